@@ -0,0 +1,54 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "arrival.h"
+#include "helpers.h"
+
+/* Sleeping overshoots by tens of microseconds, so the end of a wait is spent spinning */
+#define ARRIVAL_SPIN_NS 50000
+
+static double arrival_gap(struct Arrivals *a) {
+    if (a->process == ARRIVAL_FIXED) {
+        return a->gap_ns;
+    }
+    return -log(1.0 - erand48(a->seed)) * a->gap_ns;
+}
+
+/* Schedule [rate] requests per second, the first of them one gap after [start] */
+void arrivals_init(struct Arrivals *a, double rate, enum ArrivalProcess process, uint64_t start, unsigned int seed) {
+    a->gap_ns = NS_PER_SEC / rate;
+    a->process = process;
+    a->seed[0] = 0x330e;
+    a->seed[1] = (unsigned short) seed;
+    a->seed[2] = (unsigned short) (seed >> 16);
+    a->next = start + (uint64_t) arrival_gap(a);
+}
+
+/* Arrival time of the next request; the one after it is scheduled */
+uint64_t arrivals_next(struct Arrivals *a) {
+    uint64_t t = a->next;
+    a->next += (uint64_t) arrival_gap(a);
+    return t;
+}
+
+/* Return at CLOCK_MONOTONIC [time], or right away if it has passed; returns the time it returned */
+uint64_t arrival_wait(uint64_t time) {
+    uint64_t now = monotonic_ns();
+    if (now >= time) {
+        return now;
+    }
+    if (time > now + ARRIVAL_SPIN_NS) {
+        uint64_t wake = time - ARRIVAL_SPIN_NS;
+        struct timespec ts = { .tv_sec = wake / NS_PER_SEC, .tv_nsec = wake % NS_PER_SEC };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+    }
+    while ((now = monotonic_ns()) < time) {
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+    return now;
+}
@@ -0,0 +1,39 @@
+#ifndef _ARRIVAL_H_
+#define _ARRIVAL_H_
+
+#include <stdint.h>
+
+/*
+ * Open-loop request arrivals
+ *
+ * By default a worker sends its next request as soon as the previous one completes,
+ * so a slow request delays the ones behind it without that delay being measured
+ * (coordinated omission). With `get --rate`, requests instead arrive on a schedule
+ * fixed in advance, and their latency is measured from their arrival time. A worker
+ * that falls behind sends the requests that are due at once, and the time they
+ * waited counts towards their latency. Each worker follows its own schedule at its
+ * share of the rate.
+ */
+enum ArrivalProcess {
+    /* Exponentially distributed gaps */
+    ARRIVAL_POISSON,
+    /* Evenly spaced requests */
+    ARRIVAL_FIXED,
+};
+
+struct Arrivals {
+    /* Arrival time of the next request, in CLOCK_MONOTONIC ns */
+    uint64_t next;
+    /* Mean gap between arrivals */
+    double gap_ns;
+    enum ArrivalProcess process;
+    unsigned short seed[3];
+};
+
+void arrivals_init(struct Arrivals *a, double rate, enum ArrivalProcess process, uint64_t start, unsigned int seed);
+
+uint64_t arrivals_next(struct Arrivals *a);
+
+uint64_t arrival_wait(uint64_t time);
+
+#endif /* _ARRIVAL_H_ */
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "blkcache.h"
+
+struct BlockCache *node_cache;
+struct BlockCache *value_cache;
+
+#define NO_SLOT (-1)
+
+struct CacheSlot {
+    ptr__t offset;
+    /* Next slot in the same hash bucket */
+    int next;
+    /* CLOCK reference bit */
+    unsigned char ref;
+};
+
+struct CacheShard {
+    pthread_mutex_t lock;
+    struct CacheSlot *slots;
+    char *data;
+    int *buckets;
+    size_t n_buckets;
+    size_t capacity;
+    size_t used;
+    size_t hand;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} __attribute__((aligned(64)));
+
+struct BlockCache {
+    size_t n_shards;
+    struct CacheShard *shards;
+    /* Number of block_cache_update calls; read-through fills racing with one are dropped */
+    size_t updates;
+};
+
+static inline size_t hash_offset(ptr__t offset) {
+    return (size_t) ((offset >> BLK_SIZE_LOG) * 0x9E3779B97F4A7C15ul);
+}
+
+static inline struct CacheShard *shard_of(struct BlockCache *bc, size_t hash) {
+    return &bc->shards[(hash >> 58) & (bc->n_shards - 1)];
+}
+
+static inline int *bucket_of(struct CacheShard *sh, size_t hash) {
+    return &sh->buckets[hash & (sh->n_buckets - 1)];
+}
+
+/* Returns the slot holding [offset], or NO_SLOT. Caller holds the shard lock. */
+static int find_slot(struct CacheShard *sh, size_t hash, ptr__t offset) {
+    int s = *bucket_of(sh, hash);
+    while (s != NO_SLOT && sh->slots[s].offset != offset) {
+        s = sh->slots[s].next;
+    }
+    return s;
+}
+
+static void unlink_slot(struct CacheShard *sh, int slot) {
+    int *link = bucket_of(sh, hash_offset(sh->slots[slot].offset));
+    while (*link != slot) {
+        link = &sh->slots[*link].next;
+    }
+    *link = sh->slots[slot].next;
+}
+
+/* Pick a free slot, or evict one with CLOCK. Caller holds the shard lock. */
+static int claim_slot(struct CacheShard *sh) {
+    if (sh->used < sh->capacity) {
+        return (int) sh->used++;
+    }
+    while (sh->slots[sh->hand].ref) {
+        sh->slots[sh->hand].ref = 0;
+        sh->hand = (sh->hand + 1) % sh->capacity;
+    }
+    int victim = (int) sh->hand;
+    sh->hand = (sh->hand + 1) % sh->capacity;
+    unlink_slot(sh, victim);
+    sh->evictions++;
+    return victim;
+}
+
+/**
+ * Create a cache holding at most [budget] bytes of blocks
+ * @return the cache, or NULL if [budget] is too small to hold a single block
+ */
+struct BlockCache *block_cache_new(size_t budget) {
+    size_t n_blocks = budget / BLK_SIZE;
+    if (n_blocks == 0) {
+        return NULL;
+    }
+
+    struct BlockCache *bc = malloc(sizeof(struct BlockCache));
+    if (bc == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    bc->n_shards = n_blocks < BLOCK_CACHE_SHARDS ? 1 : BLOCK_CACHE_SHARDS;
+    bc->updates = 0;
+    if (posix_memalign((void **) &bc->shards, 64, bc->n_shards * sizeof(struct CacheShard))) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < bc->n_shards; ++i) {
+        struct CacheShard *sh = &bc->shards[i];
+        memset(sh, 0, sizeof(*sh));
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->capacity = n_blocks / bc->n_shards;
+        sh->n_buckets = 1;
+        while (sh->n_buckets < sh->capacity) {
+            sh->n_buckets <<= 1;
+        }
+        sh->slots = calloc(sh->capacity, sizeof(struct CacheSlot));
+        sh->buckets = malloc(sh->n_buckets * sizeof(int));
+        if (sh->slots == NULL || sh->buckets == NULL
+            || posix_memalign((void **) &sh->data, BLK_SIZE, sh->capacity * BLK_SIZE)) {
+            perror("failed to allocate block cache");
+            exit(1);
+        }
+        for (size_t j = 0; j < sh->n_buckets; ++j) {
+            sh->buckets[j] = NO_SLOT;
+        }
+    }
+    return bc;
+}
+
+void block_cache_free(struct BlockCache *bc) {
+    if (bc == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < bc->n_shards; ++i) {
+        struct CacheShard *sh = &bc->shards[i];
+        pthread_mutex_destroy(&sh->lock);
+        free(sh->slots);
+        free(sh->buckets);
+        free(sh->data);
+    }
+    free(bc->shards);
+    free(bc);
+}
+
+/**
+ * Copy the block at [offset] to [dst] if it is cached
+ * @return 1 on a hit, 0 on a miss
+ */
+int block_cache_lookup(struct BlockCache *bc, ptr__t offset, void *dst) {
+    size_t hash = hash_offset(offset);
+    struct CacheShard *sh = shard_of(bc, hash);
+
+    pthread_mutex_lock(&sh->lock);
+    int s = find_slot(sh, hash, offset);
+    if (s == NO_SLOT) {
+        sh->misses++;
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    sh->slots[s].ref = 1;
+    memcpy(dst, sh->data + (size_t) s * BLK_SIZE, BLK_SIZE);
+    sh->hits++;
+    pthread_mutex_unlock(&sh->lock);
+    return 1;
+}
+
+/* Copy [src] into the slot of [offset], claiming one if it is not cached. Caller holds the shard lock. */
+static void store_block(struct CacheShard *sh, size_t hash, ptr__t offset, void const *src) {
+    int s = find_slot(sh, hash, offset);
+    if (s == NO_SLOT) {
+        s = claim_slot(sh);
+        sh->slots[s].offset = offset;
+        sh->slots[s].ref = 0;
+        int *bucket = bucket_of(sh, hash);
+        sh->slots[s].next = *bucket;
+        *bucket = s;
+    }
+    memcpy(sh->data + (size_t) s * BLK_SIZE, src, BLK_SIZE);
+}
+
+/* Add (or refresh) the block at [offset] */
+void block_cache_insert(struct BlockCache *bc, ptr__t offset, void const *src) {
+    size_t hash = hash_offset(offset);
+    struct CacheShard *sh = shard_of(bc, hash);
+
+    pthread_mutex_lock(&sh->lock);
+    store_block(sh, hash, offset, src);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * Refresh the cached copy of the block at [offset] after it was written with [src].
+ * Blocks that are not cached stay uncached.
+ *
+ * A reader may have read the old block from the file before the write and insert it
+ * after this call; bumping [updates] under the shard lock makes that fill drop out.
+ */
+void block_cache_update(struct BlockCache *bc, ptr__t offset, void const *src) {
+    size_t hash = hash_offset(offset);
+    struct CacheShard *sh = shard_of(bc, hash);
+
+    pthread_mutex_lock(&sh->lock);
+    __atomic_add_fetch(&bc->updates, 1, __ATOMIC_SEQ_CST);
+    int s = find_slot(sh, hash, offset);
+    if (s != NO_SLOT) {
+        memcpy(sh->data + (size_t) s * BLK_SIZE, src, BLK_SIZE);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Insert a block read from the file, unless a block was updated since [updates] was sampled */
+static void fill_block(struct BlockCache *bc, ptr__t offset, void const *src, size_t updates) {
+    size_t hash = hash_offset(offset);
+    struct CacheShard *sh = shard_of(bc, hash);
+
+    pthread_mutex_lock(&sh->lock);
+    if (__atomic_load_n(&bc->updates, __ATOMIC_SEQ_CST) == updates) {
+        store_block(sh, hash, offset, src);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/**
+ * Read-through: read the block at [offset] from the cache, or from [fd] on a miss.
+ * [bc] may be NULL, in which case this is a plain pread.
+ *
+ * @return number of bytes read, as pread
+ */
+ssize_t block_cache_pread(struct BlockCache *bc, int fd, void *buf, ptr__t offset) {
+    if (bc == NULL) {
+        return pread(fd, buf, BLK_SIZE, (long) offset);
+    }
+    if (block_cache_lookup(bc, offset, buf)) {
+        return BLK_SIZE;
+    }
+    size_t updates = __atomic_load_n(&bc->updates, __ATOMIC_SEQ_CST);
+    ssize_t bytes_read = pread(fd, buf, BLK_SIZE, (long) offset);
+    if (bytes_read == BLK_SIZE) {
+        fill_block(bc, offset, buf, updates);
+    }
+    return bytes_read;
+}
+
+/* Like [block_cache_pread], but terminates the program if the read fails */
+void checked_block_cache_pread(struct BlockCache *bc, int fd, void *buf, ptr__t offset) {
+    ssize_t bytes_read = block_cache_pread(bc, fd, buf, offset);
+    if (bytes_read < 0) {
+        perror("checked_block_cache_pread: ");
+        exit(1);
+    }
+    if (bytes_read != BLK_SIZE) {
+        fprintf(stderr, "partial read %ld bytes of block at %lu\n", bytes_read, offset);
+        exit(1);
+    }
+}
+
+void block_cache_get_stats(struct BlockCache *bc, struct BlockCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < bc->n_shards; ++i) {
+        struct CacheShard *sh = &bc->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        stats->hits += sh->hits;
+        stats->misses += sh->misses;
+        stats->evictions += sh->evictions;
+        stats->capacity += sh->capacity;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void block_cache_print_stats(struct BlockCache *bc, char const *name) {
+    if (bc == NULL) {
+        return;
+    }
+    struct BlockCacheStats st;
+    block_cache_get_stats(bc, &st);
+    size_t total = st.hits + st.misses;
+    printf("%s cache: %lu blocks, %lu hits, %lu misses, %lu evictions, hit rate %.2f%%\n",
+           name, st.capacity, st.hits, st.misses, st.evictions,
+           total ? 100.0 * (double) st.hits / (double) total : 0.0);
+}
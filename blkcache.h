@@ -0,0 +1,50 @@
+#ifndef _BLKCACHE_H_
+#define _BLKCACHE_H_
+
+#include <sys/types.h>
+
+#include "db_types.h"
+
+/*
+ * Concurrent cache of BLK_SIZE blocks keyed by file offset
+ *
+ * The cache is split into shards, each protected by its own lock. Blocks are
+ * evicted with the CLOCK algorithm once the byte budget is used up. Lookups copy
+ * the block out, so callers never hold references into the cache.
+ */
+#define BLOCK_CACHE_SHARDS 64
+
+struct BlockCache;
+
+struct BlockCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t capacity;
+};
+
+/* Cache for index and leaf nodes, NULL if disabled */
+extern struct BlockCache *node_cache;
+
+/* Cache for value heap blocks, NULL if disabled */
+extern struct BlockCache *value_cache;
+
+struct BlockCache *block_cache_new(size_t budget);
+
+void block_cache_free(struct BlockCache *bc);
+
+int block_cache_lookup(struct BlockCache *bc, ptr__t offset, void *dst);
+
+void block_cache_insert(struct BlockCache *bc, ptr__t offset, void const *src);
+
+void block_cache_update(struct BlockCache *bc, ptr__t offset, void const *src);
+
+ssize_t block_cache_pread(struct BlockCache *bc, int fd, void *buf, ptr__t offset);
+
+void checked_block_cache_pread(struct BlockCache *bc, int fd, void *buf, ptr__t offset);
+
+void block_cache_get_stats(struct BlockCache *bc, struct BlockCacheStats *stats);
+
+void block_cache_print_stats(struct BlockCache *bc, char const *name);
+
+#endif /* _BLKCACHE_H_ */
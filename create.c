@@ -1,131 +1,743 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <liburing.h>
 
 #include "create.h"
 #include "parse.h"
 #include "db_types.h"
 #include "simplekv.h"
+#include "helpers.h"
 
+/* Bytes of the file each loader thread generates and writes at once */
+#define LOAD_CHUNK (4 << 20)
+#define CHUNK_BLOCKS (LOAD_CHUNK / BLK_SIZE)
+
+/*
+Disk layout:
+The first block is the superblock (see superblock.h), which describes the rest of the file.
+It is followed by B+ tree nodes, each one block (BLK_SIZE) with up to NODE_CAPACITY keys and NODE_CAPACITY
+associated block offsets to other nodes (31 with 512 byte blocks, 255 with 4 KiB blocks)
+Nodes are written by level in order, so, the root is first, followed by all nodes on the second level.
+Since each node has pointers to NODE_CAPACITY other nodes, fanout is NODE_CAPACITY
+| SB | 0  - 1  2  3  4 ... 31 - .... | ### LOG DATA ### |
+
+Leaf nodes have pointers into the log data, which is appended as a "heap" in the same file
+at the end of the B+tree. Once we reach a leaf node, we scan through its keys and if one matches
+the key we need, we read the offset into the heap and can retrieve the value. Generated values
+all have the same size, so each heap block holds the same number of records (or each record
+the same number of blocks).
+
+With --packed-leaves, leaves are PackedLeaf blocks of up to PACKED_CAPACITY keys instead.
+
+Every node holds the same number of keys (the fill factor of its capacity), except the last
+node of each level, which holds what is left. The contents of every block follow from its
+position alone, so the file is split into chunks of LOAD_CHUNK bytes that the loader threads
+generate and write independently.
+*/
+struct Loader {
+    int db;
+    size_t layer_num;
+    /* Block of the first node of each level, and of the value heap */
+    size_t *level_begin;
+    size_t heap_begin;
+    /* Number of keys below one node of each level */
+    size_t *span;
+    /* Keys per leaf and children per internal node */
+    size_t leaf_keys;
+    size_t fanout;
+    size_t n_keys;
+    /* Leaves are written as PackedLeaf */
+    int packed;
+    /* Values are generated from the keys rather than loaded */
+    int generated;
+    /* Length of generated values; records per heap block, or blocks per record if larger */
+    unsigned int value_size;
+    size_t block_records;
+    size_t record_blocks;
+    size_t heap_blocks;
+    size_t n_chunks;
+    size_t next_chunk;
+};
 
 int do_create_cmd(int argc, char *argv[], struct ArgState *as) {
-    parse_create_opts(argc, argv);
-    return load(as->layers, as->filename);
+    struct CreateArgs ca = { .fill_factor = 1.0 };
+    ca.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    parse_create_opts(argc, argv, &ca);
+    return load(as->layers, as->filename, &ca);
 }
 
-/* Create a new database on disk at [db_path] with [layer_num] layers */
-int load(size_t layer_num, char *db_path) {
-    printf("Load the database of %lu layers\n", layer_num);
-    int db = initialize(layer_num, LOAD_MODE, db_path);
-    int const MB = (1<<20);
+/* Number of keys in the [j]th node of [level] */
+static unsigned int node_entries(struct Loader const *ld, size_t level, size_t j) {
+    int leaf = level == ld->layer_num - 1;
+    size_t per_node = leaf ? ld->leaf_keys : ld->fanout;
+    /* Entries of the next level (or keys) left for this node */
+    size_t left = (leaf ? ld->n_keys : layer_cap[level + 1]) - j * per_node;
+    return (unsigned int) (left < per_node ? left : per_node);
+}
 
-    // 1. Load the index
-    Node * const node_begin;
-    int node_entries = (MB * 10) / sizeof(Node);
-    if (posix_memalign((void **)&node_begin, 512, node_entries * sizeof(Node))) {
-        perror("posix_memalign failed");
-        close(db);
-        free_globals();
+/* Offset of the record of the [m]th generated value */
+static ptr__t record_offset(struct Loader const *ld, size_t m) {
+    ptr__t heap = ld->heap_begin * BLK_SIZE;
+    if (ld->record_blocks > 1) {
+        return heap + m * ld->record_blocks * BLK_SIZE;
+    }
+    return heap + m / ld->block_records * BLK_SIZE + m % ld->block_records * value_record_size(ld->value_size);
+}
+
+/* Write the record of the [m]th generated value to [rec] */
+static void fill_record(struct Loader const *ld, unsigned char *rec, size_t m) {
+    set_value_header(rec, ld->value_size);
+    format_value((char *) rec + VAL_HDR_SIZE, m, ld->value_size);
+}
+
+/**
+ * Make [node] a packed leaf with the [n] entries [key], [ptr], whose values are in key
+ * order in the heap. Leaves the next pointer to the caller.
+ * @return 0 on success, -1 if the keys or value offsets are too far apart to pack
+ */
+static int pack_leaf(Node *node, key__t const *key, ptr__t const *ptr, unsigned int n) {
+    PackedLeaf *leaf = (PackedLeaf *) node;
+    memset(leaf, 0, sizeof(Node));
+    leaf->type = make_node_type(LEAF | NODE_PACKED, n);
+    leaf->key_base = key[0];
+    leaf->ptr_base = decode(ptr[0]);
+    for (unsigned int k = 0; k < n; k++) {
+        key__t key_delta = key[k] - leaf->key_base;
+        ptr__t ptr_delta = decode(ptr[k]) - leaf->ptr_base;
+        if (key_delta >= KEY_DELTA_PAD || decode(ptr[k]) < leaf->ptr_base || ptr_delta > 0xffffffffu) {
+            return -1;
+        }
+        leaf->key_delta[k] = (unsigned int) key_delta;
+        leaf->ptr_delta[k] = (unsigned int) ptr_delta;
+        leaf->value_len[k] = (unsigned short) value_len(ptr[k]);
+    }
+    for (unsigned int k = n; k < PACKED_CAPACITY; k++) {
+        leaf->key_delta[k] = KEY_DELTA_PAD;
+    }
+    return 0;
+}
+
+/* Fill [node], the [j]th node of [level] and the [n]th node of the file */
+static void fill_node(Node *node, struct Loader const *ld, size_t level, size_t j, size_t n) {
+    int leaf = level == ld->layer_num - 1;
+    size_t per_node = leaf ? ld->leaf_keys : ld->fanout;
+    unsigned int nkeys = node_entries(ld, level, j);
+    /* Pointer to the next node in this level, used for efficient scans; 0 for the last one */
+    meta__t next = j == layer_cap[level] - 1 ? 0 : (n + 1) * sizeof(Node);
+
+    if (leaf && ld->packed) {
+        key__t key[PACKED_CAPACITY];
+        ptr__t ptr[PACKED_CAPACITY];
+        for (size_t k = 0; k < nkeys; k++) {
+            key[k] = j * per_node + k;
+            ptr[k] = encode_value(record_offset(ld, key[k]), ld->value_size);
+        }
+        /* Generated keys are consecutive and their values a few MB apart at most */
+        BUG_ON(pack_leaf(node, key, ptr, nkeys) != 0);
+        node->next = next;
+        return;
+    }
+
+    node->type = make_node_type(leaf ? LEAF : INTERNAL, nkeys);
+    node->next = next;
+    for (size_t k = 0; k < nkeys; k++) {
+        /* Index of the child (or key) within the next level */
+        size_t m = j * per_node + k;
+        if (leaf) {
+            node->key[k] = m;
+            node->ptr[k] = encode_value(record_offset(ld, m), ld->value_size);
+        } else {
+            node->key[k] = m * ld->span[level + 1];
+            node->ptr[k] = encode((ld->level_begin[level + 1] + m) * BLK_SIZE);
+        }
+    }
+    for (size_t k = nkeys; k < NODE_CAPACITY; k++) {
+        node->key[k] = KEY_PAD;
+        node->ptr[k] = 0;
+    }
+}
+
+/* Generate blocks [begin, end) of the file into [buf] */
+static void fill_blocks(struct Loader const *ld, char *buf, size_t begin, size_t end) {
+    size_t b = begin;
+    size_t level = 0;
+    while (level + 1 < ld->layer_num && ld->level_begin[level + 1] <= b) {
+        level++;
+    }
+    for (; b < end && b < ld->level_begin[0]; ++b, buf += BLK_SIZE) {
+        /* The superblock is written once the rest of the file is */
+        memset(buf, 0, BLK_SIZE);
+    }
+    for (; b < end && b < ld->heap_begin; ++b, buf += BLK_SIZE) {
+        if (level + 1 < ld->layer_num && ld->level_begin[level + 1] == b) {
+            level++;
+        }
+        fill_node((Node *) buf, ld, level, b - ld->level_begin[level], b);
+    }
+    unsigned char rec[VAL_HDR_SIZE + MAX_VAL_LEN];
+    size_t const size = value_record_size(ld->value_size);
+    for (; b < end; ++b, buf += BLK_SIZE) {
+        size_t h = b - ld->heap_begin;
+        memset(buf, 0, BLK_SIZE);
+        if (ld->record_blocks > 1) {
+            /* Part [h % record_blocks] of a record spanning several blocks */
+            size_t part = h % ld->record_blocks * BLK_SIZE;
+            if (part < size) {
+                fill_record(ld, rec, h / ld->record_blocks);
+                memcpy(buf, rec + part, size - part < BLK_SIZE ? size - part : BLK_SIZE);
+            }
+            continue;
+        }
+        for (size_t j = 0; j < ld->block_records && h * ld->block_records + j < ld->n_keys; j++) {
+            fill_record(ld, (unsigned char *) buf + j * size, h * ld->block_records + j);
+        }
+    }
+}
+
+static void check_write(ssize_t bytes_written, size_t size) {
+    if (bytes_written < 0) {
+        fprintf(stderr, "failure: write of database failed: %s\n", strerror((int) -bytes_written));
+        exit(1);
+    }
+    if ((size_t) bytes_written != size) {
+        fprintf(stderr, "failure: partial write of database\n");
         exit(1);
     }
-    /*
-    Disk layout:
-    B+ tree nodes, each with 31 keys and 31 associated block offsets to other nodes
-    Nodes are written by level in order, so, the root is first, followed by all nodes on the second level.
-    Since each node has pointers to 31 other nodes, fanout is 31
-    | 0  - 1  2  3  4 ... 31 - .... | ### LOG DATA ### |
-
-    Leaf nodes have pointers into the log data, which is appended as a "heap" in the same file
-    at the end of the B+tree. Once we reach a leaf node, we scan through its keys and if one matches
-    the key we need, we read the offset into the heap and can retrieve the value.
-    */
-    ptr__t next_pos = 1;
-    long next_node_offset = 1;
-    Node *node = node_begin;
-    Node * const node_buf_end = node_begin + node_entries;
+}
+
+/* Wait for the write in flight on [ring] */
+static void wait_write(struct io_uring *ring, size_t size) {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(ring, &cqe);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_wait_cqe failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    int res = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+    check_write(res, size);
+}
+
+/*
+ * Loader thread: claims chunks until none are left. The next chunk is generated
+ * while the write of the previous one is still in flight.
+ */
+static void *load_worker(void *arg) {
+    struct Loader *ld = (struct Loader *) arg;
+    size_t const total_blocks = ld->heap_begin + ld->heap_blocks;
+
+    char *buf[2];
+    for (int i = 0; i < 2; ++i) {
+        if (posix_memalign((void **) &buf[i], BLK_SIZE, LOAD_CHUNK)) {
+            perror("posix_memalign failed");
+            exit(1);
+        }
+    }
+    struct io_uring ring;
+    int async = io_uring_queue_init(2, &ring, 0) == 0;
+    size_t in_flight = 0;
+    int cur = 0;
+
+    for (;;) {
+        size_t chunk = __atomic_fetch_add(&ld->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= ld->n_chunks) {
+            break;
+        }
+        size_t begin = chunk * CHUNK_BLOCKS;
+        size_t end = begin + CHUNK_BLOCKS < total_blocks ? begin + CHUNK_BLOCKS : total_blocks;
+        size_t size = (end - begin) * BLK_SIZE;
+        fill_blocks(ld, buf[cur], begin, end);
+
+        if (!async) {
+            check_write(pwrite(ld->db, buf[cur], size, (long) (begin * BLK_SIZE)), size);
+            continue;
+        }
+        if (in_flight) {
+            wait_write(&ring, in_flight);
+        }
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_write(sqe, ld->db, buf[cur], size, begin * BLK_SIZE);
+        if (io_uring_submit(&ring) < 1) {
+            fprintf(stderr, "io_uring_submit failed\n");
+            exit(1);
+        }
+        in_flight = size;
+        cur = !cur;
+    }
+
+    if (async) {
+        if (in_flight) {
+            wait_write(&ring, in_flight);
+        }
+        io_uring_queue_exit(&ring);
+    }
+    free(buf[0]);
+    free(buf[1]);
+    return NULL;
+}
+
+/* Keys per node of [capacity] keys for [fill_factor], but at least [min] */
+static size_t keys_per_node(double fill_factor, size_t min, size_t capacity) {
+    size_t n = (size_t) (fill_factor * capacity + 0.5);
+    return n < min ? min : n > capacity ? capacity : n;
+}
+
+/* Lay out a tree of [layer_num] levels for [n_keys] keys (0 to fill all levels) in [ld] and [layer_cap] */
+static void plan_tree(struct Loader *ld, size_t layer_num, double fill_factor, size_t n_keys, unsigned int value_size,
+                      int packed) {
+    ld->layer_num = layer_num;
+    ld->packed = packed;
+    ld->leaf_keys = keys_per_node(fill_factor, 1, ld->packed ? PACKED_CAPACITY : NODE_CAPACITY);
+    /* Internal nodes need two children, or the tree would never get narrower */
+    ld->fanout = keys_per_node(fill_factor, 2, NODE_CAPACITY);
+    ld->level_begin = malloc(layer_num * sizeof(size_t));
+    ld->span = malloc(layer_num * sizeof(size_t));
+    layer_cap = malloc(layer_num * sizeof(size_t));
+    if (ld->level_begin == NULL || ld->span == NULL || layer_cap == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* Size the levels bottom-up; by default fill all [layer_num] levels */
+    ld->span[layer_num - 1] = ld->leaf_keys;
+    for (size_t i = layer_num - 1; i > 0; i--) {
+        ld->span[i - 1] = ld->span[i] * ld->fanout;
+    }
+    ld->n_keys = n_keys ? n_keys : ld->span[0];
+    layer_cap[layer_num - 1] = (ld->n_keys + ld->leaf_keys - 1) / ld->leaf_keys;
+    for (size_t i = layer_num - 1; i > 0; i--) {
+        layer_cap[i - 1] = (layer_cap[i] + ld->fanout - 1) / ld->fanout;
+    }
+    if (layer_cap[0] != 1 || (layer_num > 1 && layer_cap[1] == 1)) {
+        size_t needed = 1;
+        for (size_t n = layer_cap[layer_num - 1]; n > 1; n = (n + ld->fanout - 1) / ld->fanout) {
+            needed++;
+        }
+        fprintf(stderr, "%lu keys with %lu keys per leaf and %lu children per node need %lu layers, not %lu\n",
+                ld->n_keys, ld->leaf_keys, ld->fanout, needed, layer_num);
+        exit(1);
+    }
+
+    /* The index starts with the root, right after the superblock, and the value heap follows it */
+    total_node = 0;
     for (size_t i = 0; i < layer_num; i++) {
-        size_t extent = max_key / layer_cap[i], start_key = 0;
-        printf("layer %lu extent %lu\n", i, extent);
-        for (size_t j = 0; j < layer_cap[i]; ++j, ++next_node_offset) {
-            node->type = (i == layer_num - 1) ? LEAF : INTERNAL;
-            size_t sub_extent = extent / NODE_CAPACITY;
-            if (j == layer_cap[i] - 1) {
-                /* Last node in this level */
-                node->next = 0;
-            } else {
-                /* Pointer to the next node in this level; used for efficient scans */
-                node->next = next_node_offset * sizeof(Node);
-            }
-            for (size_t k = 0; k < NODE_CAPACITY; k++) {
-                node->key[k] = start_key + k * sub_extent;
-                node->ptr[k] = node->type == INTERNAL ?
-                               encode(next_pos   * BLK_SIZE) :
-                               encode(total_node * BLK_SIZE + (next_pos - total_node) * VAL_SIZE);
-                next_pos++;
-            }
+        ld->level_begin[i] = ROOT_NODE_OFFSET / BLK_SIZE + total_node;
+        total_node += layer_cap[i];
+        printf("layer %lu nodes %lu extent %lu\n", i, layer_cap[i], ld->span[i]);
+    }
+    ld->heap_begin = ld->level_begin[0] + total_node;
+    ld->value_size = value_size;
+    size_t size = value_record_size(value_size);
+    ld->block_records = size <= BLK_SIZE ? BLK_SIZE / size : 1;
+    ld->record_blocks = (size + BLK_SIZE - 1) / BLK_SIZE;
+    ld->heap_blocks = ld->record_blocks > 1 ? ld->n_keys * ld->record_blocks
+                                            : (ld->n_keys + ld->block_records - 1) / ld->block_records;
+}
 
-            node += 1;
-            if (node == node_buf_end) {
-                ssize_t write_size = node_entries * sizeof(Node);
-                ssize_t bytes_written = write(db, node_begin, write_size);
-                if (bytes_written != write_size) {
-                    fprintf(stderr, "failure: partial write of index node\n");
-                    exit(1);
-                }
-                node = node_begin;
-            }
-            start_key += extent;
+/* Allocate [blocks] blocks for the database up front */
+static void preallocate(int db, size_t blocks) {
+    if (fallocate(db, 0, 0, (off_t) (blocks * BLK_SIZE)) < 0) {
+        if (ftruncate(db, (off_t) (blocks * BLK_SIZE)) < 0) {
+            perror("ftruncate");
+            exit(1);
         }
     }
-    /* Write any remaining node buffer */
-    if (node > node_begin) {
-        ssize_t write_size = (node - node_begin) * sizeof(Node);
-        ssize_t bytes_written = write(db, node_begin, write_size);
-        if (bytes_written != write_size) {
-            fprintf(stderr, "failure: partial write of index node\n");
+}
+
+/* Write the superblock of the new database [db], once everything it describes is on disk */
+static void write_superblock(int db, struct Loader const *ld) {
+    if (fdatasync(db) != 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+    superblock_init(&superblock, ld->layer_num, ld->n_keys, ld->heap_begin * BLK_SIZE);
+    if (ld->packed) {
+        superblock.flags |= SB_PACKED_LEAVES;
+    }
+    if (ld->generated) {
+        superblock.flags |= SB_GENERATED_VALUES;
+    }
+    superblock_write(db, &superblock);
+}
+
+/*
+ * Loading from a file of sorted key/value records
+ *
+ * The input is either CSV, one "key,value" line per record with the value as text
+ * of up to MAX_VAL_LEN bytes, or binary, records of a native-endian key__t followed
+ * by a val__t. It is mapped and read twice: once to count and check the records and
+ * size the heap, which fixes the layout of the file, and once to write it. The
+ * second pass builds the tree bottom-up and keeps only the open node of every level
+ * in memory; a node is written as soon as it has all its entries and then adds
+ * itself to its parent. Value records are packed into the heap as by the write path.
+ */
+struct KVSource {
+    char const *path;
+    char const *data;
+    size_t size;
+    size_t pos;
+    int csv;
+    size_t record;
+};
+
+/* Buffered writer for a sequential region of the file */
+struct SeqWriter {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t len;
+    off_t offset;
+};
+
+/* Number of bytes buffered for each level of the index and for the heap */
+#define LEVEL_BUF (256 << 10)
+#define HEAP_BUF (4 << 20)
+
+static void open_source(struct KVSource *src, char const *path, int csv) {
+    memset(src, 0, sizeof(*src));
+    src->path = path;
+    src->csv = csv;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        exit(1);
+    }
+    src->size = (size_t) st.st_size;
+    if (src->size > 0) {
+        src->data = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src->data == MAP_FAILED) {
+            perror("mmap");
             exit(1);
         }
+        madvise((void *) src->data, src->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (!csv && src->size % (sizeof(key__t) + sizeof(val__t)) != 0) {
+        fprintf(stderr, "%s: size is not a multiple of the %lu byte record size\n", path,
+                sizeof(key__t) + sizeof(val__t));
+        exit(1);
+    }
+}
+
+static void close_source(struct KVSource *src) {
+    if (src->size > 0) {
+        munmap((void *) src->data, src->size);
+    }
+}
+
+static void rewind_source(struct KVSource *src) {
+    src->pos = 0;
+    src->record = 0;
+}
+
+/* Exit with an error about the last record read from [src] */
+static void bad_record(struct KVSource const *src, char const *msg) {
+    fprintf(stderr, "%s: record %lu: %s\n", src->path, src->record, msg);
+    exit(1);
+}
+
+/**
+ * Read the next record of [src] into [key], [value] and [len]
+ * @return 1 if a record was read, 0 at the end of the input
+ */
+static int next_record(struct KVSource *src, key__t *key, unsigned char *value, unsigned int *len) {
+    if (!src->csv) {
+        if (src->pos == src->size) {
+            return 0;
+        }
+        memcpy(key, src->data + src->pos, sizeof(key__t));
+        memcpy(value, src->data + src->pos + sizeof(key__t), sizeof(val__t));
+        *len = sizeof(val__t);
+        src->pos += sizeof(key__t) + sizeof(val__t);
+        src->record++;
+        return 1;
+    }
+
+    /* Skip empty lines */
+    while (src->pos < src->size && (src->data[src->pos] == '\n' || src->data[src->pos] == '\r')) {
+        src->pos++;
+    }
+    if (src->pos == src->size) {
+        return 0;
+    }
+    src->record++;
+    char const *line = src->data + src->pos;
+    char const *end = memchr(line, '\n', src->size - src->pos);
+    if (end == NULL) {
+        end = src->data + src->size;
     }
-    free(node_begin);
+    src->pos = (size_t) (end - src->data);
 
-    // 2. Load the value log
-    Log * const log_begin;
-    int const log_entries = (MB * 10) / sizeof(Log);
-    if (posix_memalign((void **)&log_begin, 512, log_entries * sizeof(Log))) {
+    char const *p = line;
+    key__t k = 0;
+    if (p == end || *p < '0' || *p > '9') {
+        bad_record(src, "expected a key");
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+        if (k > (KEY_PAD - 1 - (key__t) (*p - '0')) / 10) {
+            bad_record(src, "key out of range");
+        }
+        k = k * 10 + (key__t) (*p - '0');
+    }
+    if (p == end || *p != ',') {
+        bad_record(src, "expected a comma after the key");
+    }
+    ++p;
+    if (end > p && end[-1] == '\r') {
+        --end;
+    }
+    if ((size_t) (end - p) > MAX_VAL_LEN) {
+        bad_record(src, "value longer than 4096 bytes");
+    }
+    *len = (unsigned int) (end - p);
+    memcpy(value, p, *len);
+    *key = k;
+    return 1;
+}
+
+static void seq_writer_init(struct SeqWriter *w, int fd, size_t cap, off_t offset) {
+    w->fd = fd;
+    w->cap = cap;
+    w->len = 0;
+    w->offset = offset;
+    if (posix_memalign((void **) &w->buf, BLK_SIZE, cap)) {
         perror("posix_memalign failed");
-        close(db);
-        free_globals();
         exit(1);
     }
-    printf("Writing value heap\n");
-    Log *log = log_begin;
-    Log * const log_end = log_begin + log_entries;
-    for (size_t i = 0; i < max_key; i += LOG_CAPACITY) {
-        for (size_t j = 0; j < LOG_CAPACITY; j++) {
-            sprintf((char *) log->val[j], "%63lu", i + j);
-        }
-        ++log;
-        if (log == log_end) {
-            ssize_t write_size = log_entries * sizeof(Log);
-            ssize_t bytes_written = write(db, log_begin, write_size);
-            if (bytes_written != write_size) {
-                fprintf(stderr, "failure: partial write of log data\n");
-                exit(1);
-            }
-            log = log_begin;
+}
+
+/* Write out the whole blocks in the buffer and keep the rest */
+static void seq_writer_drain(struct SeqWriter *w) {
+    size_t size = w->len & ~((size_t) BLK_SIZE - 1);
+    if (size == 0) {
+        return;
+    }
+    check_write(pwrite(w->fd, w->buf, size, w->offset), size);
+    w->offset += (off_t) size;
+    memmove(w->buf, w->buf + size, w->len - size);
+    w->len -= size;
+}
+
+/* Write out the buffer, padded with zeros to whole blocks for O_DIRECT */
+static void seq_writer_flush(struct SeqWriter *w) {
+    if (w->len == 0) {
+        return;
+    }
+    size_t size = (w->len + BLK_SIZE - 1) & ~((size_t) BLK_SIZE - 1);
+    memset(w->buf + w->len, 0, size - w->len);
+    check_write(pwrite(w->fd, w->buf, size, w->offset), size);
+    w->offset += (off_t) size;
+    w->len = 0;
+}
+
+/* Append [size] bytes of [data], or zeros if [data] is NULL; [size] must leave a block of the buffer free */
+static void seq_writer_append(struct SeqWriter *w, void const *data, size_t size) {
+    if (w->len + size > w->cap) {
+        seq_writer_drain(w);
+    }
+    if (data != NULL) {
+        memcpy(w->buf + w->len, data, size);
+    } else {
+        memset(w->buf + w->len, 0, size);
+    }
+    w->len += size;
+}
+
+static void seq_writer_free(struct SeqWriter *w) {
+    seq_writer_flush(w);
+    free(w->buf);
+}
+
+struct StreamBuild {
+    struct Loader const *ld;
+    /* Open node, number of entries in it and its index within the level, per level */
+    Node *open;
+    unsigned int *fill;
+    size_t *index;
+    struct SeqWriter *levels;
+    /* Entries of the open leaf, when leaves are packed */
+    key__t packed_key[PACKED_CAPACITY];
+    ptr__t packed_ptr[PACKED_CAPACITY];
+};
+
+/* Add an entry to the open node of [level]; writes the node out once it is complete */
+static void stream_add(struct StreamBuild *sb, size_t level, key__t key, ptr__t ptr) {
+    struct Loader const *ld = sb->ld;
+    Node *node = &sb->open[level];
+    size_t j = sb->index[level];
+    unsigned int nkeys = node_entries(ld, level, j);
+    int leaf = level == ld->layer_num - 1;
+    int packed = leaf && ld->packed;
+
+    key__t *keys = packed ? sb->packed_key : node->key;
+    ptr__t *ptrs = packed ? sb->packed_ptr : node->ptr;
+    keys[sb->fill[level]] = key;
+    ptrs[sb->fill[level]] = ptr;
+    if (++sb->fill[level] < nkeys) {
+        return;
+    }
+
+    size_t n = ld->level_begin[level] + j;
+    key__t first = keys[0];
+    if (packed) {
+        if (pack_leaf(node, keys, ptrs, nkeys) != 0) {
+            fprintf(stderr, "the keys or values of leaf %lu are too far apart to pack; "
+                            "create the database without --packed-leaves\n", j);
+            exit(1);
+        }
+    } else {
+        node->type = make_node_type(leaf ? LEAF : INTERNAL, nkeys);
+        for (size_t k = nkeys; k < NODE_CAPACITY; k++) {
+            node->key[k] = KEY_PAD;
+            node->ptr[k] = 0;
+        }
+    }
+    node->next = j == layer_cap[level] - 1 ? 0 : (n + 1) * sizeof(Node);
+    seq_writer_append(&sb->levels[level], node, sizeof(Node));
+    sb->fill[level] = 0;
+    sb->index[level]++;
+    if (level > 0) {
+        stream_add(sb, level - 1, first, encode(n * BLK_SIZE));
+    }
+}
+
+/* Guess the input format from the file name: CSV for *.csv, binary otherwise */
+static int is_csv_path(char const *path) {
+    size_t len = strlen(path);
+    return len >= 4 && strcasecmp(path + len - 4, ".csv") == 0;
+}
+
+/* Create the database at [db_path] from the sorted records in [ca->from] */
+static int load_from(size_t layer_num, char *db_path, struct CreateArgs const *ca) {
+    struct KVSource src;
+    open_source(&src, ca->from, ca->format == FORMAT_AUTO ? is_csv_path(ca->from) : ca->format == FORMAT_CSV);
+
+    /* First pass: count the records and check that the keys are sorted */
+    key__t key, prev = 0;
+    unsigned char value[VAL_HDR_SIZE + MAX_VAL_LEN];
+    unsigned int len;
+    size_t n_keys = 0;
+    ptr__t heap_end = 0;
+    while (next_record(&src, &key, value + VAL_HDR_SIZE, &len)) {
+        if (key == KEY_PAD) {
+            bad_record(&src, "key is reserved");
+        }
+        if (n_keys > 0 && key <= prev) {
+            bad_record(&src, "keys are not sorted in increasing order");
         }
+        prev = key;
+        n_keys++;
+        heap_end = value_record_start(heap_end, value_record_size(len)) + value_record_size(len);
+    }
+    if (n_keys == 0) {
+        fprintf(stderr, "%s: no records\n", ca->from);
+        exit(1);
+    }
+    printf("Loading %lu keys from %s\n", n_keys, ca->from);
+
+    struct Loader ld = { 0 };
+    plan_tree(&ld, layer_num, ca->fill_factor, n_keys, 0, ca->packed_leaves);
+    ld.heap_blocks = (heap_end + BLK_SIZE - 1) / BLK_SIZE;
+    max_key = prev + 1;
+    int db = initialize(layer_num, LOAD_MODE, db_path);
+    preallocate(db, ld.heap_begin + ld.heap_blocks);
+
+    /* Second pass: stream the values to the heap and the keys into the leaves */
+    struct StreamBuild sb = { .ld = &ld };
+    sb.open = malloc(layer_num * sizeof(Node));
+    sb.fill = calloc(layer_num, sizeof(unsigned int));
+    sb.index = calloc(layer_num, sizeof(size_t));
+    sb.levels = malloc(layer_num * sizeof(struct SeqWriter));
+    if (sb.open == NULL || sb.fill == NULL || sb.index == NULL || sb.levels == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < layer_num; i++) {
+        seq_writer_init(&sb.levels[i], db, LEVEL_BUF, (off_t) (ld.level_begin[i] * BLK_SIZE));
+    }
+    struct SeqWriter heap;
+    seq_writer_init(&heap, db, HEAP_BUF, (off_t) (ld.heap_begin * BLK_SIZE));
+
+    rewind_source(&src);
+    heap_end = 0;
+    while (next_record(&src, &key, value + VAL_HDR_SIZE, &len)) {
+        size_t size = value_record_size(len);
+        ptr__t start = value_record_start(heap_end, size);
+        seq_writer_append(&heap, NULL, start - heap_end);
+        set_value_header(value, len);
+        seq_writer_append(&heap, value, size);
+        heap_end = start + size;
+        stream_add(&sb, layer_num - 1, key, encode_value(ld.heap_begin * BLK_SIZE + start, len));
+    }
+    for (size_t i = 0; i < layer_num; i++) {
+        BUG_ON(sb.index[i] != layer_cap[i] || sb.fill[i] != 0);
+        seq_writer_free(&sb.levels[i]);
+    }
+    seq_writer_free(&heap);
+    write_superblock(db, &ld);
+
+    free(sb.open);
+    free(sb.fill);
+    free(sb.index);
+    free(sb.levels);
+    free(ld.level_begin);
+    free(ld.span);
+    close_source(&src);
+    close(db);
+    return terminate();
+}
+
+/* Create a new database on disk at [db_path] with [layer_num] layers */
+int load(size_t layer_num, char *db_path, struct CreateArgs const *ca) {
+    printf("Load the database of %lu layers\n", layer_num);
+    if (ca->from != NULL) {
+        return load_from(layer_num, db_path, ca);
     }
-    /* Write any remaining entries */
-    if (log != log_begin) {
-        ssize_t write_size = (log - log_begin) * sizeof(Log);
-        ssize_t bytes_written = write(db, log_begin, write_size);
-        if (bytes_written != write_size) {
-            fprintf(stderr, "failure: partial write of log data\n");
-            exit(2);
+
+    struct Loader ld = { 0 };
+    plan_tree(&ld, layer_num, ca->fill_factor, ca->keys, ca->value_size ? ca->value_size : DEFAULT_VAL_LEN,
+              ca->packed_leaves);
+    max_key = ld.n_keys;
+    int db = initialize(layer_num, LOAD_MODE, db_path);
+    ld.db = db;
+    ld.generated = 1;
+    size_t total_blocks = ld.heap_begin + ld.heap_blocks;
+    ld.n_chunks = (total_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+
+    /* Allocate the file up front so the threads do not serialize on extending it */
+    preallocate(db, total_blocks);
+
+    int n_threads = ca->threads > 0 ? ca->threads : 1;
+    if ((size_t) n_threads > ld.n_chunks) {
+        n_threads = (int) ld.n_chunks;
+    }
+    printf("Writing index and value heap (%lu blocks) with %d thread(s)\n", total_blocks, n_threads);
+    pthread_t tids[n_threads];
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&tids[i], NULL, load_worker, &ld) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    write_superblock(db, &ld);
 
-    free(log_begin);
+    free(ld.level_begin);
+    free(ld.span);
     close(db);
     return terminate();
 }
@@ -2,9 +2,10 @@
 #define _CREATE_H_
 
 struct ArgState;
+struct CreateArgs;
 
 int do_create_cmd(int argc, char *argv[], struct ArgState *as);
 
-int load(size_t layer_num, char *db_path);
+int load(size_t layer_num, char *db_path, struct CreateArgs const *ca);
 
 #endif /* _CREATE_H_ */
\ No newline at end of file
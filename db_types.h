@@ -12,22 +12,57 @@ typedef unsigned long ptr__t;
 #define KEY_SIZE sizeof(key__t)
 #define VAL_SIZE sizeof(val__t)
 #define PTR_SIZE sizeof(ptr__t)
-#define BLK_SIZE 512
+
+/*
+ * Size of nodes and of the unit of I/O, fixed at build time (make BLK_SIZE_LOG=12 for
+ * 4 KiB blocks). A database can only be read by builds for the block size it was
+ * created with. XRP reads at most a page per resubmission, so blocks are 512 bytes
+ * to 4 KiB.
+ */
+#ifndef BLK_SIZE_LOG
 #define BLK_SIZE_LOG 9
+#endif
+#if BLK_SIZE_LOG < 9 || BLK_SIZE_LOG > 12
+#error "BLK_SIZE_LOG must be between 9 and 12"
+#endif
+#define BLK_SIZE (1 << BLK_SIZE_LOG)
 #define SCRATCH_SIZE 4096
 
-#define ROOT_NODE_OFFSET 0
+/* Where `create` puts the root, right after the superblock; readers take it from the superblock */
+#define ROOT_NODE_OFFSET BLK_SIZE
 
 // Node offset "encoding"
 #define FILE_MASK ((ptr__t)1 << 63)
+/* Not block aligned, so never a block offset: marks empty block slots and buffers */
+#define NO_BLOCK (~(ptr__t) 0)
 
 // Node-level information
 #define INTERNAL 0
 #define LEAF 1
 
 #define NODE_CAPACITY ((BLK_SIZE - 2 * META_SIZE) / (KEY_SIZE + PTR_SIZE))
-#define LOG_CAPACITY  ((BLK_SIZE) / (VAL_SIZE))
 #define FANOUT NODE_CAPACITY
+/* NODE_CAPACITY is one less than a power of two; masks indexes into the entries of a node for the verifier */
+#define NODE_INDEX_MASK ((1u << (BLK_SIZE_LOG - 4)) - 1)
+
+/*
+ * Values are variable length. The heap holds each one as a record: a VAL_HDR_SIZE
+ * byte little-endian length followed by the value's bytes. Records are packed; one
+ * that would cross a block boundary starts at the next block instead, and one larger
+ * than a block starts at a block boundary and runs on into the following blocks. So
+ * a value that fits a block is still read with one I/O, and a larger one with one
+ * I/O of consecutive blocks.
+ *
+ * Leaf pointers carry the length of their value too (above VALUE_LEN_SHIFT), so
+ * readers know how much to read before reading, and writers know how much space a
+ * value they replace frees. Lookup results hold the length and the first VAL_SIZE
+ * bytes of the value; val__t is that inline prefix.
+ */
+#define VAL_HDR_SIZE 2
+#define MAX_VAL_LEN 4096
+/* Eight records per block, like the fixed size values of older databases */
+#define DEFAULT_VAL_LEN (VAL_SIZE - VAL_HDR_SIZE)
+#define VALUE_LEN_SHIFT 48
 
 static __inline ptr__t value_base(ptr__t ptr) {
     return ptr & ~(BLK_SIZE - 1);
@@ -42,7 +77,41 @@ static __inline ptr__t encode(ptr__t ptr) {
 }
 
 static __inline ptr__t decode(ptr__t ptr) {
-    return ptr & (~FILE_MASK);
+    return ptr & (((ptr__t) 1 << VALUE_LEN_SHIFT) - 1);
+}
+
+/* Leaf pointer to a value of [len] bytes at [offset] */
+static __inline ptr__t encode_value(ptr__t offset, unsigned int len) {
+    return encode(offset | ((ptr__t) len << VALUE_LEN_SHIFT));
+}
+
+/* Length of the value a leaf pointer points to */
+static __inline unsigned int value_len(ptr__t ptr) {
+    return (unsigned int) ((ptr & ~FILE_MASK) >> VALUE_LEN_SHIFT);
+}
+
+/* Number of value bytes returned inline with lookup results */
+static __inline unsigned int value_inline_len(unsigned int len) {
+    return len < VAL_SIZE ? len : (unsigned int) VAL_SIZE;
+}
+
+static __inline unsigned long value_record_size(unsigned int len) {
+    return VAL_HDR_SIZE + len;
+}
+
+/* Offset of a record of [size] bytes appended to a heap filled up to [pos] */
+static __inline ptr__t value_record_start(ptr__t pos, unsigned long size) {
+    ptr__t in_block = pos & (BLK_SIZE - 1);
+    if (in_block != 0 && (size > BLK_SIZE || in_block + size > BLK_SIZE)) {
+        return pos - in_block + BLK_SIZE;
+    }
+    return pos;
+}
+
+/* Write the header of a record of a [len] byte value to [rec] */
+static __inline void set_value_header(unsigned char *rec, unsigned int len) {
+    rec[0] = (unsigned char) (len & 0xff);
+    rec[1] = (unsigned char) (len >> 8);
 }
 
 static inline ptr__t is_file_offset(ptr__t ptr) {
@@ -57,10 +126,95 @@ typedef struct _Node {
 } Node;
 
 _Static_assert(sizeof(Node) == BLK_SIZE, "Nodes must be block sized");
+_Static_assert(NODE_CAPACITY == NODE_INDEX_MASK, "NODE_INDEX_MASK must cover exactly the entries of a node");
+
+/*
+ * The low half of Node.type is INTERNAL or LEAF, the high half is the number of
+ * keys in the node. A count of 0 means the node is full, so full trees look the
+ * same as before counts existed; leaves emptied by deletes are marked with
+ * NODE_NKEYS_EMPTY. Unused slots hold KEY_PAD, which is larger than every key,
+ * so searches that scan all NODE_CAPACITY slots stay correct.
+ */
+#define NODE_NKEYS_SHIFT 32
+#define NODE_NKEYS_EMPTY 0xffffffffu
+#define KEY_PAD (~(key__t) 0)
 
-typedef struct _Log {
-    val__t val[LOG_CAPACITY];
-} Log;
+/*
+ * Packed leaves
+ *
+ * `create --packed-leaves` writes leaves in a denser format, flagged with NODE_PACKED
+ * in the type. Keys are stored as 32 bit offsets from the leaf's key_base (frame of
+ * reference), and value pointers as 32 bit offsets from its ptr_base plus the 16 bit
+ * value length, so a leaf holds PACKED_CAPACITY entries instead of NODE_CAPACITY.
+ * Unused slots hold KEY_DELTA_PAD. node_type() still reads LEAF; leaf_key() and
+ * leaf_ptr() read entries of either format. Packed databases are read only.
+ */
+#define NODE_PACKED 0x100
+#define NODE_TYPE_MASK 0xff
+#define PACKED_ENTRY_SIZE (2 * sizeof(unsigned int) + sizeof(unsigned short))
+/* A multiple of 8, so the SIMD searches load whole vectors of deltas */
+#define PACKED_CAPACITY (((BLK_SIZE - 4 * META_SIZE) / PACKED_ENTRY_SIZE) & ~7ul)
+#define KEY_DELTA_PAD 0xffffffffu
+
+typedef struct {
+    meta__t next;
+    meta__t type;
+    key__t key_base;
+    ptr__t ptr_base;
+    unsigned int key_delta[PACKED_CAPACITY];
+    unsigned int ptr_delta[PACKED_CAPACITY];
+    unsigned short value_len[PACKED_CAPACITY];
+} PackedLeaf;
+
+_Static_assert(sizeof(PackedLeaf) <= sizeof(Node), "Packed leaves must fit in a block");
+_Static_assert(MAX_VAL_LEN <= 0xffff, "Packed leaves store value lengths in 16 bits");
+
+static __inline meta__t node_type(Node const *node) {
+    return node->type & NODE_TYPE_MASK;
+}
+
+static __inline int node_packed(Node const *node) {
+    return (node->type & NODE_PACKED) != 0;
+}
+
+/* Most keys [node] can hold */
+static __inline unsigned int node_capacity(Node const *node) {
+    return node_packed(node) ? PACKED_CAPACITY : NODE_CAPACITY;
+}
+
+static __inline unsigned int node_nkeys(Node const *node) {
+    unsigned int n = (unsigned int) (node->type >> NODE_NKEYS_SHIFT);
+    if (n == NODE_NKEYS_EMPTY) {
+        return 0;
+    }
+    return n == 0 || n > node_capacity(node) ? node_capacity(node) : n;
+}
+
+static __inline meta__t make_node_type(meta__t type, unsigned int nkeys) {
+    if (nkeys == 0) {
+        return type | ((meta__t) NODE_NKEYS_EMPTY << NODE_NKEYS_SHIFT);
+    }
+    unsigned int capacity = type & NODE_PACKED ? PACKED_CAPACITY : NODE_CAPACITY;
+    return nkeys >= capacity ? type : type | ((meta__t) nkeys << NODE_NKEYS_SHIFT);
+}
+
+/* Key [i] of the leaf [node] */
+static __inline key__t leaf_key(Node const *node, unsigned int i) {
+    if (node_packed(node)) {
+        PackedLeaf const *leaf = (PackedLeaf const *) node;
+        return leaf->key_base + leaf->key_delta[i];
+    }
+    return node->key[i];
+}
+
+/* Leaf pointer [i] of the leaf [node] */
+static __inline ptr__t leaf_ptr(Node const *node, unsigned int i) {
+    if (node_packed(node)) {
+        PackedLeaf const *leaf = (PackedLeaf const *) node;
+        return encode_value(leaf->ptr_base + leaf->ptr_delta[i], leaf->value_len[i]);
+    }
+    return node->ptr[i];
+}
 
 /* State Flags for BPF Functions */
 #define REACHED_LEAF 1
@@ -72,13 +226,11 @@ struct Query {
     long found;
     long state_flags;
 
+    /* Length and first bytes of the value */
+    unsigned int value_len;
     val__t value;
     /* Used to store file offset to the value once we've located it via a leaf node */
     ptr__t value_ptr;
-
-    /* Current node (possibly a leaf being used to process results) and its parent */
-    Node current_node;
-    ptr__t current_parent;
 };
 
 
@@ -86,11 +238,15 @@ struct Query {
 
 struct MaybeValue {
     char found;
+    unsigned int value_len;
+    /* File offset of the value's record, to read the rest of long values */
+    ptr__t value_ptr;
     val__t value;
 };
 
 struct ScatterGatherQuery {
     ptr__t root_pointer;
+    /* Leaf pointer of the value being read */
     ptr__t value_ptr;
     unsigned int state_flags;
     int current_index;
@@ -122,6 +278,7 @@ static inline struct ScatterGatherQuery new_sg_query(void) {
 
 struct KeyValue {
     key__t key;
+    unsigned int value_len;
     val__t value;
 };
 
@@ -145,7 +302,17 @@ struct RangeQuery {
     unsigned int _state;
     ptr__t _resume_from_leaf;
     unsigned int _node_key_ix;
-    Node _current_node;
+    /*
+     * Entries [_window_begin, _window_begin + RNG_KEYS) of the leaf whose values the BPF
+     * function is reading, with the leaf's key count and next pointer. One call returns
+     * at most RNG_KEYS values, so this is all of the leaf it needs, and unlike a copy of
+     * the whole leaf it fits the scratch page with any block size.
+     */
+    unsigned int _window_begin;
+    unsigned int _leaf_nkeys;
+    ptr__t _leaf_next;
+    key__t _window_key[RNG_KEYS];
+    ptr__t _window_ptr[RNG_KEYS];
 };
 
 static inline int empty_range(struct RangeQuery const *query) {
@@ -212,10 +379,9 @@ static inline struct Query new_query(long key) {
         .key = key,
         .found = 0,
         .state_flags = 0,
+        .value_len = 0,
         .value = { 0 },
-        .value_ptr = 0,
-        .current_node = { 0 },
-        .current_parent = 0
+        .value_ptr = 0
     };
     return query;
 }
@@ -8,19 +8,39 @@
 #include "db_types.h"
 #include "helpers.h"
 #include "simplekv.h"
+#include "xrp_emu.h"
+#include "blkcache.h"
+#include "phase.h"
 
 
 int do_get_cmd(int argc, char *argv[], struct ArgState *as) {
     struct GetArgs ga = {
-            .database_layers = as->layers,
             .threads = 1,
-            .requests = 500
+            .requests = 500,
+            .batch = 1,
+            .queue_depth = 32,
+            .wal = WAL_ARGS_DEFAULT,
+            .keys = KEY_DIST_ARGS_DEFAULT
     };
     parse_get_opts(argc, argv, &ga);
 
+    open_database(as);
+    ga.database_layers = as->layers;
+    if (ga.cache_level >= ga.database_layers) {
+        /*
+         * This is enforced to avoid additional refactoring to handle the case where
+         * the entire index is cached.
+         * Currently, our retreival functions assume at least one level of the index is traversed.
+         */
+        fprintf(stderr, "number of cache layers must be less than number of database layers\n");
+        exit(1);
+    }
+
     /* Load BPF program */
     int bpf_fd = -1;
-    if (ga.xrp) {
+    if (ga.xrp_emu) {
+        bpf_fd = XRP_EMU_GET;
+    } else if (ga.xrp) {
         bpf_fd = load_bpf_program("xrp-bpf/get.o");
     }
 
@@ -28,14 +48,14 @@ int do_get_cmd(int argc, char *argv[], struct ArgState *as) {
         return lookup_single_key(as->filename, ga.key, ga.xrp, bpf_fd);
     }
 
-    return run(as->filename, as->layers, ga.requests, ga.threads, ga.xrp, bpf_fd, ga.cache_level);
+    return run(as->filename, &ga, bpf_fd);
 }
 
 
 
 int lookup_single_key(char *filename, long key, int use_xrp, int bpf_fd) {
     /* Lookup Single Key */
-    char *value = grab_value(filename, key, use_xrp, bpf_fd, ROOT_NODE_OFFSET);
+    char *value = grab_value(filename, key, use_xrp, bpf_fd, superblock.root);
     printf("Key: %ld\n", key);
     if (value == NULL) {
         printf("Value not found\n");
@@ -51,13 +71,11 @@ int lookup_single_key(char *filename, long key, int use_xrp, int bpf_fd) {
 }
 
 char *grab_value(char *file_name, unsigned long const key, int use_xrp, int bpf_fd, ptr__t index_offset) {
-    char *const retval = malloc(sizeof(val__t) + 1);
+    char *const retval = malloc(MAX_VAL_LEN + 1);
     if (retval == NULL) {
         perror("malloc");
         exit(1);
     }
-    /* Ensure we have a null at the end of the string */
-    retval[sizeof(val__t)] = '\0';
 
     /* Open the database */
     int flags = O_RDONLY;
@@ -86,14 +104,21 @@ char *grab_value(char *file_name, unsigned long const key, int use_xrp, int bpf_
             exit(1);
         }
     } else {
-        if (lookup_key_userspace(db_fd, &query, index_offset)) {
+        /* Traverse b+ tree index in db to find value and verify the key exists in leaf node */
+        if (lookup_key_userspace(db_fd, &query, index_offset, (unsigned char *) retval)) {
             free(retval);
             close(db_fd);
             return NULL;
         }
-        /* Traverse b+ tree index in db to find value and verify the key exists in leaf node */
     }
-    memcpy(retval, query.value, sizeof(query.value));
+    /* XRP lookups return the start of the value; read the rest of long ones */
+    if (use_xrp && query.value_len > VAL_SIZE) {
+        read_value(db_fd, query.value_ptr, query.value_len, (unsigned char *) retval);
+    } else if (use_xrp) {
+        memcpy(retval, query.value, query.value_len);
+    }
+    /* Ensure we have a null at the end of the string */
+    retval[query.value_len] = '\0';
     close(db_fd);
     return retval;
 }
@@ -105,29 +130,202 @@ char *grab_value(char *file_name, unsigned long const key, int use_xrp, int bpf_
  * @param key
  * @param index_offset Offset into the B+tree index to begin the traversal inside the index
  *        if caching is used.
+ * @param value If not NULL, receives the whole value, read with the same single I/O as
+ *        its start; otherwise only the start of the value is read, into the query
  * @return null terminated string containing the value on disk, or NULL if key not found
  */
 
-long lookup_key_userspace(int db_fd, struct Query *query, ptr__t index_offset) {
+long lookup_key_userspace(int db_fd, struct Query *query, ptr__t index_offset, unsigned char *value) {
     /* Traverse b+ tree index in db to find value and verify the key exists in leaf node */
     Node node = { 0 };
-    if (get_leaf_containing(db_fd, query->key, &node, index_offset) != 0 || !key_exists(query->key, &node)) {
+    ptr__t ptr = 0;
+    if (get_leaf_containing(db_fd, query->key, &node, index_offset) != 0
+        || (ptr = leaf_lookup(query->key, &node)) == 0) {
         query->found = 0;
         return -1;
     }
-    read_value_the_hard_way(db_fd, (char *) query->value, nxt_node(query->key, &node));
+    uint64_t phase = phase_start();
+    if (value != NULL) {
+        read_value(db_fd, decode(ptr), value_len(ptr), value);
+        memcpy(query->value, value, value_inline_len(value_len(ptr)));
+    } else {
+        read_value_the_hard_way(db_fd, (char *) query->value, ptr);
+    }
+    phase_end(PHASE_VALUE, phase);
+    query->value_len = value_len(ptr);
+    query->value_ptr = decode(ptr);
     query->found = 1;
     return 0;
 }
 
-/* Function using the same bit fiddling that we use in the BPF function */
+/* Function using the same bit fiddling that we use in the BPF function; reads the inline part of the value */
 void read_value_the_hard_way(int fd, char *retval, ptr__t ptr) {
     /* Aligned buffer for O_DIRECT read */
     char *buf = (char *) aligned_alloca(BLK_SIZE, BLK_SIZE);
 
     /* Base of the block containing our value */
     ptr__t base = decode(ptr) & ~(BLK_SIZE - 1);
-    checked_pread(fd, buf, BLK_SIZE, (long) base);
+    checked_block_cache_pread(value_cache, fd, buf, base);
     ptr__t offset = decode(ptr) & (BLK_SIZE - 1);
-    memcpy(retval, buf + offset, sizeof(val__t));
+    memcpy(retval, buf + offset + VAL_HDR_SIZE, value_inline_len(value_len(ptr)));
+}
+
+/**
+ * Read the whole [len] byte value whose record is at file offset [offset] into [dst].
+ * The record's blocks are consecutive, so this is one read.
+ */
+void read_value(int fd, ptr__t offset, unsigned int len, unsigned char *dst) {
+    size_t size = (value_offset(offset) + value_record_size(len) + BLK_SIZE - 1) & ~((size_t) BLK_SIZE - 1);
+    char *buf = (char *) aligned_alloca(BLK_SIZE, size);
+    if (size == BLK_SIZE) {
+        checked_block_cache_pread(value_cache, fd, buf, value_base(offset));
+    } else {
+        checked_pread(fd, buf, size, (long) value_base(offset));
+    }
+    memcpy(dst, buf + value_offset(offset) + VAL_HDR_SIZE, len);
+}
+
+/* Keys of a batch, sorted so that keys sharing index nodes are adjacent */
+struct BatchEntry {
+    key__t key;
+    int idx;
+    ptr__t index_offset;
+};
+
+struct BatchState {
+    int db_fd;
+    struct MaybeValue *out;
+    /* Last value block read; consecutive keys often share it */
+    char *value_block;
+    ptr__t value_block_base;
+};
+
+static int cmp_batch_entry(const void *a, const void *b) {
+    key__t ka = ((const struct BatchEntry *) a)->key;
+    key__t kb = ((const struct BatchEntry *) b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+/* Look up the [n] sorted entries [e] that all pass through the node at [offset] */
+static void batch_descend(struct BatchState *bs, ptr__t offset, struct BatchEntry *e, int n) {
+    Node *const node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
+    uint64_t phase = phase_start();
+    read_node(offset, node, bs->db_fd);
+    phase_end_node(node, phase);
+
+    if (node_type(node) != LEAF) {
+        /* Split the entries by the child they descend to; each child is read once */
+        int i = 0;
+        while (i < n) {
+            ptr__t child = nxt_node(e[i].key, node);
+            int j = i + 1;
+            while (j < n && nxt_node(e[j].key, node) == child) {
+                ++j;
+            }
+            batch_descend(bs, decode(child), e + i, j - i);
+            i = j;
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        struct MaybeValue *mv = &bs->out[e[i].idx];
+        ptr__t entry = leaf_lookup(e[i].key, node);
+        if (entry == 0) {
+            mv->found = 0;
+            continue;
+        }
+        ptr__t ptr = decode(entry);
+        if (value_base(ptr) != bs->value_block_base) {
+            phase = phase_start();
+            checked_block_cache_pread(value_cache, bs->db_fd, bs->value_block, value_base(ptr));
+            phase_end(PHASE_VALUE, phase);
+            bs->value_block_base = value_base(ptr);
+        }
+        mv->value_len = value_len(entry);
+        mv->value_ptr = ptr;
+        memcpy(mv->value, bs->value_block + value_offset(ptr) + VAL_HDR_SIZE, value_inline_len(mv->value_len));
+        mv->found = 1;
+    }
+}
+
+static long lookup_batch_userspace(int db_fd, key__t const *keys, int n, struct MaybeValue *out) {
+    struct BatchEntry *entries = malloc(n * sizeof(struct BatchEntry));
+    if (entries == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; ++i) {
+        entries[i].key = keys[i];
+        entries[i].idx = i;
+    }
+    qsort(entries, n, sizeof(struct BatchEntry), cmp_batch_entry);
+    for (int i = 0; i < n; ++i) {
+        uint64_t phase = phase_start();
+        entries[i].index_offset = cached_index_offset(entries[i].key);
+        if (cache_cap != 0) {
+            phase_end(PHASE_CACHED, phase);
+        }
+    }
+
+    char *value_block = (char *) aligned_alloca(BLK_SIZE, BLK_SIZE);
+    struct BatchState bs = {
+        .db_fd = db_fd,
+        .out = out,
+        .value_block = value_block,
+        .value_block_base = NO_BLOCK
+    };
+    /* Sorted keys that start below the same cached node are adjacent */
+    int i = 0;
+    while (i < n) {
+        int j = i + 1;
+        while (j < n && entries[j].index_offset == entries[i].index_offset) {
+            ++j;
+        }
+        batch_descend(&bs, entries[i].index_offset, entries + i, j - i);
+        i = j;
+    }
+    free(entries);
+    return 0;
+}
+
+static long lookup_batch_bpf(int db_fd, int bpf_fd, key__t const *keys, int n, struct MaybeValue *out) {
+    char *buf = (char *) aligned_alloca(0x1000, 0x1000);
+    char *scratch = (char *) aligned_alloca(0x1000, SCRATCH_SIZE);
+    struct ScatterGatherQuery *sgq = (struct ScatterGatherQuery *) scratch;
+
+    /* Pack up to SG_KEYS keys into each submission */
+    for (int done = 0; done < n; done += SG_KEYS) {
+        int n_keys = n - done < SG_KEYS ? n - done : SG_KEYS;
+        memset(scratch, 0, SCRATCH_SIZE);
+        sgq->root_pointer = superblock.root;
+        sgq->n_keys = n_keys;
+        memcpy(sgq->keys, keys + done, n_keys * sizeof(key__t));
+
+        uint64_t phase = phase_start();
+        long ret = read_xrp(db_fd, buf, BLK_SIZE, superblock.root, bpf_fd, scratch);
+        phase_end(PHASE_XRP, phase);
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(out + done, sgq->values, n_keys * sizeof(struct MaybeValue));
+    }
+    return 0;
+}
+
+/**
+ * Retrieve the values of [n] keys at once.
+ *
+ * With XRP the keys are packed into scatter-gather queries of up to SG_KEYS keys,
+ * so that one syscall serves up to SG_KEYS lookups. In userspace the keys are sorted
+ * and index nodes (and value blocks) shared by several keys are only read once.
+ *
+ * @param out - Array of [n] results; out[i] holds the value of keys[i], if found
+ * @return 0 on success, negative on XRP failure
+ */
+long lookup_batch(int db_fd, int use_xrp, int bpf_fd, key__t const *keys, int n, struct MaybeValue *out) {
+    if (use_xrp) {
+        return lookup_batch_bpf(db_fd, bpf_fd, keys, n, out);
+    }
+    return lookup_batch_userspace(db_fd, keys, n, out);
 }
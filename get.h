@@ -11,8 +11,12 @@ int lookup_single_key(char *filename, long key, int use_xrp, int bpf_fd);
 
 char *grab_value(char *file_name, unsigned long key, int use_xrp, int bpf_fd, ptr__t index_offset);
 
-long lookup_key_userspace(int db_fd, struct Query *query, ptr__t index_offset);
+long lookup_key_userspace(int db_fd, struct Query *query, ptr__t index_offset, unsigned char *value);
+
+long lookup_batch(int db_fd, int use_xrp, int bpf_fd, key__t const *keys, int n, struct MaybeValue *out);
 
 void read_value_the_hard_way(int fd, char *retval, ptr__t ptr);
 
+void read_value(int fd, ptr__t offset, unsigned int len, unsigned char *dst);
+
 #endif /* _GET_H_ */
\ No newline at end of file
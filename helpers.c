@@ -4,6 +4,10 @@
 #include <string.h>
 
 #include "helpers.h"
+#include "xrp_emu.h"
+#include "blkcache.h"
+#include "nodesearch.h"
+#include "phase.h"
 
 /**
  * Get the leaf node that MAY contain [key].
@@ -18,18 +22,21 @@
  */
 int _get_leaf_containing(int database_fd, key__t key, Node *node, ptr__t index_offset, ptr__t *node_offset) {
     Node *const tmp_node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
-    long bytes_read = pread(database_fd, tmp_node, sizeof(Node), (long) index_offset);
+    uint64_t phase = phase_start();
+    long bytes_read = block_cache_pread(node_cache, database_fd, tmp_node, index_offset);
     if (bytes_read != sizeof(Node)) {
         return -1;
     }
-    ptr__t ptr = nxt_node(key, tmp_node);
-    while (tmp_node->type != LEAF) {
-        bytes_read = pread(database_fd, tmp_node, sizeof(Node), (long) decode(ptr));
+    phase_end_node(tmp_node, phase);
+    while (node_type(tmp_node) != LEAF) {
+        ptr__t ptr = nxt_node(key, tmp_node);
+        phase = phase_start();
+        bytes_read = block_cache_pread(node_cache, database_fd, tmp_node, decode(ptr));
         if (bytes_read != sizeof(Node)) {
             return -1;
         }
+        phase_end_node(tmp_node, phase);
         *node_offset = ptr;
-        ptr = nxt_node(key, tmp_node);
     }
     *node = *tmp_node;
     return 0;
@@ -52,17 +59,29 @@ long lookup_bpf(int db_fd, int bpf_fd, struct Query *query, ptr__t index_offset)
     sgq->n_keys = 1;
 
     /* Syscall to invoke BPF function that we loaded out-of-band previously */
-    long ret = syscall(SYS_READ_XRP, db_fd, buf, BLK_SIZE, index_offset, bpf_fd, scratch);
+    uint64_t phase = phase_start();
+    long ret = read_xrp(db_fd, buf, BLK_SIZE, index_offset, bpf_fd, scratch);
+    phase_end(PHASE_XRP, phase);
 
     struct MaybeValue *maybe_v = &sgq->values[0];
     query->found = (long) maybe_v->found;
     if (query->found) {
+        query->value_len = maybe_v->value_len;
+        query->value_ptr = maybe_v->value_ptr;
         memcpy(query->value, maybe_v->value, sizeof(val__t));
     }
 
     return ret;
 }
 
+/* Invoke the XRP read syscall, or run the program in the userspace emulator if [bpf_fd] is emulated */
+long read_xrp(int db_fd, char *buf, size_t size, long offset, int bpf_fd, char *scratch) {
+    if (is_xrp_emu_fd(bpf_fd)) {
+        return xrp_emu_read(db_fd, buf, size, offset, bpf_fd, scratch);
+    }
+    return syscall(SYS_READ_XRP, db_fd, buf, size, offset, bpf_fd, scratch);
+}
+
 /* Helper function that terminates the program is pread fails */
 void checked_pread(int fd, void *buf, size_t size, long offset) {
     ssize_t bytes_read = pread(fd, buf, size, offset);
@@ -83,13 +102,7 @@ void checked_pread(int fd, void *buf, size_t size, long offset) {
  * @return B+ tree encoded byte offset into the db file
  */
 ptr__t nxt_node(unsigned long key, Node *node) {
-    for (size_t i = 1; i < NODE_CAPACITY; ++i) {
-        if (key < node->key[i]) {
-            return node->ptr[i - 1];
-        }
-    }
-    /* Key wasn't smaller than any of node->key[x], so take the last ptr */
-    return node->ptr[NODE_CAPACITY - 1];
+    return node->ptr[node_child_index(key, node)];
 }
 
 /**
@@ -99,12 +112,60 @@ ptr__t nxt_node(unsigned long key, Node *node) {
  * @return 1 if [key] exists, else 0
  */
 int key_exists(unsigned long const key, Node const *node) {
-    for (unsigned int i = 0; i < NODE_CAPACITY; ++i) {
-        if (node->key[i] == key) {
-            return 1;
-        }
+    return leaf_index(key, node) >= 0;
+}
+
+/* Index of [key] in the leaf [node], or -1 if it is not there */
+int leaf_index(key__t key, Node const *node) {
+    unsigned int i = node_packed(node) ? packed_key_index(key, (PackedLeaf const *) node) : node_key_index(key, node);
+    return i < node_capacity(node) ? (int) i : -1;
+}
+
+/* Leaf pointer of [key] in the leaf [node], or 0 if [key] is not there */
+ptr__t leaf_lookup(key__t key, Node const *node) {
+    int i = leaf_index(key, node);
+    return i < 0 ? 0 : leaf_ptr(node, i);
+}
+
+static char const digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * Generate the [len] byte value of key [v] in generated databases: [v] right-aligned
+ * and NUL terminated in the inline prefix, followed by filler. A VAL_SIZE byte value
+ * is the same as sprintf([dst], "%63lu", [v]).
+ */
+void format_value(char *dst, unsigned long v, unsigned int len) {
+    if (len == 0) {
+        return;
+    }
+    unsigned long const key = v;
+    char digits[24];
+    char *const end = digits + sizeof(digits);
+    char *p = end;
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * (v % 100)], 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * v], 2);
+    } else {
+        *--p = (char) ('0' + v);
+    }
+
+    /* Keep the low digits if the value is too short for all of them */
+    unsigned int prefix = value_inline_len(len);
+    size_t n = (size_t) (end - p) < prefix - 1 ? (size_t) (end - p) : prefix - 1;
+    memset(dst, ' ', prefix - 1 - n);
+    memcpy(dst + prefix - 1 - n, end - n, n);
+    dst[prefix - 1] = '\0';
+    for (unsigned int i = prefix; i < len; ++i) {
+        dst[i] = (char) ('a' + (key + i) % 26);
     }
-    return 0;
 }
 
 int compare_nodes(Node *x, Node *y) {
@@ -121,15 +182,6 @@ int compare_nodes(Node *x, Node *y) {
     return 1;
 }
 
-long calculate_max_key(unsigned int layers) {
-    long result = 1;
-    for (unsigned int i = 0; i < layers; ++i) {
-        result *= FANOUT;
-    }
-    /* Subtract one due to zero indexing of keys */
-    return result - 1;
-}
-
 int load_bpf_program(char *path) {
     struct bpf_object *obj;
     int ret, progfd;
@@ -7,6 +7,7 @@
 #include <alloca.h>
 #include <stdint.h>
 #include <math.h>
+#include <time.h>
 
 #include <linux/bpf.h>
 #include <linux/lirc.h>
@@ -21,16 +22,28 @@
 #define NS_PER_SEC 1000000000
 #define US_PER_NS  1000
 
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
 #define aligned_alloca(align, size)     (((uintptr_t) alloca((size) + (align) - 1) + ((align) - 1)) & ~ (uintptr_t) ((align) - 1));
 
 long lookup_bpf(int db_fd, int bpf_fd, struct Query *query, ptr__t index_offset);
 
+long read_xrp(int db_fd, char *buf, size_t size, long offset, int bpf_fd, char *scratch);
+
 void checked_pread(int fd, void *buf, size_t size, long offset);
 
 ptr__t nxt_node(unsigned long key, Node *node);
 
 int key_exists(unsigned long key, Node const *node);
 
+int leaf_index(key__t key, Node const *node);
+
+ptr__t leaf_lookup(key__t key, Node const *node);
+
 int _get_leaf_containing(int database_fd, key__t key, Node *node, ptr__t index_offset, ptr__t *node_offset);
 int get_leaf_containing(int database_fd, key__t key, Node *node, ptr__t index_offset);
 
@@ -58,7 +71,7 @@ static inline unsigned long strtoul_or_exit(char *str, char *fail_msg) {
 
 int compare_nodes(Node *x, Node *y);
 
-long calculate_max_key(unsigned int layers);
+void format_value(char *dst, unsigned long v, unsigned int len);
 
 int load_bpf_program(char *path);
 
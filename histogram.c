@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "helpers.h"
+
+/* Smallest value counted in bucket [b] */
+static size_t bucket_low(size_t b) {
+    size_t shift = b < 2 * HIST_SUB_BUCKETS ? 0 : b / HIST_SUB_BUCKETS - 1;
+    return (b - HIST_SUB_BUCKETS * shift) << shift;
+}
+
+/* Largest value counted in bucket [b] */
+static size_t bucket_high(size_t b) {
+    return b == HIST_BUCKETS - 1 ? SIZE_MAX : bucket_low(b + 1) - 1;
+}
+
+struct Histogram *hist_new(void) {
+    struct Histogram *h = calloc(1, sizeof(struct Histogram));
+    BUG_ON(h == NULL);
+    h->min = SIZE_MAX;
+    return h;
+}
+
+#define HIST_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/* Add [src] to [dst]; [src] may be recorded into by another thread meanwhile */
+void hist_merge(struct Histogram *dst, struct Histogram const *src) {
+    size_t min = HIST_LOAD(src->min), max = HIST_LOAD(src->max);
+    dst->count += HIST_LOAD(src->count);
+    dst->total += HIST_LOAD(src->total);
+    dst->min = min < dst->min ? min : dst->min;
+    dst->max = max > dst->max ? max : dst->max;
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        dst->buckets[b] += HIST_LOAD(src->buckets[b]);
+    }
+}
+
+/**
+ * Remove the values of [prev], an earlier copy of [dst], from [dst], leaving the
+ * values recorded since. The count is taken from the buckets, so it agrees with
+ * them even if the copies were made while values were being recorded, and the
+ * smallest and largest values are only known to the precision of the buckets.
+ */
+void hist_subtract(struct Histogram *dst, struct Histogram const *prev) {
+    dst->count = 0;
+    dst->total = dst->total > prev->total ? dst->total - prev->total : 0;
+    dst->min = SIZE_MAX;
+    dst->max = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        dst->buckets[b] = dst->buckets[b] > prev->buckets[b] ? dst->buckets[b] - prev->buckets[b] : 0;
+        if (dst->buckets[b] > 0) {
+            dst->count += dst->buckets[b];
+            dst->min = dst->min == SIZE_MAX ? bucket_low(b) : dst->min;
+            dst->max = bucket_high(b);
+        }
+    }
+}
+
+/**
+ * Value below which [percentile] (between 0 and 1) of the values in [h] fall. It is
+ * the middle of the bucket holding that value, within the smallest and largest value
+ * recorded, so it is exact up to the precision of the histogram.
+ */
+size_t hist_percentile(struct Histogram const *h, double percentile) {
+    if (h->count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (percentile * (double) h->count + 0.5);
+    rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+    size_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            size_t low = bucket_low(b);
+            size_t value = low + (bucket_high(b) == SIZE_MAX ? 0 : (bucket_high(b) - low) / 2);
+            return value < h->min ? h->min : value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+/* Number of values in [h] that are at least [value], up to the precision of the histogram */
+size_t hist_count_at_least(struct Histogram const *h, size_t value) {
+    size_t n = 0;
+    for (size_t b = hist_bucket(value); b < HIST_BUCKETS; ++b) {
+        n += h->buckets[b];
+    }
+    return n;
+}
+
+double hist_mean(struct Histogram const *h) {
+    return h->count ? (double) h->total / (double) h->count : 0.0;
+}
+
+/* Append the non-empty buckets of [h] to [out] as "name,low,high,count" lines */
+void hist_dump_csv(struct Histogram const *h, char const *name, FILE *out) {
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        if (h->buckets[b] > 0) {
+            fprintf(out, "%s,%lu,%lu,%lu\n", name, bucket_low(b), bucket_high(b), h->buckets[b]);
+        }
+    }
+}
+
+/* Write [h] to [out] as a JSON object with its summary, [percentiles] (in percent) and non-empty buckets */
+void hist_dump_json(struct Histogram const *h, double const *percentiles, int n_percentiles, FILE *out) {
+    fprintf(out, "{\"count\": %lu, \"min\": %lu, \"max\": %lu, \"mean\": %.1f, \"percentiles\": {",
+            h->count, h->count ? h->min : 0, h->max, hist_mean(h));
+    for (int i = 0; i < n_percentiles; ++i) {
+        fprintf(out, "%s\"%g\": %lu", i ? ", " : "", percentiles[i], hist_percentile(h, percentiles[i] / 100));
+    }
+    fprintf(out, "}, \"buckets\": [");
+    int first = 1;
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        if (h->buckets[b] > 0) {
+            fprintf(out, "%s[%lu, %lu, %lu]", first ? "" : ", ", bucket_low(b), bucket_high(b), h->buckets[b]);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}");
+}
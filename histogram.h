@@ -0,0 +1,70 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Log-linear latency histograms (in the style of HdrHistogram)
+ *
+ * Values below 2 * HIST_SUB_BUCKETS are counted exactly. Above that, each power of
+ * two range is split into HIST_SUB_BUCKETS equal buckets, so a value is known to
+ * within 1/HIST_SUB_BUCKETS (0.8%) of itself. Values up to 2^HIST_MAX_LOG ns
+ * (almost five hours) fit, larger ones are counted in the last bucket. A histogram
+ * takes the same memory however many values it holds.
+ *
+ * Each worker thread records into its own histograms without synchronization, and
+ * they are merged once the workers are done. A histogram has a single writer, which
+ * stores its fields with relaxed atomics, so the monitor thread can merge it while
+ * it is being recorded into; it then sees each field as it was at some point.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1ul << HIST_SUB_BITS)
+#define HIST_MAX_LOG 44
+#define HIST_BUCKETS ((HIST_MAX_LOG - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct Histogram {
+    size_t count;
+    /* Sum of the values, for the mean */
+    size_t total;
+    size_t min;
+    size_t max;
+    size_t buckets[HIST_BUCKETS];
+};
+
+/* Bucket that counts [value] */
+static inline size_t hist_bucket(size_t value) {
+    unsigned int log = 63 - (unsigned int) __builtin_clzl(value | 1);
+    unsigned int shift = log > HIST_SUB_BITS ? log - HIST_SUB_BITS : 0;
+    size_t b = HIST_SUB_BUCKETS * shift + (value >> shift);
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+#define HIST_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static inline void hist_record(struct Histogram *h, size_t value) {
+    size_t b = hist_bucket(value);
+    HIST_STORE(h->buckets[b], h->buckets[b] + 1);
+    HIST_STORE(h->total, h->total + value);
+    HIST_STORE(h->min, value < h->min ? value : h->min);
+    HIST_STORE(h->max, value > h->max ? value : h->max);
+    HIST_STORE(h->count, h->count + 1);
+}
+
+struct Histogram *hist_new(void);
+
+void hist_merge(struct Histogram *dst, struct Histogram const *src);
+
+void hist_subtract(struct Histogram *dst, struct Histogram const *prev);
+
+size_t hist_percentile(struct Histogram const *h, double percentile);
+
+size_t hist_count_at_least(struct Histogram const *h, size_t value);
+
+double hist_mean(struct Histogram const *h);
+
+void hist_dump_csv(struct Histogram const *h, char const *name, FILE *out);
+
+void hist_dump_json(struct Histogram const *h, double const *percentiles, int n_percentiles, FILE *out);
+
+#endif /* _HISTOGRAM_H_ */
@@ -0,0 +1,134 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "keygen.h"
+#include "parse.h"
+
+/* zeta(n) is summed term by term up to here, and estimated beyond */
+#define ZETA_EXACT_TERMS (1ul << 20)
+
+static char const *const dist_name[] = {
+    [DIST_UNIFORM] = "uniform",
+    [DIST_ZIPFIAN] = "zipfian",
+    [DIST_HOTSPOT] = "hotspot",
+    [DIST_SEQUENTIAL] = "sequential",
+    [DIST_LATEST] = "latest",
+};
+
+/*
+ * Sum of 1 / i^theta for i in [1, n]. Past ZETA_EXACT_TERMS the rest of the sum is
+ * the integral plus the Euler-Maclaurin corrections, which is exact to many digits
+ * that far out, so databases with billions of keys do not take seconds to start.
+ */
+static double zeta(uint64_t n, double theta) {
+    uint64_t m = n < ZETA_EXACT_TERMS ? n : ZETA_EXACT_TERMS;
+    double sum = 0;
+    for (uint64_t i = 1; i <= m; ++i) {
+        sum += pow((double) i, -theta);
+    }
+    if (n > m) {
+        double a = (double) m, b = (double) n;
+        sum += (pow(b, 1 - theta) - pow(a, 1 - theta)) / (1 - theta);
+        sum += (pow(b, -theta) - pow(a, -theta)) / 2;
+        sum += theta * (pow(a, -theta - 1) - pow(b, -theta - 1)) / 12;
+    }
+    return sum;
+}
+
+void key_dist_init(struct KeyDist *d, struct KeyDistArgs const *args, uint64_t n) {
+    d->distribution = args->distribution;
+    d->n = n;
+    d->theta = args->theta;
+    if (d->distribution == DIST_ZIPFIAN || d->distribution == DIST_LATEST) {
+        d->alpha = 1 / (1 - d->theta);
+        d->zetan = zeta(n, d->theta);
+        d->eta = (1 - pow(2.0 / (double) n, 1 - d->theta)) / (1 - zeta(2, d->theta) / d->zetan);
+    }
+    d->hot_n = (uint64_t) (args->hot_set * (double) n);
+    d->hot_n = d->hot_n == 0 ? 1 : d->hot_n;
+    d->hot_ops = args->hot_ops;
+}
+
+void key_dist_print(struct KeyDist const *d) {
+    printf("Key distribution: %s", dist_name[d->distribution]);
+    if (d->distribution == DIST_ZIPFIAN || d->distribution == DIST_LATEST) {
+        printf(", theta %g", d->theta);
+    } else if (d->distribution == DIST_HOTSPOT) {
+        printf(", %.1f%% of the requests to %lu keys", 100 * d->hot_ops, d->hot_n);
+    }
+    printf("\n");
+}
+
+/* Start a generator of [d] seeded with [seed]; the sequential distribution starts at index [first] */
+void keygen_init(struct KeyGen *g, struct KeyDist const *d, uint64_t seed, uint64_t first) {
+    g->dist = d;
+    g->state = seed;
+    g->next = first % d->n;
+}
+
+/* splitmix64 */
+static uint64_t next_random(struct KeyGen *g) {
+    uint64_t z = (g->state += 0x9E3779B97F4A7C15ul);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ul;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBul;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double next_double(struct KeyGen *g) {
+    return (double) (next_random(g) >> 11) * 0x1.0p-53;
+}
+
+/* Uniform in [0, n) */
+static uint64_t next_below(struct KeyGen *g, uint64_t n) {
+    return (uint64_t) (((unsigned __int128) next_random(g) * n) >> 64);
+}
+
+/* Zipf distributed rank in [0, n), 0 being the most popular */
+static uint64_t next_zipf_rank(struct KeyGen *g) {
+    struct KeyDist const *d = g->dist;
+    double u = next_double(g);
+    double uz = u * d->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, d->theta)) {
+        return 1;
+    }
+    uint64_t rank = (uint64_t) ((double) d->n * pow(d->eta * u - d->eta + 1, d->alpha));
+    return rank < d->n ? rank : d->n - 1;
+}
+
+/* 64 bit FNV-1a hash of the bytes of [x] */
+static uint64_t fnv_hash64(uint64_t x) {
+    uint64_t hash = 0xCBF29CE484222325ul;
+    for (int i = 0; i < 8; ++i) {
+        hash ^= x & 0xff;
+        hash *= 0x100000001B3ul;
+        x >>= 8;
+    }
+    return hash;
+}
+
+uint64_t keygen_next(struct KeyGen *g) {
+    struct KeyDist const *d = g->dist;
+    switch (d->distribution) {
+        case DIST_ZIPFIAN:
+            return fnv_hash64(next_zipf_rank(g)) % d->n;
+        case DIST_LATEST:
+            return d->n - 1 - next_zipf_rank(g);
+        case DIST_HOTSPOT:
+            if (d->hot_n >= d->n || next_double(g) < d->hot_ops) {
+                return next_below(g, d->hot_n < d->n ? d->hot_n : d->n);
+            }
+            return d->hot_n + next_below(g, d->n - d->hot_n);
+        case DIST_SEQUENTIAL: {
+            uint64_t index = g->next;
+            g->next = index + 1 == d->n ? 0 : index + 1;
+            return index;
+        }
+        case DIST_UNIFORM:
+        default:
+            return next_below(g, d->n);
+    }
+}
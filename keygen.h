@@ -0,0 +1,65 @@
+#ifndef _KEYGEN_H_
+#define _KEYGEN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Key distributions of the get and range benchmarks
+ *
+ * A distribution picks indexes in [0, n): the keys of the database in order, or the
+ * start of a range. The choices follow YCSB:
+ *
+ *   uniform     every index is as likely
+ *   zipfian     index ranks follow a Zipf law with exponent [theta], and the ranks
+ *               are scattered over the key space by an FNV hash, so the popular
+ *               keys do not sit next to each other
+ *   hotspot     a fraction [hot_ops] of the requests go to the first [hot_set] of
+ *               the indexes, the others to the rest
+ *   sequential  each thread walks its own part of the key space, wrapping around
+ *   latest      like zipfian without scattering, counted from the last index, so the
+ *               most recently created keys are the most popular
+ *
+ * Each thread draws from its own generator, and the benchmarks draw all the keys of
+ * a thread before the timed run.
+ */
+enum KeyDistribution {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_HOTSPOT,
+    DIST_SEQUENTIAL,
+    DIST_LATEST,
+};
+
+struct KeyDistArgs;
+
+/* Parameters of a distribution over [0, n), shared by its generators */
+struct KeyDist {
+    enum KeyDistribution distribution;
+    uint64_t n;
+    /* Zipfian constants, see Gray et al., "Quickly Generating Billion-Record Synthetic Databases" */
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    /* Hotspot: the first [hot_n] indexes get a fraction [hot_ops] of the requests */
+    uint64_t hot_n;
+    double hot_ops;
+};
+
+struct KeyGen {
+    struct KeyDist const *dist;
+    uint64_t state;
+    /* Next index of the sequential distribution */
+    uint64_t next;
+};
+
+void key_dist_init(struct KeyDist *d, struct KeyDistArgs const *args, uint64_t n);
+
+void key_dist_print(struct KeyDist const *d);
+
+void keygen_init(struct KeyGen *g, struct KeyDist const *d, uint64_t seed, uint64_t first);
+
+uint64_t keygen_next(struct KeyGen *g);
+
+#endif /* _KEYGEN_H_ */
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "monitor.h"
+#include "helpers.h"
+#include "blkcache.h"
+
+/* Reads the kernel accounted to the process; unknown without task I/O accounting */
+struct IoCounts {
+    int known;
+    size_t read_calls;
+    size_t read_bytes;
+};
+
+/* Totals since the start of the run, at one point in time */
+struct Sample {
+    uint64_t time;
+    struct Histogram *latency;
+    size_t updates;
+    struct IoCounts io;
+    struct BlockCacheStats node_cache;
+    struct BlockCacheStats value_cache;
+};
+
+static struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+
+    FILE *out;
+    uint64_t interval_ns;
+    struct Histogram **latency;
+    struct Histogram **write_latency;
+    size_t n;
+} monitor;
+
+static void read_io_counts(struct IoCounts *io) {
+    memset(io, 0, sizeof(*io));
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL) {
+        return;
+    }
+    char name[32];
+    size_t value;
+    while (fscanf(f, "%31[^:]: %lu\n", name, &value) == 2) {
+        if (strcmp(name, "syscr") == 0) {
+            io->read_calls = value;
+            io->known |= 1;
+        } else if (strcmp(name, "read_bytes") == 0) {
+            io->read_bytes = value;
+            io->known |= 2;
+        }
+    }
+    io->known = io->known == 3;
+    fclose(f);
+}
+
+static void take_sample(struct Sample *s) {
+    s->time = monotonic_ns();
+    memset(s->latency, 0, sizeof(struct Histogram));
+    s->latency->min = SIZE_MAX;
+    s->updates = 0;
+    for (size_t i = 0; i < monitor.n; ++i) {
+        hist_merge(s->latency, monitor.latency[i]);
+        if (monitor.write_latency != NULL && monitor.write_latency[i] != NULL) {
+            s->updates += __atomic_load_n(&monitor.write_latency[i]->count, __ATOMIC_RELAXED);
+        }
+    }
+    read_io_counts(&s->io);
+    if (node_cache != NULL) {
+        block_cache_get_stats(node_cache, &s->node_cache);
+    }
+    if (value_cache != NULL) {
+        block_cache_get_stats(value_cache, &s->value_cache);
+    }
+}
+
+static void print_cache(char const *name, struct BlockCacheStats const *now, struct BlockCacheStats const *before) {
+    fprintf(monitor.out, ", \"%s_hits\": %lu, \"%s_misses\": %lu", name, now->hits - before->hits,
+            name, now->misses - before->misses);
+}
+
+/* Write the line for the interval from [prev] to [now]; [h] holds the latencies recorded in it */
+static void report(uint64_t start, struct Sample const *prev, struct Sample const *now, struct Histogram const *h) {
+    double seconds = (double) (now->time - prev->time) / NS_PER_SEC;
+    fprintf(monitor.out, "{\"time\": %.3f, \"interval\": %.3f, \"ops\": %lu, \"ops_per_sec\": %.1f, \"updates\": %lu",
+            (double) (now->time - start) / NS_PER_SEC, seconds, h->count,
+            seconds > 0 ? (double) h->count / seconds : 0.0, now->updates - prev->updates);
+    fprintf(monitor.out, ", \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p99.9_us\": %.3f, \"max_us\": %.3f",
+            hist_mean(h) / US_PER_NS, (double) hist_percentile(h, 0.5) / US_PER_NS,
+            (double) hist_percentile(h, 0.99) / US_PER_NS, (double) hist_percentile(h, 0.999) / US_PER_NS,
+            (double) (h->count ? h->max : 0) / US_PER_NS);
+    if (now->io.known && prev->io.known) {
+        fprintf(monitor.out, ", \"read_calls\": %lu, \"read_bytes\": %lu", now->io.read_calls - prev->io.read_calls,
+                now->io.read_bytes - prev->io.read_bytes);
+    }
+    if (node_cache != NULL) {
+        print_cache("node_cache", &now->node_cache, &prev->node_cache);
+    }
+    if (value_cache != NULL) {
+        print_cache("value_cache", &now->value_cache, &prev->value_cache);
+    }
+    fprintf(monitor.out, "}\n");
+    fflush(monitor.out);
+}
+
+static void *monitor_thread(void *arg) {
+    (void) arg;
+    struct Sample samples[2] = { { .latency = hist_new() }, { .latency = hist_new() } };
+    struct Sample *prev = &samples[0], *now = &samples[1];
+    struct Histogram *interval = hist_new();
+    take_sample(prev);
+    uint64_t const start = prev->time;
+
+    uint64_t deadline = start;
+    for (int stop = 0; !stop;) {
+        deadline += monitor.interval_ns;
+        pthread_mutex_lock(&monitor.lock);
+        while (!monitor.stop && monotonic_ns() < deadline) {
+            struct timespec ts = { .tv_sec = deadline / NS_PER_SEC, .tv_nsec = deadline % NS_PER_SEC };
+            pthread_cond_timedwait(&monitor.wake, &monitor.lock, &ts);
+        }
+        stop = monitor.stop;
+        pthread_mutex_unlock(&monitor.lock);
+
+        take_sample(now);
+        memcpy(interval, now->latency, sizeof(struct Histogram));
+        hist_subtract(interval, prev->latency);
+        /* The last interval is cut short by the end of the run; leave it out if nothing completed in it */
+        if (!stop || interval->count > 0) {
+            report(start, prev, now, interval);
+        }
+        struct Sample *tmp = prev;
+        prev = now;
+        now = tmp;
+        /* Skip the intervals a stalled monitor missed instead of reporting them all at once */
+        while (deadline + monitor.interval_ns <= prev->time) {
+            deadline += monitor.interval_ns;
+        }
+    }
+
+    free(samples[0].latency);
+    free(samples[1].latency);
+    free(interval);
+    return NULL;
+}
+
+/**
+ * Report the requests recorded in the [n] histograms [latency] to [path] ("-" for
+ * stdout) every [interval_ms] until monitor_stop. [write_latency], if not NULL,
+ * holds the histograms of the updates among them; its entries may be NULL.
+ */
+void monitor_start(char const *path, unsigned int interval_ms, struct Histogram *const *latency,
+                   struct Histogram *const *write_latency, size_t n) {
+    monitor.out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (monitor.out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    monitor.interval_ns = (uint64_t) interval_ms * 1000000;
+    monitor.n = n;
+    monitor.latency = malloc(n * sizeof(struct Histogram *));
+    BUG_ON(monitor.latency == NULL);
+    memcpy(monitor.latency, latency, n * sizeof(struct Histogram *));
+    monitor.write_latency = NULL;
+    if (write_latency != NULL) {
+        monitor.write_latency = malloc(n * sizeof(struct Histogram *));
+        BUG_ON(monitor.write_latency == NULL);
+        memcpy(monitor.write_latency, write_latency, n * sizeof(struct Histogram *));
+    }
+    monitor.stop = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&monitor.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&monitor.lock, NULL);
+    if (pthread_create(&monitor.tid, NULL, monitor_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/* Report the last interval and stop; the histograms must still be alive */
+void monitor_stop(void) {
+    pthread_mutex_lock(&monitor.lock);
+    monitor.stop = 1;
+    pthread_cond_signal(&monitor.wake);
+    pthread_mutex_unlock(&monitor.lock);
+    pthread_join(monitor.tid, NULL);
+
+    if (monitor.out != stdout) {
+        fclose(monitor.out);
+    }
+    pthread_cond_destroy(&monitor.wake);
+    pthread_mutex_destroy(&monitor.lock);
+    free(monitor.latency);
+    free(monitor.write_latency);
+}
@@ -0,0 +1,25 @@
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+#include <stddef.h>
+
+#include "histogram.h"
+
+/*
+ * Time series of a benchmark run
+ *
+ * With --monitor, a thread wakes up every interval and writes a JSON object on a
+ * line of its own for the requests that completed during the interval: how many
+ * there were, the throughput, latency percentiles, and the reads the process made.
+ * It takes the requests from the latency histograms the workers record into and
+ * the reads from the kernel's I/O accounting, so the workers do not share anything
+ * with it or with each other. A last line covers the end of the run.
+ */
+#define DEFAULT_MONITOR_INTERVAL_MS 1000
+
+void monitor_start(char const *path, unsigned int interval_ms, struct Histogram *const *latency,
+                   struct Histogram *const *write_latency, size_t n);
+
+void monitor_stop(void);
+
+#endif /* _MONITOR_H_ */
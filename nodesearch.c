@@ -0,0 +1,259 @@
+#include "nodesearch.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Both searches are expressed as "first slot matching a predicate". For the child
+ * index the predicate is key < node->key[i] over slots 1..nkeys-1 and the child is
+ * ptr[i - 1], falling back to the last ptr; that is exactly the slot index of the
+ * first match, counting from slot 1.
+ */
+
+static unsigned int child_index_scalar(key__t key, Node const *node) {
+    unsigned int nkeys = node_nkeys(node);
+    for (unsigned int i = 1; i < nkeys; ++i) {
+        if (key < node->key[i]) {
+            return i - 1;
+        }
+    }
+    return nkeys - 1;
+}
+
+static unsigned int key_index_scalar(key__t key, Node const *node) {
+    unsigned int nkeys = node_nkeys(node);
+    for (unsigned int i = 0; i < nkeys; ++i) {
+        if (node->key[i] == key) {
+            return i;
+        }
+    }
+    return NODE_CAPACITY;
+}
+
+/* Delta of [key] from the base of [leaf], or KEY_DELTA_PAD if no delta stored there can match it */
+static inline unsigned int packed_delta(key__t key, PackedLeaf const *leaf) {
+    key__t delta = key - leaf->key_base;
+    return key < leaf->key_base || delta >= KEY_DELTA_PAD ? KEY_DELTA_PAD : (unsigned int) delta;
+}
+
+static unsigned int packed_index_scalar(key__t key, PackedLeaf const *leaf) {
+    unsigned int nkeys = node_nkeys((Node const *) leaf);
+    unsigned int delta = packed_delta(key, leaf);
+    if (delta == KEY_DELTA_PAD) {
+        return PACKED_CAPACITY;
+    }
+    for (unsigned int i = 0; i < nkeys; ++i) {
+        if (leaf->key_delta[i] == delta) {
+            return i;
+        }
+    }
+    return PACKED_CAPACITY;
+}
+
+static unsigned int line_index_scalar(key__t key, key__t const *line) {
+    for (unsigned int i = 0; i < LINE_KEYS; ++i) {
+        if (key < line[i]) {
+            return i;
+        }
+    }
+    return LINE_KEYS;
+}
+
+unsigned int (*node_child_index)(key__t key, Node const *node) = child_index_scalar;
+unsigned int (*node_key_index)(key__t key, Node const *node) = key_index_scalar;
+unsigned int (*line_child_index)(key__t key, key__t const *line) = line_index_scalar;
+unsigned int (*packed_key_index)(key__t key, PackedLeaf const *leaf) = packed_index_scalar;
+static char const *search_name = "scalar";
+
+#if defined(__x86_64__)
+
+/*
+ * The vector loops compare the used slots of a node in groups of 64, one bit per slot,
+ * rounding up to whole vectors. Slots past the end of key[] are the first entries of
+ * ptr[], which are still inside the Node; their bits are masked out of the result
+ * together with the unused slots of non-full nodes.
+ */
+#define GROUP_SLOTS 64
+#define KEY_MASK(n)  ((n) ? ~0ul >> (GROUP_SLOTS - (n)) : 0ul)
+
+/* Number of the [n] slots from [base] on that are in the group starting at [base] */
+static inline unsigned int group_len(unsigned int n, unsigned int base) {
+    return n - base < GROUP_SLOTS ? n - base : GROUP_SLOTS;
+}
+
+/* AVX2 only has a signed 64 bit compare, so flip the sign bits for unsigned order */
+__attribute__((target("avx2")))
+static unsigned int child_index_avx2(key__t key, Node const *node) {
+    __m256i const sign = _mm256_set1_epi64x((long long) (1ul << 63));
+    __m256i const k = _mm256_xor_si256(_mm256_set1_epi64x((long long) key), sign);
+    key__t const *slots = &node->key[1];
+    unsigned int nkeys = node_nkeys(node);
+    unsigned int n = nkeys ? nkeys - 1 : 0;
+    for (unsigned int base = 0; base < n; base += GROUP_SLOTS) {
+        unsigned int len = group_len(n, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 4) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((__m256i const *) &slots[base + i]), sign);
+            unsigned long gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, k)));
+            mask |= gt << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return nkeys - 1;
+}
+
+__attribute__((target("avx2")))
+static unsigned int key_index_avx2(key__t key, Node const *node) {
+    __m256i const k = _mm256_set1_epi64x((long long) key);
+    unsigned int nkeys = node_nkeys(node);
+    for (unsigned int base = 0; base < nkeys; base += GROUP_SLOTS) {
+        unsigned int len = group_len(nkeys, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 4) {
+            __m256i v = _mm256_loadu_si256((__m256i const *) &node->key[base + i]);
+            unsigned long eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, k)));
+            mask |= eq << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return NODE_CAPACITY;
+}
+
+/* Packed leaves compare 32 bit deltas, twice as many per vector; loads past key_delta[] stay in the leaf */
+__attribute__((target("avx2")))
+static unsigned int packed_index_avx2(key__t key, PackedLeaf const *leaf) {
+    unsigned int nkeys = node_nkeys((Node const *) leaf);
+    unsigned int delta = packed_delta(key, leaf);
+    if (delta == KEY_DELTA_PAD) {
+        return PACKED_CAPACITY;
+    }
+    __m256i const k = _mm256_set1_epi32((int) delta);
+    for (unsigned int base = 0; base < nkeys; base += GROUP_SLOTS) {
+        unsigned int len = group_len(nkeys, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 8) {
+            __m256i v = _mm256_loadu_si256((__m256i const *) &leaf->key_delta[base + i]);
+            unsigned long eq = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, k)));
+            mask |= eq << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return PACKED_CAPACITY;
+}
+
+__attribute__((target("avx2")))
+static unsigned int line_index_avx2(key__t key, key__t const *line) {
+    __m256i const sign = _mm256_set1_epi64x((long long) (1ul << 63));
+    __m256i const k = _mm256_xor_si256(_mm256_set1_epi64x((long long) key), sign);
+    __m256i lo = _mm256_xor_si256(_mm256_load_si256((__m256i const *) line), sign);
+    __m256i hi = _mm256_xor_si256(_mm256_load_si256((__m256i const *) (line + 4)), sign);
+    unsigned int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(lo, k)))
+                        | _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(hi, k))) << 4;
+    return mask ? (unsigned int) __builtin_ctz(mask) : LINE_KEYS;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int child_index_avx512(key__t key, Node const *node) {
+    __m512i const k = _mm512_set1_epi64((long long) key);
+    key__t const *slots = &node->key[1];
+    unsigned int nkeys = node_nkeys(node);
+    unsigned int n = nkeys ? nkeys - 1 : 0;
+    for (unsigned int base = 0; base < n; base += GROUP_SLOTS) {
+        unsigned int len = group_len(n, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 8) {
+            __m512i v = _mm512_loadu_si512((void const *) &slots[base + i]);
+            mask |= (unsigned long) _mm512_cmpgt_epu64_mask(v, k) << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return nkeys - 1;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int key_index_avx512(key__t key, Node const *node) {
+    __m512i const k = _mm512_set1_epi64((long long) key);
+    unsigned int nkeys = node_nkeys(node);
+    for (unsigned int base = 0; base < nkeys; base += GROUP_SLOTS) {
+        unsigned int len = group_len(nkeys, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 8) {
+            __m512i v = _mm512_loadu_si512((void const *) &node->key[base + i]);
+            mask |= (unsigned long) _mm512_cmpeq_epu64_mask(v, k) << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return NODE_CAPACITY;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int packed_index_avx512(key__t key, PackedLeaf const *leaf) {
+    unsigned int nkeys = node_nkeys((Node const *) leaf);
+    unsigned int delta = packed_delta(key, leaf);
+    if (delta == KEY_DELTA_PAD) {
+        return PACKED_CAPACITY;
+    }
+    __m512i const k = _mm512_set1_epi32((int) delta);
+    for (unsigned int base = 0; base < nkeys; base += GROUP_SLOTS) {
+        unsigned int len = group_len(nkeys, base);
+        unsigned long mask = 0;
+        for (unsigned int i = 0; i < len; i += 16) {
+            __m512i v = _mm512_loadu_si512((void const *) &leaf->key_delta[base + i]);
+            mask |= (unsigned long) _mm512_cmpeq_epu32_mask(v, k) << i;
+        }
+        mask &= KEY_MASK(len);
+        if (mask) {
+            return base + (unsigned int) __builtin_ctzl(mask);
+        }
+    }
+    return PACKED_CAPACITY;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int line_index_avx512(key__t key, key__t const *line) {
+    __m512i const k = _mm512_set1_epi64((long long) key);
+    unsigned int mask = _mm512_cmpgt_epu64_mask(_mm512_load_si512((void const *) line), k);
+    return mask ? (unsigned int) __builtin_ctz(mask) : LINE_KEYS;
+}
+
+#endif /* __x86_64__ */
+
+/* Pick the widest kernel the CPU supports */
+void node_search_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        node_child_index = child_index_avx512;
+        node_key_index = key_index_avx512;
+        line_child_index = line_index_avx512;
+        packed_key_index = packed_index_avx512;
+        search_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        node_child_index = child_index_avx2;
+        node_key_index = key_index_avx2;
+        line_child_index = line_index_avx2;
+        packed_key_index = packed_index_avx2;
+        search_name = "avx2";
+    }
+#endif
+}
+
+char const *node_search_name(void) {
+    return search_name;
+}
@@ -0,0 +1,34 @@
+#ifndef _NODESEARCH_H_
+#define _NODESEARCH_H_
+
+#include "db_types.h"
+
+/*
+ * Key search within a single Node
+ *
+ * `nxt_node` and `key_exists` run once per level of every lookup, so on x86 they
+ * use AVX2 or AVX-512 kernels that compare the key against all slots of the node
+ * at once. The kernel is picked by `node_search_init` according to the CPU; the
+ * scalar loops are used until then and on other architectures.
+ */
+
+/* Index of the child of [node] to follow for [key] */
+extern unsigned int (*node_child_index)(key__t key, Node const *node);
+
+/* Index of [key] in [node], or NODE_CAPACITY if it is not there */
+extern unsigned int (*node_key_index)(key__t key, Node const *node);
+
+/* Index of [key] in the packed leaf [leaf], or PACKED_CAPACITY if it is not there */
+extern unsigned int (*packed_key_index)(key__t key, PackedLeaf const *leaf);
+
+/* Keys in one cache line */
+#define LINE_KEYS (64 / KEY_SIZE)
+
+/* Index of the first of the LINE_KEYS keys in [line] greater than [key], or LINE_KEYS */
+extern unsigned int (*line_child_index)(key__t key, key__t const *line);
+
+void node_search_init(void);
+
+char const *node_search_name(void);
+
+#endif /* _NODESEARCH_H_ */
@@ -3,37 +3,361 @@
 
 #include "parse.h"
 #include "helpers.h"
+#include "arrival.h"
+#include "keygen.h"
 
 /* Parsing for main */
 
 
+/* Generated values start with the key as text, so they cannot be much shorter */
+#define MIN_VALUE_SIZE 16
+
+static unsigned int parse_value_size(struct argp_state *state, char *arg) {
+    unsigned long size = strtoul_or_exit(arg, "invalid value size\n");
+    if (size < MIN_VALUE_SIZE || size > MAX_VAL_LEN) {
+        argp_error(state, "value size must be between %d and %d bytes", MIN_VALUE_SIZE, MAX_VAL_LEN);
+    }
+    return (unsigned int) size;
+}
+
+static unsigned int parse_monitor_interval(struct argp_state *state, char *arg) {
+    char *endptr = NULL;
+    unsigned long ms = strtoul(arg, &endptr, 10);
+    if (endptr == arg || *endptr != '\0' || ms == 0 || ms > 3600000) {
+        argp_error(state, "monitor interval must be between 1 and 3600000 milliseconds");
+    }
+    return (unsigned int) ms;
+}
+
+
 /* Parsing for DB creation */
 static struct argp_option create_opts[] = {
+        { "keys", KEYS_ARG_KEY, "N", 0, "Number of keys to load (default: as many as fill all layers)." },
+        { "fill-factor", FILL_FACTOR_ARG_KEY, "F", 0, "Fraction of the slots of each node to fill, between 0 and 1"
+                                                  " (default 1)." },
+        { "from", FROM_ARG_KEY, "FILE", 0, "Load the keys and values from FILE, sorted by key, instead of"
+                                           " generating them." },
+        { "format", FORMAT_ARG_KEY, "FORMAT", 0, "Format of the --from file: csv (key,value lines) or binary"
+                                                 " (8 byte key and 64 byte value records). Default: csv for"
+                                                 " *.csv files, binary otherwise." },
+        { "value-size", VALUE_SIZE_ARG_KEY, "BYTES", 0, "Length of the generated values, from 16 to 4096 bytes"
+                                                       " (default 62, eight to a block)." },
+        { "packed-leaves", PACKED_LEAVES_ARG_KEY, 0, 0, "Write the leaves in the packed format, which holds more"
+                                                        " keys per leaf. The database is then read only." },
+        { "threads" , 't', "N_THREADS", 0, "Number of threads generating and writing the database"
+                                           " (default: number of online CPUs)." },
         { 0 }
 };
 static char create_doc[] = "Create a new database with the specified number of layers.";
 
 static int _parse_create_opts(int key, char *arg, struct argp_state *state) {
-    if (key == CACHE_ARG_KEY) {
-        argp_error(state, "unsupported argument");
+    struct CreateArgs *st = state->input;
+    switch (key) {
+        case CACHE_ARG_KEY:
+            argp_error(state, "unsupported argument");
+            break;
+        case 't':
+            st->threads = (int) strtol_or_exit(arg, "invalid thread count\n");
+            if (st->threads <= 0) {
+                argp_error(state, "thread count must be positive");
+            }
+            break;
+        case KEYS_ARG_KEY:
+            st->keys = strtoul_or_exit(arg, "invalid key count\n");
+            if (st->keys == 0) {
+                argp_error(state, "key count must be positive");
+            }
+            break;
+        case FROM_ARG_KEY:
+            st->from = arg;
+            break;
+        case PACKED_LEAVES_ARG_KEY:
+            st->packed_leaves = 1;
+            break;
+        case VALUE_SIZE_ARG_KEY:
+            st->value_size = parse_value_size(state, arg);
+            break;
+        case FORMAT_ARG_KEY:
+            if (strcmp(arg, "csv") == 0) {
+                st->format = FORMAT_CSV;
+            } else if (strcmp(arg, "binary") == 0) {
+                st->format = FORMAT_BINARY;
+            } else {
+                argp_error(state, "format must be csv or binary");
+            }
+            break;
+        case ARGP_KEY_END:
+            if (st->from != NULL && st->keys != 0) {
+                argp_error(state, "--keys cannot be used with --from");
+            }
+            if (st->from == NULL && st->format != FORMAT_AUTO) {
+                argp_error(state, "--format requires --from");
+            }
+            if (st->from != NULL && st->value_size != 0) {
+                argp_error(state, "--value-size cannot be used with --from");
+            }
+            break;
+        case FILL_FACTOR_ARG_KEY: {
+            char *endptr = NULL;
+            st->fill_factor = strtod(arg, &endptr);
+            if (endptr == arg || *endptr != '\0' || !(st->fill_factor > 0 && st->fill_factor <= 1)) {
+                argp_error(state, "fill factor must be in (0, 1]");
+            }
+            break;
+        }
+        default:
+            return ARGP_ERR_UNKNOWN;
     }
     return 0;
 }
 
-void parse_create_opts(int argc, char *argv[]) {
+void parse_create_opts(int argc, char *argv[], struct CreateArgs *create_args) {
     struct argp argp = {create_opts, _parse_create_opts, "", create_doc};
-    argp_parse(&argp, argc, argv, 0, 0, create_opts);
+    argp_parse(&argp, argc, argv, 0, 0, create_args);
+}
+
+
+/* Write-ahead log options, shared by put and get */
+static struct argp_option wal_opts[] = {
+        { 0, 0, 0, 0, "Write-ahead log:" },
+        { "wal", WAL_ARG_KEY, 0, 0, "Log every change to DB_FILE.wal and wait until it is durable; the log is"
+                                    " replayed after a crash." },
+        { "commit-interval", COMMIT_INTERVAL_ARG_KEY, "USEC", 0, "Let a commit wait up to USEC microseconds for"
+                                                                " other writers to join its group (default 0)." },
+        { "commit-batch", COMMIT_BATCH_ARG_KEY, "N", 0, "Write a group as soon as it has N records (default 64)." },
+        { "wal-dsync", WAL_DSYNC_ARG_KEY, 0, 0, "Write the log with O_DSYNC instead of calling fdatasync." },
+        { "checkpoint-bytes", CHECKPOINT_ARG_KEY, "BYTES", 0, "Sync the database and empty the log when it"
+                                                             " reaches BYTES (default 64M)." },
+        { 0 }
+};
+
+/* The tuning options imply --wal */
+static int _parse_wal_opts(int key, char *arg, struct argp_state *state) {
+    struct WalArgs *st = state->input;
+    switch (key) {
+        case WAL_ARG_KEY:
+            st->enabled = 1;
+            break;
+        case COMMIT_INTERVAL_ARG_KEY:
+            st->commit_interval_us = strtol_or_exit(arg, "invalid commit interval\n");
+            if (st->commit_interval_us < 0) {
+                argp_error(state, "commit interval must not be negative");
+            }
+            st->enabled = 1;
+            break;
+        case COMMIT_BATCH_ARG_KEY:
+            st->commit_batch = strtoul_or_exit(arg, "invalid commit batch\n");
+            if (st->commit_batch == 0) {
+                argp_error(state, "commit batch must be positive");
+            }
+            st->enabled = 1;
+            break;
+        case WAL_DSYNC_ARG_KEY:
+            st->dsync = 1;
+            st->enabled = 1;
+            break;
+        case CHECKPOINT_ARG_KEY:
+            if (parse_size(arg, &st->checkpoint_bytes) != 0 || st->checkpoint_bytes == 0) {
+                argp_error(state, "invalid checkpoint size");
+            }
+            st->enabled = 1;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp wal_argp = {wal_opts, _parse_wal_opts};
+
+static struct argp_child wal_children[] = {
+        { &wal_argp, 0, 0, 0 },
+        { 0 }
+};
+
+/* Key distribution options, shared by get and range */
+static struct argp_option key_dist_opts[] = {
+        { 0, 0, 0, 0, "Key distribution:" },
+        { "distribution", DISTRIBUTION_ARG_KEY, "NAME", 0, "Draw keys from a uniform (default), zipfian, hotspot,"
+                                                          " sequential or latest distribution." },
+        { "theta", THETA_ARG_KEY, "T", 0, "Skew of the zipfian and latest distributions, between 0 and 1"
+                                          " (default 0.99)." },
+        { "hot-set", HOT_SET_ARG_KEY, "F", 0, "Fraction of the keys that are hot with hotspot (default 0.2)." },
+        { "hot-ops", HOT_OPS_ARG_KEY, "F", 0, "Fraction of the requests that go to hot keys with hotspot"
+                                              " (default 0.8)." },
+        { 0 }
+};
+
+/* Parse a fraction between 0 and 1, [open] excluding both ends */
+static double parse_fraction(struct argp_state *state, char *arg, int open, char const *what) {
+    char *endptr = NULL;
+    double f = strtod(arg, &endptr);
+    if (endptr == arg || *endptr != '\0' || !(open ? f > 0 && f < 1 : f >= 0 && f <= 1)) {
+        argp_error(state, "%s must be %s", what, open ? "strictly between 0 and 1" : "between 0 and 1");
+    }
+    return f;
+}
+
+static int _parse_key_dist_opts(int key, char *arg, struct argp_state *state) {
+    struct KeyDistArgs *st = state->input;
+    switch (key) {
+        case DISTRIBUTION_ARG_KEY:
+            if (strcmp(arg, "uniform") == 0) {
+                st->distribution = DIST_UNIFORM;
+            } else if (strcmp(arg, "zipfian") == 0) {
+                st->distribution = DIST_ZIPFIAN;
+            } else if (strcmp(arg, "hotspot") == 0) {
+                st->distribution = DIST_HOTSPOT;
+            } else if (strcmp(arg, "sequential") == 0) {
+                st->distribution = DIST_SEQUENTIAL;
+            } else if (strcmp(arg, "latest") == 0) {
+                st->distribution = DIST_LATEST;
+            } else {
+                argp_error(state, "distribution must be uniform, zipfian, hotspot, sequential or latest");
+            }
+            break;
+        case THETA_ARG_KEY:
+            st->theta = parse_fraction(state, arg, 1, "theta");
+            break;
+        case HOT_SET_ARG_KEY:
+            st->hot_set = parse_fraction(state, arg, 0, "hot set");
+            break;
+        case HOT_OPS_ARG_KEY:
+            st->hot_ops = parse_fraction(state, arg, 0, "hot ops");
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp key_dist_argp = {key_dist_opts, _parse_key_dist_opts};
+
+/* Each child gets its own group, or argp merges their options under one of the headers */
+static struct argp_child get_children[] = {
+        { &wal_argp, 0, 0, 1 },
+        { &key_dist_argp, 0, 0, 2 },
+        { 0 }
+};
+
+static struct argp_child range_children[] = {
+        { &key_dist_argp, 0, 0, 0 },
+        { 0 }
+};
+
+
+/* Parsing for put */
+static struct argp_option put_opts[] = {
+        { "key", 'k', "KEY", 0, "First key to insert, update or delete." },
+        { "count", 'n', "N", 0, "Apply the change to the N consecutive keys starting at KEY (default 1)." },
+        { "value", VALUE_ARG_KEY, "TEXT", 0, "Value to store, up to 4096 bytes of text (default: the key as text)." },
+        { "value-size", VALUE_SIZE_ARG_KEY, "BYTES", 0, "Length of the values that store the key as text, from 16"
+                                                       " to 4096 bytes (default 62)." },
+        { "delete", DELETE_ARG_KEY, 0, 0, "Delete the keys instead of storing values." },
+        { "compact", COMPACT_ARG_KEY, 0, 0, "Move the live values out of value blocks that updates and deletes"
+                                            " left at least half dead, and reuse those blocks." },
+        { 0 }
+};
+static char put_doc[] = "Insert, update or delete keys of an existing database\v"
+                        "Splitting or merging nodes may change the number of layers of the tree; "
+                        "put prints the new number when it does.";
+
+static int _parse_put_opts(int key, char *arg, struct argp_state *state) {
+    struct PutArgs *st = state->input;
+    switch (key) {
+        case ARGP_KEY_INIT:
+            state->child_inputs[0] = &st->wal;
+            break;
+        case 'k':
+            st->key = strtoul_or_exit(arg, "invalid key\n");
+            st->key_set = 1;
+            break;
+        case 'n':
+            st->count = strtoul_or_exit(arg, "invalid key count\n");
+            if (st->count == 0) {
+                argp_error(state, "key count must be positive");
+            }
+            break;
+        case VALUE_ARG_KEY:
+            if (strlen(arg) > MAX_VAL_LEN) {
+                argp_error(state, "values are at most %d bytes", MAX_VAL_LEN);
+            }
+            st->value = arg;
+            break;
+        case VALUE_SIZE_ARG_KEY:
+            st->value_size = parse_value_size(state, arg);
+            break;
+        case DELETE_ARG_KEY:
+            st->delete = 1;
+            break;
+        case COMPACT_ARG_KEY:
+            st->compact = 1;
+            break;
+        case ARGP_KEY_END:
+            if (!st->key_set) {
+                argp_error(state, "no key specified");
+            }
+            /* KEY_PAD marks unused slots, so it cannot be stored */
+            if (st->key + st->count - 1 < st->key || st->key + st->count - 1 >= KEY_PAD) {
+                argp_error(state, "keys out of range");
+            }
+            if (st->delete && (st->value != NULL || st->value_size != 0)) {
+                argp_error(state, "--value and --value-size cannot be used with --delete");
+            }
+            if (st->value != NULL && st->value_size != 0) {
+                argp_error(state, "--value cannot be combined with --value-size");
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+void parse_put_opts(int argc, char *argv[], struct PutArgs *put_args) {
+    struct argp argp = {put_opts, _parse_put_opts, "", put_doc, wal_children};
+    argp_parse(&argp, argc, argv, 0, 0, put_args);
 }
 
 
 /* Parsing for get key benchmark */
 static struct argp_option get_opts[] = {
         { "cache", CACHE_ARG_KEY, "NUM", 0, "Number of B+ tree layers to cache."
-                                            " Must be less than 3 and the number of database layers." },
+                                            " Must be less than the number of database layers." },
+        { "cache-bytes", CACHE_BYTES_ARG_KEY, "BYTES", 0, "Cache as many whole B+ tree layers as fit in BYTES"
+                                                         " (K, M and G suffixes allowed). Overrides --cache." },
+        { "node-cache", NODE_CACHE_ARG_KEY, "BYTES", 0, "Cache recently used index and leaf nodes in BYTES of memory"
+                                                      " (CLOCK eviction)." },
+        { "value-cache", VALUE_CACHE_ARG_KEY, "BYTES", 0, "Cache recently used value blocks in BYTES of memory"
+                                                        " (CLOCK eviction)." },
         { "key", 'k', "KEY", 0, "Retrieve a single key from the database." },
         { "use-xrp", 'x', 0, 0, "Use the (previously) loaded XRP BPF function to query the DB." },
+        { "emulate-xrp", XRP_EMU_ARG_KEY, 0, 0, "Run the XRP BPF function in the userspace emulator (no XRP kernel needed)." },
         { "requests", 'r', "REQ", 0, "Number of requests to submit per thread. Ignored if -k is set." },
         { "threads" , 't', "N_THREADS", 0, "Number of concurrent threads to run. Ignored if -k is set." },
+        { "batch", 'b', "N", 0, "Look up N keys per request with the multi-get API (XRP packs up to 32 keys per syscall)." },
+        { "uring", URING_ARG_KEY, 0, 0, "Use the asynchronous io_uring lookup engine instead of blocking reads." },
+        { "queue-depth", 'q', "QD", 0, "Number of lookups each thread keeps in flight with --uring (default 32)." },
+        { "sqpoll", SQPOLL_ARG_KEY, 0, 0, "Use a kernel submission queue polling thread with --uring." },
+        { "fixed-buffers", FIXED_BUFS_ARG_KEY, 0, 0, "Register I/O buffers with the kernel with --uring." },
+        { "write-ratio", WRITE_RATIO_ARG_KEY, "F", 0, "Make a fraction F (between 0 and 1) of the requests updates"
+                                                     " that store the key as text, like generated values." },
+        { "value-size", VALUE_SIZE_ARG_KEY, "BYTES", 0, "Length of the values updates store, from 16 to 4096"
+                                                       " bytes (default 62)." },
+        { "compact", COMPACT_ARG_KEY, 0, 0, "Reclaim value blocks left mostly dead by updates in a background"
+                                            " thread (with --write-ratio)." },
+        { "phases", PHASES_ARG_KEY, 0, 0, "Time the phases of every lookup (cached levels, index, leaf and value"
+                                          " reads) and print a breakdown and histograms." },
+        { "percentiles", PERCENTILES_ARG_KEY, "P,...", 0, "Latency percentiles to print (default 95,99,99.9)." },
+        { "latency-dump", LATENCY_DUMP_ARG_KEY, "FILE", 0, "Write the latency histograms to FILE, as JSON if it"
+                                                          " ends in .json and CSV otherwise." },
+        { "monitor", MONITOR_ARG_KEY, "FILE", 0, "Write the throughput, latency percentiles and reads of every"
+                                                " interval to FILE as JSON lines (- for stdout)." },
+        { "monitor-interval", MONITOR_INTERVAL_ARG_KEY, "MS", 0, "Length of the --monitor intervals in milliseconds"
+                                                               " (default 1000)." },
+        { "rate", RATE_ARG_KEY, "OPS", 0, "Send OPS requests per second across all threads on a fixed schedule,"
+                                          " and measure latency from when each request was due." },
+        { "arrivals", ARRIVALS_ARG_KEY, "PROCESS", 0, "Arrival process of --rate: poisson (default) or fixed." },
         { 0 }
 };
 static char get_doc[] = "Run the benchmark to retrieve single keys from the database";
@@ -41,23 +365,48 @@ static char get_doc[] = "Run the benchmark to retrieve single keys from the data
 static int _parse_get_opts(int key, char *arg, struct argp_state *state) {
     struct GetArgs *st = state->input;
     switch (key) {
+        case ARGP_KEY_INIT:
+            state->child_inputs[0] = &st->wal;
+            state->child_inputs[1] = &st->keys;
+            break;
+
         case CACHE_ARG_KEY: {
             char *endptr = NULL;
             unsigned long cache_level = strtoul(arg, &endptr, 10);
-            if ((endptr != NULL && *endptr != '\0') || cache_level > 3) {
-                argp_failure(state, 1, 0, "invalid cache level. Allowed: 0 <= level <= 3");
+            if (endptr != NULL && *endptr != '\0') {
+                argp_failure(state, 1, 0, "invalid cache level");
             }
             st->cache_level = (size_t) cache_level;
-            if (cache_level > st->database_layers) {
-                argp_failure(state, 1, 0, "error: cache level exceeds database layers");
-            }
         }
             break;
 
+        case CACHE_BYTES_ARG_KEY:
+            if (parse_size(arg, &st->cache_bytes) != 0) {
+                argp_failure(state, 1, 0, "invalid cache size");
+            }
+            break;
+
+        case NODE_CACHE_ARG_KEY:
+            if (parse_size(arg, &st->node_cache_bytes) != 0) {
+                argp_failure(state, 1, 0, "invalid node cache size");
+            }
+            break;
+
+        case VALUE_CACHE_ARG_KEY:
+            if (parse_size(arg, &st->value_cache_bytes) != 0) {
+                argp_failure(state, 1, 0, "invalid value cache size");
+            }
+            break;
+
         case 'x':
             st -> xrp = 1;
             break;
 
+        case XRP_EMU_ARG_KEY:
+            st->xrp = 1;
+            st->xrp_emu = 1;
+            break;
+
         case 'r': {
             char *endptr = NULL;
             st->requests = strtol(arg, &endptr, 10);
@@ -86,21 +435,131 @@ static int _parse_get_opts(int key, char *arg, struct argp_state *state) {
         }
             break;
 
+        case 'b': {
+            char *endptr = NULL;
+            st->batch = strtol(arg, &endptr, 10);
+            if ((endptr != NULL && *endptr != '\0') || st->batch <= 0) {
+                argp_failure(state, 1, 0, "invalid batch size");
+            }
+        }
+            break;
+
+        case URING_ARG_KEY:
+            st->uring = 1;
+            break;
+
+        case 'q': {
+            char *endptr = NULL;
+            st->queue_depth = strtol(arg, &endptr, 10);
+            if ((endptr != NULL && *endptr != '\0') || st->queue_depth <= 0) {
+                argp_failure(state, 1, 0, "invalid queue depth");
+            }
+        }
+            break;
+
+        case SQPOLL_ARG_KEY:
+            st->sqpoll = 1;
+            break;
+
+        case FIXED_BUFS_ARG_KEY:
+            st->fixed_bufs = 1;
+            break;
+
+        case WRITE_RATIO_ARG_KEY: {
+            char *endptr = NULL;
+            st->write_ratio = strtod(arg, &endptr);
+            if (endptr == arg || *endptr != '\0' || !(st->write_ratio >= 0 && st->write_ratio <= 1)) {
+                argp_error(state, "write ratio must be in [0, 1]");
+            }
+        }
+            break;
+
+        case COMPACT_ARG_KEY:
+            st->compact = 1;
+            break;
+
+        case PHASES_ARG_KEY:
+            st->phases = 1;
+            break;
+
+        case PERCENTILES_ARG_KEY: {
+            st->n_percentiles = 0;
+            char *p = arg;
+            for (;;) {
+                char *endptr = NULL;
+                double percentile = strtod(p, &endptr);
+                if (endptr == p || (*endptr != ',' && *endptr != '\0') || !(percentile > 0 && percentile <= 100)) {
+                    argp_error(state, "percentiles must be a comma separated list of numbers in (0, 100]");
+                }
+                if (st->n_percentiles == MAX_PERCENTILES) {
+                    argp_error(state, "at most %d percentiles", MAX_PERCENTILES);
+                }
+                st->percentiles[st->n_percentiles++] = percentile;
+                if (*endptr == '\0') {
+                    break;
+                }
+                p = endptr + 1;
+            }
+        }
+            break;
+
+        case LATENCY_DUMP_ARG_KEY:
+            st->latency_dump = arg;
+            break;
+
+        case MONITOR_ARG_KEY:
+            st->monitor = arg;
+            break;
+
+        case MONITOR_INTERVAL_ARG_KEY:
+            st->monitor_interval_ms = parse_monitor_interval(state, arg);
+            break;
+
+        case RATE_ARG_KEY: {
+            char *endptr = NULL;
+            st->rate = strtod(arg, &endptr);
+            if (endptr == arg || *endptr != '\0' || !(st->rate > 0 && st->rate <= 1e9)) {
+                argp_error(state, "rate must be a positive number of requests per second");
+            }
+        }
+            break;
+
+        case ARRIVALS_ARG_KEY:
+            if (strcmp(arg, "poisson") == 0) {
+                st->arrivals = ARRIVAL_POISSON;
+            } else if (strcmp(arg, "fixed") == 0) {
+                st->arrivals = ARRIVAL_FIXED;
+            } else {
+                argp_error(state, "arrival process must be poisson or fixed");
+            }
+            break;
+
+        case VALUE_SIZE_ARG_KEY:
+            st->value_size = parse_value_size(state, arg);
+            break;
+
         case ARGP_KEY_ARG:
             argp_error(state, "unsupported argument %s", arg);
             break;
 
         case ARGP_KEY_END:
-            if (st->cache_level > st->database_layers) {
-                argp_error(state, "number of cache layers exceeds database layers");
+            if (st->uring && st->xrp) {
+                argp_error(state, "--uring cannot be combined with --use-xrp");
+            }
+            else if (st->uring && st->batch > 1) {
+                argp_error(state, "--uring cannot be combined with --batch");
+            }
+            else if ((st->sqpoll || st->fixed_bufs) && !st->uring) {
+                argp_error(state, "--sqpoll and --fixed-buffers require --uring");
             }
-            else if (st->cache_level == st->database_layers) {
-                /*
-                 * This is enforced to avoid additional refactoring to handle the case where
-                 * the entire index is cached.
-                 * Currently, our retreival functions assume at least one level of the index is traversed.
-                 */
-                argp_error(state, "number of cache layers must be less than number of database layers");
+            else if (st->write_ratio > 0 && (st->uring || st->batch > 1)) {
+                argp_error(state, "--write-ratio cannot be combined with --uring or --batch");
+            }
+            else if (st->wal.enabled && st->write_ratio == 0) {
+                argp_error(state, "--wal requires --write-ratio");
+            }
+            else if (st->compact && st->write_ratio == 0) {
+                argp_error(state, "--compact requires --write-ratio");
             }
             break;
 
@@ -111,7 +570,7 @@ static int _parse_get_opts(int key, char *arg, struct argp_state *state) {
 }
 
 void parse_get_opts(int argc, char *argv[], struct GetArgs *get_args) {
-    struct argp argp = {get_opts, _parse_get_opts, "", get_doc};
+    struct argp argp = {get_opts, _parse_get_opts, "", get_doc, get_children};
     argp_parse(&argp, argc, argv, 0, 0, get_args);
 }
 
@@ -121,8 +580,17 @@ static struct argp_option range_opts[] = {
         { "dump", 'd', 0, 0, "Dump values to stdout." },
         { "sum", RANGE_SUM_KEY, 0, 0, "Sum the first 8 bytes of each value instead of returning them."},
         { "use-xrp", 'x', 0, 0, "Use the (previously) loaded XRP BPF function to query the DB." },
+        { "emulate-xrp", XRP_EMU_ARG_KEY, 0, 0, "Run the XRP BPF function in the userspace emulator (no XRP kernel needed)." },
         { "requests", 'r', "REQ", 0, "Number of requests to submit per thread. Ignored if -k is set." },
         { "range-size", 's', "SIZE", 0, "Size of randomly generated ranges for benchmarking." },
+        { "value-cache", VALUE_CACHE_ARG_KEY, "BYTES", 0, "Cache recently used value blocks in BYTES of memory"
+                                                        " (userspace only)." },
+        { "coalesce", COALESCE_ARG_KEY, "BYTES", 0, "Merge value reads of adjacent blocks into reads of up to BYTES"
+                                                  " (userspace only, default 128K, 0 disables)." },
+        { "monitor", MONITOR_ARG_KEY, "FILE", 0, "Write the throughput, latency percentiles and reads of every"
+                                                " interval to FILE as JSON lines (- for stdout)." },
+        { "monitor-interval", MONITOR_INTERVAL_ARG_KEY, "MS", 0, "Length of the --monitor intervals in milliseconds"
+                                                               " (default 1000)." },
         { 0 }
 };
 static char range_doc[] = "Perform a range query against the specified database\v"
@@ -131,6 +599,10 @@ static char range_doc[] = "Perform a range query against the specified database\
 static int _parse_range_opts(int key, char *arg, struct argp_state *state) {
     struct RangeArgs *st = state->input;
     switch (key) {
+        case ARGP_KEY_INIT:
+            state->child_inputs[0] = &st->keys;
+            break;
+
         case ARGP_KEY_ARG:
             switch (state->arg_num) {
                 case 0: {
@@ -151,10 +623,30 @@ static int _parse_range_opts(int key, char *arg, struct argp_state *state) {
             st->dump_flag = 1;
             break;
 
+        case VALUE_CACHE_ARG_KEY:
+            if (parse_size(arg, &st->value_cache_bytes) != 0) {
+                argp_error(state, "invalid value cache size");
+            }
+            break;
+
+        case COALESCE_ARG_KEY:
+            if (parse_size(arg, &st->coalesce_bytes) != 0) {
+                argp_error(state, "invalid coalesce size");
+            }
+            break;
+
         case RANGE_SUM_KEY:
             st->agg_op = AGG_SUM;
             break;
 
+        case MONITOR_ARG_KEY:
+            st->monitor = arg;
+            break;
+
+        case MONITOR_INTERVAL_ARG_KEY:
+            st->monitor_interval_ms = parse_monitor_interval(state, arg);
+            break;
+
         case 'r': {
             char *endptr = NULL;
             st->requests = strtol(arg, &endptr, 10);
@@ -168,6 +660,11 @@ static int _parse_range_opts(int key, char *arg, struct argp_state *state) {
             st->xrp = 1;
             break;
 
+        case XRP_EMU_ARG_KEY:
+            st->xrp = 1;
+            st->xrp_emu = 1;
+            break;
+
         case 's': {
             char *endptr = NULL;
             st->range_size = strtol(arg, &endptr, 10);
@@ -190,7 +687,7 @@ static int _parse_range_opts(int key, char *arg, struct argp_state *state) {
 }
 
 void parse_range_opts(int argc, char *argv[], struct RangeArgs *range_args) {
-    struct argp argp = {range_opts, _parse_range_opts, "[BEGIN,END]", range_doc};
+    struct argp argp = {range_opts, _parse_range_opts, "[BEGIN,END]", range_doc, range_children};
     argp_parse(&argp, argc, argv, 0, 0, range_args);
 }
 
@@ -252,3 +749,44 @@ int parse_range(struct Range *range, char *range_str) {
     }
     return 0;
 }
+
+/**
+ * Parse a size in bytes with an optional binary suffix
+ *
+ * Example strings:
+ *     4096
+ *     64K
+ *     512M
+ *     2G
+ *
+ * @param str
+ * @param size - Populated with the parsed size on success
+ * @return 0 on success, -1 on error
+ */
+int parse_size(char *str, size_t *size) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long result = strtoul(str, &endptr, 10);
+    if (errno != 0 || endptr == str) {
+        return -1;
+    }
+    switch (*endptr) {
+        case 'G': case 'g':
+            result <<= 10;
+            /* FALL THROUGH */
+        case 'M': case 'm':
+            result <<= 10;
+            /* FALL THROUGH */
+        case 'K': case 'k':
+            result <<= 10;
+            ++endptr;
+            break;
+        default:
+            break;
+    }
+    if (*endptr != '\0') {
+        return -1;
+    }
+    *size = result;
+    return 0;
+}
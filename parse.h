@@ -5,6 +5,48 @@
 
 #define CACHE_ARG_KEY 1337
 #define RANGE_SUM_KEY 9999
+#define URING_ARG_KEY 1338
+#define SQPOLL_ARG_KEY 1339
+#define FIXED_BUFS_ARG_KEY 1340
+#define XRP_EMU_ARG_KEY 1341
+#define CACHE_BYTES_ARG_KEY 1342
+#define NODE_CACHE_ARG_KEY 1343
+#define VALUE_CACHE_ARG_KEY 1344
+#define COALESCE_ARG_KEY 1345
+#define KEYS_ARG_KEY 1346
+#define FILL_FACTOR_ARG_KEY 1347
+#define FROM_ARG_KEY 1348
+#define FORMAT_ARG_KEY 1349
+#define VALUE_ARG_KEY 1350
+#define DELETE_ARG_KEY 1351
+#define WRITE_RATIO_ARG_KEY 1352
+#define WAL_ARG_KEY 1353
+#define COMMIT_INTERVAL_ARG_KEY 1354
+#define COMMIT_BATCH_ARG_KEY 1355
+#define WAL_DSYNC_ARG_KEY 1356
+#define CHECKPOINT_ARG_KEY 1357
+#define COMPACT_ARG_KEY 1358
+#define VALUE_SIZE_ARG_KEY 1359
+#define PACKED_LEAVES_ARG_KEY 1360
+#define PHASES_ARG_KEY 1361
+#define PERCENTILES_ARG_KEY 1362
+#define LATENCY_DUMP_ARG_KEY 1363
+#define MONITOR_ARG_KEY 1364
+#define MONITOR_INTERVAL_ARG_KEY 1365
+#define RATE_ARG_KEY 1366
+#define ARRIVALS_ARG_KEY 1367
+#define DISTRIBUTION_ARG_KEY 1368
+#define THETA_ARG_KEY 1369
+#define HOT_SET_ARG_KEY 1370
+#define HOT_OPS_ARG_KEY 1371
+
+/* Input formats for create --from */
+#define FORMAT_AUTO 0
+#define FORMAT_CSV 1
+#define FORMAT_BINARY 2
+
+/* Most latency percentiles `get --percentiles` takes */
+#define MAX_PERCENTILES 16
 
 struct ArgState {
     /* Required Args */
@@ -14,26 +56,124 @@ struct ArgState {
     int subcommand_retval;
 };
 
+struct CreateArgs {
+    int threads;
+    /* Number of keys, 0 for a full tree */
+    size_t keys;
+    /* Fraction of each node's slots to use */
+    double fill_factor;
+    /* Load sorted records from this file instead of generating them */
+    char *from;
+    int format;
+    /* Length of the generated values, 0 for DEFAULT_VAL_LEN */
+    unsigned int value_size;
+    /* Write the leaves as PackedLeaf */
+    int packed_leaves;
+};
+
+/* Write-ahead log options of put and get */
+struct WalArgs {
+    int enabled;
+    /* Longest time a commit waits for other writers to join its group */
+    long commit_interval_us;
+    /* A group is written as soon as it has this many records */
+    size_t commit_batch;
+    /* Write groups with O_DSYNC instead of write + fdatasync */
+    int dsync;
+    /* Log size at which the database is synced and the log emptied */
+    size_t checkpoint_bytes;
+};
+
+#define WAL_ARGS_DEFAULT { .commit_batch = 64, .checkpoint_bytes = 64ul << 20 }
+
+/* Key distribution options of get and range, see keygen.h */
+struct KeyDistArgs {
+    int distribution;
+    /* Skew of the zipfian and latest distributions, in (0, 1) */
+    double theta;
+    /* With hotspot, a fraction [hot_ops] of the requests go to the first [hot_set] of the keys */
+    double hot_set;
+    double hot_ops;
+};
+
+#define KEY_DIST_ARGS_DEFAULT { .theta = 0.99, .hot_set = 0.2, .hot_ops = 0.8 }
+
 struct GetArgs {
     long key;
 
     /* Flags */
     int key_set;
     int xrp;
+    int xrp_emu;
 
     int threads;
     int requests;
+    int batch;
     size_t cache_level;
+    size_t cache_bytes;
+    size_t node_cache_bytes;
+    size_t value_cache_bytes;
     size_t database_layers;
+
+    /* io_uring lookup engine */
+    int uring;
+    int queue_depth;
+    int sqpoll;
+    int fixed_bufs;
+
+    /* Fraction of requests that update a key instead of looking it up */
+    double write_ratio;
+    /* Length of the values updates store, 0 for DEFAULT_VAL_LEN */
+    unsigned int value_size;
+    /* Reclaim the space of dead values in the background */
+    int compact;
+    struct WalArgs wal;
+    /* Time the phases of every lookup */
+    int phases;
+    /* Latency percentiles to print, in percent; none for the defaults */
+    double percentiles[MAX_PERCENTILES];
+    int n_percentiles;
+    /* Write the latency histograms to this file */
+    char *latency_dump;
+    /* Write a line of statistics every [monitor_interval_ms] to this file */
+    char *monitor;
+    unsigned int monitor_interval_ms;
+    /* Requests per second offered by all threads together; 0 sends each one when the last completes */
+    double rate;
+    int arrivals;
+    struct KeyDistArgs keys;
+};
+
+struct PutArgs {
+    unsigned long key;
+    int key_set;
+    /* Number of consecutive keys starting at [key] */
+    unsigned long count;
+    /* Value text; NULL stores the key as text, like generated databases */
+    char *value;
+    /* Length of the values that store the key, 0 for DEFAULT_VAL_LEN */
+    unsigned int value_size;
+    int delete;
+    /* Reclaim the space of dead values afterwards */
+    int compact;
+    struct WalArgs wal;
 };
 
 struct RangeArgs {
     int dump_flag;
     int xrp;
+    int xrp_emu;
     unsigned long range_begin;
     unsigned long range_end;
     long requests;
     long range_size;
+    size_t value_cache_bytes;
+    size_t coalesce_bytes;
+    /* Write a line of statistics every [monitor_interval_ms] to this file */
+    char *monitor;
+    unsigned int monitor_interval_ms;
+    /* Distribution of the starts of random ranges */
+    struct KeyDistArgs keys;
 
     int agg_op;
 };
@@ -54,10 +194,14 @@ int run_subcommand(struct argp_state *state, char *cmd_name, int(*subcommand)(in
 
 int parse_range(struct Range *range, char *range_str);
 
+int parse_size(char *str, size_t *size);
+
 void parse_range_opts(int argc, char *argv[], struct RangeArgs *range_args);
 
 void parse_get_opts(int argc, char *argv[], struct GetArgs *get_args);
 
-void parse_create_opts(int argc, char *argv[]);
+void parse_create_opts(int argc, char *argv[], struct CreateArgs *create_args);
+
+void parse_put_opts(int argc, char *argv[], struct PutArgs *put_args);
 
 #endif /* _PARSE_H_ */
\ No newline at end of file
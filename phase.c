@@ -0,0 +1,119 @@
+#include <stdio.h>
+
+#include "phase.h"
+
+__thread struct PhaseStats *phase_stats;
+
+static char const *const phase_name[N_PHASES] = {
+    [PHASE_CACHED] = "cached levels",
+    [PHASE_INDEX] = "index reads",
+    [PHASE_LEAF] = "leaf reads",
+    [PHASE_VALUE] = "value reads",
+    [PHASE_XRP] = "XRP calls",
+};
+
+/* Short column headers of the histogram */
+static char const *const phase_column[N_PHASES] = {
+    [PHASE_CACHED] = "cached",
+    [PHASE_INDEX] = "index",
+    [PHASE_LEAF] = "leaf",
+    [PHASE_VALUE] = "value",
+    [PHASE_XRP] = "xrp",
+};
+
+static unsigned int phase_bucket(uint64_t ns) {
+    unsigned int b = ns ? 63 - (unsigned int) __builtin_clzl(ns) : 0;
+    return b < PHASE_BUCKETS ? b : PHASE_BUCKETS - 1;
+}
+
+void phase_record(enum LookupPhase phase, uint64_t ns) {
+    phase_stats->count[phase] += 1;
+    phase_stats->ns[phase] += ns;
+    phase_stats->hist[phase][phase_bucket(ns)] += 1;
+}
+
+void phase_stats_add(struct PhaseStats *dst, struct PhaseStats const *src) {
+    for (int p = 0; p < N_PHASES; ++p) {
+        dst->count[p] += src->count[p];
+        dst->ns[p] += src->ns[p];
+        for (int b = 0; b < PHASE_BUCKETS; ++b) {
+            dst->hist[p][b] += src->hist[p][b];
+        }
+    }
+    dst->lookups += src->lookups;
+    dst->lookup_ns += src->lookup_ns;
+}
+
+/* Print [ns] in [buf] with a unit that keeps it short */
+static void format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%luns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", (double) ns / 1000);
+    } else {
+        snprintf(buf, size, "%.1fms", (double) ns / 1000000);
+    }
+}
+
+/*
+ * Print how the lookup time splits into phases, and a histogram of the duration of
+ * each phase. "other" is the lookup time outside the timed phases: system call and
+ * checking overhead, and with io_uring the time between a completion and the next read.
+ */
+void phase_stats_print(struct PhaseStats const *stats) {
+    if (stats->lookups == 0) {
+        return;
+    }
+    double const lookups = (double) stats->lookups;
+    double const total = (double) stats->lookup_ns;
+    printf("Lookup phases over %lu lookups, %.3f usec each:\n", stats->lookups, total / lookups / 1000);
+    printf("  %-14s %10s %10s %12s %7s\n", "phase", "per lookup", "avg usec", "usec/lookup", "share");
+    size_t timed = 0;
+    int used[N_PHASES];
+    unsigned int lo = PHASE_BUCKETS, hi = 0;
+    for (int p = 0; p < N_PHASES; ++p) {
+        used[p] = stats->count[p] > 0;
+        if (!used[p]) {
+            continue;
+        }
+        timed += stats->ns[p];
+        printf("  %-14s %10.2f %10.3f %12.3f %6.1f%%\n", phase_name[p], (double) stats->count[p] / lookups,
+               (double) stats->ns[p] / (double) stats->count[p] / 1000, (double) stats->ns[p] / lookups / 1000,
+               total > 0 ? 100.0 * (double) stats->ns[p] / total : 0.0);
+        for (unsigned int b = 0; b < PHASE_BUCKETS; ++b) {
+            if (stats->hist[p][b] > 0) {
+                lo = b < lo ? b : lo;
+                hi = b > hi ? b : hi;
+            }
+        }
+    }
+    /* Batched and asynchronous lookups overlap, so the phases can add up to more than the wall time */
+    double other = total > (double) timed ? total - (double) timed : 0.0;
+    printf("  %-14s %10s %10s %12.3f %6.1f%%\n", "other", "", "", other / lookups / 1000,
+           total > 0 ? 100.0 * other / total : 0.0);
+
+    if (lo > hi) {
+        return;
+    }
+    printf("Phase duration histogram (count per bucket):\n");
+    printf("  %-19s", "duration");
+    for (int p = 0; p < N_PHASES; ++p) {
+        if (used[p]) {
+            printf(" %10s", phase_column[p]);
+        }
+    }
+    printf("\n");
+    for (unsigned int b = lo; b <= hi; ++b) {
+        char from[16], to[16], range[40];
+        format_ns(from, sizeof(from), 1ul << b);
+        format_ns(to, sizeof(to), 2ul << b);
+        snprintf(range, sizeof(range), "[%s, %s)", from, to);
+        printf("  %-19s", range);
+        for (int p = 0; p < N_PHASES; ++p) {
+            if (used[p]) {
+                printf(" %10lu", stats->hist[p][b]);
+            }
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _PHASE_H_
+#define _PHASE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "db_types.h"
+
+/*
+ * Lookup phase breakdown
+ *
+ * With `get --phases` every lookup charges the time it spends in each of its phases
+ * to the PhaseStats of its worker thread: searching the cached levels, reading index
+ * nodes, reading the leaf and reading the value. XRP lookups are one syscall and are
+ * timed as a whole. Reads served by the node or value cache still count as reads, so
+ * a change that removes I/O shows up as faster reads, and one that only moves it as
+ * reads moving from one phase to another. Threads without stats skip the clock.
+ */
+enum LookupPhase {
+    PHASE_CACHED,
+    PHASE_INDEX,
+    PHASE_LEAF,
+    PHASE_VALUE,
+    PHASE_XRP,
+    N_PHASES
+};
+
+/* Bucket b of the histograms counts durations in [2^b, 2^(b+1)) ns */
+#define PHASE_BUCKETS 40
+
+struct PhaseStats {
+    size_t count[N_PHASES];
+    size_t ns[N_PHASES];
+    size_t hist[N_PHASES][PHASE_BUCKETS];
+    /* Lookups, and the wall time they took */
+    size_t lookups;
+    size_t lookup_ns;
+};
+
+/* Stats of the lookups of the calling thread, or NULL if phases are not timed */
+extern __thread struct PhaseStats *phase_stats;
+
+static inline uint64_t phase_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ul + (uint64_t) ts.tv_nsec;
+}
+
+/* Start of a phase, to pass to phase_end; 0 if phases are not timed */
+static inline uint64_t phase_start(void) {
+    return phase_stats != NULL ? phase_clock() : 0;
+}
+
+void phase_record(enum LookupPhase phase, uint64_t ns);
+
+/* Charge the time since [start] to [phase] */
+static inline void phase_end(enum LookupPhase phase, uint64_t start) {
+    if (phase_stats != NULL) {
+        phase_record(phase, phase_clock() - start);
+    }
+}
+
+/* Charge the read of [node] that began at [start] to the leaf or index phase */
+static inline void phase_end_node(Node const *node, uint64_t start) {
+    if (phase_stats != NULL) {
+        phase_record(node_type(node) == LEAF ? PHASE_LEAF : PHASE_INDEX, phase_clock() - start);
+    }
+}
+
+/* Count [n] lookups that took [ns] of wall time together */
+static inline void phase_lookups(size_t n, size_t ns) {
+    if (phase_stats != NULL) {
+        phase_stats->lookups += n;
+        phase_stats->lookup_ns += ns;
+    }
+}
+
+void phase_stats_add(struct PhaseStats *dst, struct PhaseStats const *src);
+
+void phase_stats_print(struct PhaseStats const *stats);
+
+#endif /* _PHASE_H_ */
@@ -9,13 +9,19 @@
 #include "db_types.h"
 #include "simplekv.h"
 #include "helpers.h"
+#include "xrp_emu.h"
+#include "blkcache.h"
+#include "monitor.h"
+#include "keygen.h"
 
 static void print_query_results(struct RangeQuery *query) {
     if (query->agg_op == AGG_NONE) {
         char buf[sizeof(val__t) + 1] = { 0 };
-        buf[sizeof(val__t)] = '\0';
         for (int i = 0; i < query->len; ++i) {
-            memcpy(buf, query->kv[i].value, sizeof(val__t));
+            /* Only the first VAL_SIZE bytes of long values are returned */
+            unsigned int len = value_inline_len(query->kv[i].value_len);
+            memcpy(buf, query->kv[i].value, len);
+            buf[len] = '\0';
             char *trimmed = buf;
             while (isspace(*trimmed)) {
                 ++trimmed;
@@ -29,16 +35,22 @@ static void print_query_results(struct RangeQuery *query) {
 }
 
 int do_range_cmd(int argc, char *argv[], struct ArgState *as) {
-    struct RangeArgs ra = { .requests = 1 };
+    struct RangeArgs ra = { .requests = 1, .coalesce_bytes = DEFAULT_COALESCE_BYTES, .keys = KEY_DIST_ARGS_DEFAULT };
     parse_range_opts(argc, argv, &ra);
-    if (ra.range_size && ra.range_size - 1 > calculate_max_key(as->layers)) {
+    open_database(as);
+
+    int db_fd = get_handler(as->filename, O_RDONLY);
+    load_geometry(db_fd, as->layers);
+    if (ra.range_size && (key__t) ra.range_size > max_key) {
         fprintf(stderr, "range size exceeds database size\n");
         exit(1);
     }
 
     /* Load BPF program */
     int bpf_fd = -1;
-    if (ra.xrp) {
+    if (ra.xrp_emu) {
+        bpf_fd = XRP_EMU_RANGE;
+    } else if (ra.xrp) {
         bpf_fd = load_bpf_program("xrp-bpf/range.o");
     }
 
@@ -50,31 +62,55 @@ int do_range_cmd(int argc, char *argv[], struct ArgState *as) {
      */
     struct RangeQuery query = { .agg_op = ra.agg_op };
 
-    /* Open the database */
-    int db_fd = get_handler(as->filename, O_RDONLY);
+    if (ra.value_cache_bytes > 0) {
+        value_cache = block_cache_new(ra.value_cache_bytes);
+    }
+    struct RangeScan scan;
+    range_scan_init(&scan, ra.coalesce_bytes);
+
+    /* Starts of the random ranges, drawn before the run */
+    key__t *begins = NULL;
+    if (ra.range_size) {
+        struct KeyDist dist;
+        key_dist_init(&dist, &ra.keys, max_key + 1 - ra.range_size);
+        key_dist_print(&dist);
+        struct KeyGen gen;
+        keygen_init(&gen, &dist, monotonic_ns(), 0);
+        begins = malloc(ra.requests * sizeof(key__t));
+        BUG_ON(ra.requests > 0 && begins == NULL);
+        for (long i = 0; i < ra.requests; ++i) {
+            begins[i] = keygen_next(&gen);
+        }
+    }
+
+    /* Latency of each request, for --monitor */
+    struct Histogram *request_latency = NULL;
+    if (ra.monitor != NULL) {
+        request_latency = hist_new();
+        monitor_start(ra.monitor, ra.monitor_interval_ms ? ra.monitor_interval_ms : DEFAULT_MONITOR_INTERVAL_MS,
+                      &request_latency, NULL, 1);
+    }
 
     /* Retrieve values in range and print */
     struct timespec start, stop, l_start, l_stop;
     long total_time = 0, total_latency = 0;
     clock_gettime(CLOCK_REALTIME, &start);
 
-    /* Used to generate random ranges */
-    srandom(start.tv_nsec ^ start.tv_sec);
-    max_key = calculate_max_key(as->layers);
-
     for (long i = 0; i < ra.requests; ++i) {
         if (ra.range_size) {
-            ra.range_begin = random() % (max_key + 2 - ra.range_size);
+            ra.range_begin = begins[i];
             ra.range_end = ra.range_begin + ra.range_size;
         }
         set_range(&query, ra.range_begin, ra.range_end, 0);
+        range_scan_reset(&scan);
+        long request_ns = 0;
 
         for (;;) {
             clock_gettime(CLOCK_REALTIME, &l_start);
-            int rv = submit_range_query(&query, db_fd, ra.xrp, bpf_fd);
+            int rv = submit_range_query(&query, db_fd, ra.xrp, bpf_fd, &scan);
             clock_gettime(CLOCK_REALTIME, &l_stop);
 
-            total_latency += NS_PER_SEC * (l_stop.tv_sec - l_start.tv_sec) + (l_stop.tv_nsec - l_start.tv_nsec);
+            request_ns += NS_PER_SEC * (l_stop.tv_sec - l_start.tv_sec) + (l_stop.tv_nsec - l_start.tv_nsec);
 
             if (rv != 0) {
                 exit(rv);
@@ -86,8 +122,16 @@ int do_range_cmd(int argc, char *argv[], struct ArgState *as) {
                 break;
             }
         }
+        total_latency += request_ns;
+        if (request_latency != NULL) {
+            hist_record(request_latency, (size_t) request_ns);
+        }
     }
     clock_gettime(CLOCK_REALTIME, &stop);
+    if (request_latency != NULL) {
+        monitor_stop();
+        free(request_latency);
+    }
     total_time = NS_PER_SEC * (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec);
 
     /* Dump results */
@@ -95,12 +139,160 @@ int do_range_cmd(int argc, char *argv[], struct ArgState *as) {
     double latency = (double) total_latency / (double) ra.requests / US_PER_NS;
     unsigned long range_size = ra.range_size ? ra.range_size : ra.range_end - ra.range_begin;
     printf("Range Size: %lu, Average throughput: %f op/s latency: %f usec\n", range_size, throughput, latency);
+    if (ra.xrp_emu) {
+        xrp_emu_print_stats(ra.requests);
+    }
+    if (!ra.xrp) {
+        printf("Value reads: %lu, %.2f KiB per read\n", scan.value_reads,
+               scan.value_reads ? (double) scan.value_bytes / scan.value_reads / 1024 : 0.0);
+        printf("Leaf reads: %lu, %lu served by readahead\n", scan.leaves.reads, scan.leaves.prefetch_hits);
+    }
+    block_cache_print_stats(value_cache, "Value");
+    range_scan_free(&scan);
+    free(begins);
+    free_globals();
 
     close(db_fd);
     return 0;
 }
 
-int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf_fd) {
+void range_scan_init(struct RangeScan *scan, size_t coalesce_bytes) {
+    memset(scan, 0, sizeof(*scan));
+    /* Whole blocks only, since the database is opened with O_DIRECT */
+    scan->coalesce_bytes = coalesce_bytes & ~((size_t) BLK_SIZE - 1);
+    if (scan->coalesce_bytes > 0 && posix_memalign((void **) &scan->window, BLK_SIZE, scan->coalesce_bytes)) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+    leaf_readahead_init(&scan->leaves);
+}
+
+/* Drop the buffered values and leaves; call before starting a new query */
+void range_scan_reset(struct RangeScan *scan) {
+    scan->window_base = 0;
+    scan->window_len = 0;
+    leaf_readahead_reset(&scan->leaves);
+}
+
+void range_scan_free(struct RangeScan *scan) {
+    free(scan->window);
+    scan->window = NULL;
+    leaf_readahead_free(&scan->leaves);
+}
+
+/* Upper bound on the number of leaves needed to scan from [from] to [to], assuming full leaves */
+static inline size_t leaves_to_scan(key__t from, key__t to) {
+    if (to < from) {
+        return 1;
+    }
+    key__t keys = to - from;
+    return keys / leaf_capacity() > RA_MAX_LEAVES ? RA_MAX_LEAVES : keys / leaf_capacity() + 1;
+}
+
+/* Read the leaf at [offset] that continues the scan of [query] from key [from] */
+static void read_next_leaf(struct RangeScan *scan, int db_fd, struct RangeQuery const *query, key__t from,
+                           ptr__t offset, Node *node) {
+    if (scan == NULL) {
+        checked_pread(db_fd, (void *) node, sizeof(Node), (long) offset);
+        return;
+    }
+    leaf_readahead_read(&scan->leaves, db_fd, offset, node, leaves_to_scan(from, query->range_end));
+}
+
+static inline int past_range_end(struct RangeQuery const *query, key__t key) {
+    return key > query->range_end || (key == query->range_end && !(query->flags & RNG_END_INCLUSIVE));
+}
+
+/**
+ * Returns a pointer to the record of the value of the [i]th key in the leaf [node], with at
+ * least the inline part of the value buffered after the header.
+ *
+ * Without coalescing, values are read one block at a time into [scratch]. With coalescing,
+ * the blocks holding the values of the following keys in the leaf are merged into one read
+ * when they are adjacent, and the read is extended to cover the rest of the range since the
+ * heap stores values in key order. Later keys are then served from the buffered window.
+ * Blocks at the start of the window that are in the value cache are copied from it, and
+ * the blocks read are added to it.
+ */
+static char *range_value(struct RangeScan *scan, int db_fd, struct RangeQuery const *query,
+                         Node const *node, unsigned int i, char *scratch, ptr__t *scratch_base) {
+    ptr__t ptr = decode(leaf_ptr(node, i));
+    ptr__t base = value_base(ptr);
+    size_t const record = value_record_size(value_len(leaf_ptr(node, i)));
+    size_t const needed = VAL_HDR_SIZE + value_inline_len(value_len(leaf_ptr(node, i)));
+
+    if (scan == NULL || scan->coalesce_bytes == 0) {
+        if (base != *scratch_base) {
+            checked_block_cache_pread(value_cache, db_fd, scratch, base);
+            *scratch_base = base;
+            if (scan != NULL) {
+                scan->value_reads += 1;
+                scan->value_bytes += BLK_SIZE;
+            }
+        }
+        return scratch + value_offset(ptr);
+    }
+
+    if (ptr >= scan->window_base && ptr + needed <= scan->window_base + scan->window_len) {
+        return scan->window + (ptr - scan->window_base);
+    }
+
+    /* Merge the run of adjacent blocks holding the remaining values of this leaf */
+    size_t const limit = scan->coalesce_bytes;
+    ptr__t end = base + BLK_SIZE;
+    for (unsigned int j = i + 1; j < node_nkeys(node) && !past_range_end(query, leaf_key(node, j)); ++j) {
+        ptr__t b = value_base(decode(leaf_ptr(node, j)));
+        if (b < base || b > end || (b == end && end + BLK_SIZE - base > limit)) {
+            break;
+        }
+        if (b == end) {
+            end += BLK_SIZE;
+        }
+    }
+
+    /* Read ahead for the keys left in the range; at most one value (of about this size) per remaining key */
+    key__t remaining = query->range_end - leaf_key(node, i) + 1;
+    size_t ahead = remaining > limit / record ? limit : remaining * record;
+    ahead = (value_offset(ptr) + ahead + BLK_SIZE - 1) & ~((size_t) BLK_SIZE - 1);
+    if (ahead > limit) {
+        ahead = limit;
+    }
+    if (base + ahead > end) {
+        end = base + ahead;
+    }
+
+    /* The leading blocks of the window that the value cache holds are not read again */
+    ptr__t from = base;
+    while (value_cache != NULL && from < end && block_cache_lookup(value_cache, from, scan->window + (from - base))) {
+        from += BLK_SIZE;
+    }
+    ssize_t bytes_read = 0;
+    if (from < end) {
+        bytes_read = pread(db_fd, scan->window + (from - base), end - from, (long) from);
+        if (bytes_read < 0) {
+            perror("range_value: ");
+            exit(1);
+        }
+        if (value_cache != NULL) {
+            for (ssize_t off = 0; off + BLK_SIZE <= bytes_read; off += BLK_SIZE) {
+                block_cache_insert(value_cache, from + off, scan->window + (from - base) + off);
+            }
+        }
+        scan->value_reads += 1;
+        scan->value_bytes += bytes_read;
+    }
+    /* May come up short at the end of the file, but must cover at least this value */
+    size_t window_len = from - base + (size_t) bytes_read;
+    if (window_len < value_offset(ptr) + needed) {
+        fprintf(stderr, "partial read %lu bytes of value data\n", window_len);
+        exit(1);
+    }
+    scan->window_base = base;
+    scan->window_len = window_len;
+    return scan->window + value_offset(ptr);
+}
+
+int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf_fd, struct RangeScan *scan) {
     char *scratch = (char *) aligned_alloca(0x1000, 0x1000);
     memset(scratch, 0, 0x1000);
     /* XRP code path */
@@ -109,7 +301,8 @@ int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf
 
         struct RangeQuery *scratch_query = (struct RangeQuery*) scratch;
         *scratch_query = *query;
-        long ret = syscall(SYS_READ_XRP, db_fd, buf, BLK_SIZE, query->_resume_from_leaf, bpf_fd, scratch);
+        ptr__t offset = query->_state == RNG_TRAVERSE ? superblock.root : query->_resume_from_leaf;
+        long ret = read_xrp(db_fd, buf, BLK_SIZE, (long) offset, bpf_fd, scratch);
         *query = *scratch_query;
         if (ret > 0) {
             return 0;
@@ -121,51 +314,48 @@ int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf
     Node *node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
 
     if (query->_state == RNG_RESUME) {
-        checked_pread(db_fd, (void *) node, sizeof(Node), (long) query->_resume_from_leaf);
+        read_next_leaf(scan, db_fd, query, query->range_begin, query->_resume_from_leaf, node);
     } else {
         ptr__t node_offset = 0;
-        if (_get_leaf_containing(db_fd, query->range_begin, node, ROOT_NODE_OFFSET, &node_offset) != 0) {
+        if (_get_leaf_containing(db_fd, query->range_begin, node, superblock.root, &node_offset) != 0) {
             fprintf(stderr, "Failed getting leaf node for key %ld\n", query->range_begin);
             return 1;
         }
-        query->_resume_from_leaf = node_offset;
+        query->_resume_from_leaf = decode(node_offset);
     }
 
     key__t first_key = query->flags & RNG_BEGIN_EXCLUSIVE ? query->range_begin + 1 : query->range_begin;
     unsigned long end_inclusive = query->flags & RNG_END_INCLUSIVE;
+    /* Value block currently in [scratch]; consecutive keys usually share a block */
+    ptr__t scratch_base = NO_BLOCK;
     for(;;) {
         /* Iterate over keys in leaf node */
-        unsigned int i = 0;
-        for (; i < NODE_CAPACITY && query->len < RNG_KEYS; ++i) {
-            if (node->key[i] > query->range_end || (node->key[i] == query->range_end && !end_inclusive)) {
+        unsigned int i = 0, nkeys = node_nkeys(node);
+        for (; i < nkeys && query->len < RNG_KEYS; ++i) {
+            key__t key = leaf_key(node, i);
+            if (key > query->range_end || (key == query->range_end && !end_inclusive)) {
                 /* All done; set state and return 0 */
                 mark_range_query_complete(query);
                 return 0;
             }
             /* Retrieve value for this key */
-            if (node->key[i] >= first_key) {
-                /*
-                 * TODO (etm): We perform one read for each value since our hypothetical assumption is
-                 *   that the values are stored in a random heap and not in sorted order (which they actually are).
-                 *   We should confirm that this is the correct assumption to make and also keep in mind that
-                 *   from user space there reads will be cached in the BIO layer unless we do direct IO using
-                 *   IO_URING or another facility.
-                 *
-                 *   This should be discussed before we run performance benchmarks.
-                 */
-
+            if (key >= first_key) {
                 /* This fiddiling around is necessary since we're using O_DIRECT */
-                ptr__t ptr = decode(node->ptr[i]);
-                checked_pread(db_fd, scratch, BLK_SIZE, (long) value_base(ptr));
+                char *value = range_value(scan, db_fd, query, node, i, scratch, &scratch_base);
                 /* What we do next depends on the type of opp we're doing */
+                unsigned int len = value_len(leaf_ptr(node, i));
                 if (query->agg_op == AGG_NONE) {
-                    memcpy(query->kv[query->len].value, scratch + value_offset(ptr), sizeof(val__t));
+                    memcpy(query->kv[query->len].value, value + VAL_HDR_SIZE, value_inline_len(len));
 
-                    query->kv[query->len].key = node->key[i];
+                    query->kv[query->len].key = key;
+                    query->kv[query->len].value_len = len;
                     query->len += 1;
                 }
                 else if (query->agg_op == AGG_SUM) {
-                    query->agg_value += *(long*) (scratch + value_offset(ptr));
+                    /* Records are not aligned */
+                    long v = 0;
+                    memcpy(&v, value + VAL_HDR_SIZE, len < sizeof(long) ? len : sizeof(long));
+                    query->agg_value += v;
                 }
             }
         }
@@ -177,7 +367,7 @@ int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf
             /* Query buffer is full; need to suspend and return */
             query->range_begin = query->kv[query->len - 1].key;
             query->flags |= RNG_BEGIN_EXCLUSIVE;
-            if (i < NODE_CAPACITY) {
+            if (i < nkeys) {
                 /* This node still has values we should inspect */
                 return 0;
             }
@@ -201,13 +391,13 @@ int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf
          * and need to get the next node.
          */
         query->_resume_from_leaf = node->next;
-        checked_pread(db_fd, (void *) node, sizeof(Node), (long) node->next);
+        read_next_leaf(scan, db_fd, query, nkeys ? leaf_key(node, nkeys - 1) : first_key, node->next, node);
     }
 }
 
 /* Simple function that prints the key; for use with `iterate_keys` */
 int iter_print(int idx, Node *node, void *state) {
-    printf("%ld\n", node->key[idx]);
+    printf("%ld\n", leaf_key(node, idx));
     return 0;
 }
 
@@ -231,26 +421,33 @@ int iterate_keys(char *filename, int levels, key__t start_key, key__t end_key,
     }
 
     Node node = { 0 };
-    if (get_leaf_containing(db_fd, start_key, &node, ROOT_NODE_OFFSET) != 0) {
+    struct LeafReadahead ra;
+    leaf_readahead_init(&ra);
+    if (get_leaf_containing(db_fd, start_key, &node, superblock.root) != 0) {
         fprintf(stderr, "Failed dumping keys\n");
         exit(1);
     }
     printf("Dumping keys in B+ tree\n");
+    int status = 0;
     for (;;) {
-        for (unsigned int i = 0; i < NODE_CAPACITY; ++i) {
-            if (node.key[i] >= end_key) {
+        for (unsigned int i = 0; i < node_nkeys(&node); ++i) {
+            if (leaf_key(&node, i) >= end_key) {
                 break;
             }
-            int status = fn(i, &node, fn_state);
+            status = fn(i, &node, fn_state);
             if (status != 0) {
-                return status;
+                goto out;
             }
         }
         if (node.next == 0) {
             break;
         }
-        checked_pread(db_fd, &node, sizeof(Node), (long) node.next);
+        /* Leaves emptied by deletes have no keys */
+        key__t from = node_nkeys(&node) ? leaf_key(&node, node_nkeys(&node) - 1) : start_key;
+        leaf_readahead_read(&ra, db_fd, node.next, &node, end_key > from ? (end_key - from) / leaf_capacity() + 1 : 1);
     }
+out:
+    leaf_readahead_free(&ra);
     close(db_fd);
-    return 0;
+    return status;
 }
@@ -2,12 +2,39 @@
 #define _RANGE_H
 
 #include "db_types.h"
+#include "readahead.h"
 
 struct ArgState;
 
+#define DEFAULT_COALESCE_BYTES (128 << 10)
+
+/* Userspace state carried across resubmissions of range queries */
+struct RangeScan {
+    /* Upper bound for one coalesced value read; 0 reads one block at a time */
+    size_t coalesce_bytes;
+
+    /* Value heap extent [window_base, window_base + window_len) held in [window] */
+    char *window;
+    ptr__t window_base;
+    size_t window_len;
+
+    /* Readahead along the leaf chain */
+    struct LeafReadahead leaves;
+
+    /* Statistics */
+    size_t value_reads;
+    size_t value_bytes;
+};
+
 int do_range_cmd(int argc, char *argv[], struct ArgState*);
 
-int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf_fd);
+void range_scan_init(struct RangeScan *scan, size_t coalesce_bytes);
+
+void range_scan_reset(struct RangeScan *scan);
+
+void range_scan_free(struct RangeScan *scan);
+
+int submit_range_query(struct RangeQuery *query, int db_fd, int use_xrp, int bpf_fd, struct RangeScan *scan);
 
 int iter_print(int idx, Node *node, void *state);
 
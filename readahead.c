@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "readahead.h"
+
+void leaf_readahead_init(struct LeafReadahead *ra) {
+    memset(ra, 0, sizeof(*ra));
+    for (int i = 0; i < 2; ++i) {
+        if (posix_memalign((void **) &ra->buf[i], BLK_SIZE, RA_MAX_LEAVES * BLK_SIZE)) {
+            perror("posix_memalign failed");
+            exit(1);
+        }
+    }
+    /* Without io_uring the windows are still read in one I/O, just not ahead of time */
+    ra->async = io_uring_queue_init(2, &ra->ring, 0) == 0;
+    ra->window = 1;
+}
+
+/* Wait for the read in flight; returns its result */
+static int wait_pending(struct LeafReadahead *ra) {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(&ra->ring, &cqe);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_wait_cqe failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    int res = cqe->res;
+    io_uring_cqe_seen(&ra->ring, cqe);
+    ra->pending = 0;
+    return res;
+}
+
+/* Drop the buffered leaves; call before starting a new scan */
+void leaf_readahead_reset(struct LeafReadahead *ra) {
+    if (ra->pending) {
+        wait_pending(ra);
+    }
+    ra->base = 0;
+    ra->len = 0;
+    ra->window = 1;
+}
+
+void leaf_readahead_free(struct LeafReadahead *ra) {
+    if (ra->pending) {
+        wait_pending(ra);
+    }
+    if (ra->async) {
+        io_uring_queue_exit(&ra->ring);
+    }
+    free(ra->buf[0]);
+    free(ra->buf[1]);
+}
+
+/* Start reading up to [max_leaves] leaves following the current window */
+static void prefetch(struct LeafReadahead *ra, int fd, size_t max_leaves) {
+    size_t n = ra->window < max_leaves ? ra->window : max_leaves;
+    if (!ra->async || ra->pending || n == 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ra->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    ra->pending_base = ra->base + ra->len;
+    io_uring_prep_read(sqe, fd, ra->buf[!ra->cur], n * BLK_SIZE, ra->pending_base);
+    if (io_uring_submit(&ra->ring) < 1) {
+        fprintf(stderr, "io_uring_submit failed\n");
+        exit(1);
+    }
+    ra->pending = 1;
+    ra->reads += 1;
+}
+
+/**
+ * Read the leaf at [offset] into [node], from the readahead window if possible.
+ *
+ * @param max_leaves - Upper bound on the number of leaves the scan still needs,
+ *        including this one; limits how far ahead we read
+ */
+void leaf_readahead_read(struct LeafReadahead *ra, int fd, ptr__t offset, Node *node, size_t max_leaves) {
+    if (max_leaves == 0) {
+        max_leaves = 1;
+    }
+
+    if (offset < ra->base || offset + BLK_SIZE > ra->base + ra->len) {
+        int have_window = 0;
+        if (ra->pending) {
+            int res = wait_pending(ra);
+            if (res > 0 && offset >= ra->pending_base && offset + BLK_SIZE <= ra->pending_base + res) {
+                ra->cur = !ra->cur;
+                ra->base = ra->pending_base;
+                ra->len = res & ~(BLK_SIZE - 1);
+                ra->prefetch_hits += 1;
+                have_window = 1;
+            }
+        }
+        if (!have_window) {
+            /* Not contiguous with the previous window (or first leaf of the scan) */
+            size_t n = ra->window < max_leaves ? ra->window : max_leaves;
+            ssize_t bytes_read = pread(fd, ra->buf[ra->cur], n * BLK_SIZE, (long) offset);
+            if (bytes_read < BLK_SIZE) {
+                if (bytes_read < 0) {
+                    perror("leaf_readahead_read: ");
+                } else {
+                    fprintf(stderr, "partial read %ld bytes of Node\n", bytes_read);
+                }
+                exit(1);
+            }
+            ra->base = offset;
+            ra->len = bytes_read & ~(BLK_SIZE - 1);
+            ra->reads += 1;
+        }
+
+        /* The scan moved into a new window, so expect it to continue; read further ahead */
+        if (ra->window < RA_MAX_LEAVES) {
+            ra->window *= 2;
+        }
+        size_t covered = (ra->base + ra->len - offset) / BLK_SIZE;
+        if (max_leaves > covered) {
+            prefetch(ra, fd, max_leaves - covered);
+        }
+    }
+    memcpy(node, ra->buf[ra->cur] + (offset - ra->base), BLK_SIZE);
+}
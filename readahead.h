@@ -0,0 +1,50 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <liburing.h>
+
+#include "db_types.h"
+
+/* Largest readahead window, in leaves */
+#define RA_MAX_LEAVES 64
+
+/*
+ * Readahead for scans along the leaf chain
+ *
+ * `create` writes the leaves of the tree contiguously, so the next leaves of a
+ * scan are usually the next blocks in the file. Leaves are read in windows of
+ * several blocks, and while a window is processed the next one is read
+ * asynchronously with io_uring. The window starts at one leaf and doubles each
+ * time the scan moves into a new window, so short scans do not pay for reads
+ * they never use.
+ */
+struct LeafReadahead {
+    struct io_uring ring;
+    int async;
+
+    /* Window currently held in buf[cur] */
+    char *buf[2];
+    int cur;
+    ptr__t base;
+    size_t len;
+
+    /* Read in flight into buf[!cur] */
+    int pending;
+    ptr__t pending_base;
+
+    unsigned int window;
+
+    /* Statistics */
+    size_t reads;
+    size_t prefetch_hits;
+};
+
+void leaf_readahead_init(struct LeafReadahead *ra);
+
+void leaf_readahead_reset(struct LeafReadahead *ra);
+
+void leaf_readahead_free(struct LeafReadahead *ra);
+
+void leaf_readahead_read(struct LeafReadahead *ra, int fd, ptr__t offset, Node *node, size_t max_leaves);
+
+#endif /* _READAHEAD_H_ */
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/file.h>
 #include <sys/types.h>
@@ -13,20 +14,44 @@
 #include "parse.h"
 #include "create.h"
 #include "get.h"
+#include "uring.h"
+#include "xrp_emu.h"
+#include "blkcache.h"
+#include "nodesearch.h"
+#include "write.h"
+#include "wal.h"
+#include "monitor.h"
+#include "keygen.h"
 
 size_t worker_num;
 size_t total_node;
 size_t *layer_cap;
 key__t max_key;
-Node *cache;
+size_t n_keys;
+struct Superblock superblock;
+static key__t *key_pool;
+static size_t key_pool_len;
+/* Distribution of the keys of get requests */
+static struct KeyDist key_dist;
+IndexNode *cache;
 size_t cache_cap;
+/* Number of cached levels */
+size_t cache_levels;
+/*
+ * Where the children of cache[i] are: cache[cache_child[i] + j] is child j, or for
+ * the last cached level cache_ptr[cache_child[i] + j] is its encoded file offset
+ */
+size_t *cache_child;
+ptr__t *cache_ptr;
 
 const char *argp_program_version = "SimpleKV 0.1";
 const char *argp_program_bug_address = "<etm2131@columbia.edu>";
 static char doc[] =
-"SimpleKV Benchmark for Oliver XRP Kernel\n\nCommands: create, get, range\v\
+"SimpleKV Benchmark for Oliver XRP Kernel\n\nCommands: create, get, range, put\v\
 This utility provides several tools for testing and benchmarking \
 SimpleKV database files on XRP enabled kernels. \
+Databases record their number of layers, so N_LAYERS may be 0 for \
+every command but create. \
 \n\nIf you are using XRP eBPF functions it is your responsibility to ensure \
 the correct function is loaded before executing your query with SimpleKV. \
 SimpleKV currently DOES NOT verify that the correct eBPF is loaded.";
@@ -45,21 +70,13 @@ int get_handler(char *db_path, int flag) {
 int initialize(size_t layer_num, int mode, char *db_path) {
     int db;
     if (mode == LOAD_MODE) {
+        /* `load` has already laid out the tree */
         db = get_handler(db_path, O_CREAT|O_TRUNC|O_WRONLY);
     } else {
         db = get_handler(db_path, O_RDONLY);
+        load_geometry(db, layer_num);
     }
 
-    layer_cap = (size_t *)malloc(layer_num * sizeof(size_t));
-    total_node = 1;
-    layer_cap[0] = 1;
-    for (size_t i = 1; i < layer_num; i++) {
-        layer_cap[i] = layer_cap[i - 1] * FANOUT;
-        total_node += layer_cap[i];
-    }
-    /* NOTE: this is actually 1 past the last key, since the keys start at 0 */
-    max_key = layer_cap[layer_num - 1] * NODE_CAPACITY;
-
     cache_cap = 0;
 
     printf("%lu blocks in total, max key is %lu\n", total_node, max_key);
@@ -67,15 +84,244 @@ int initialize(size_t layer_num, int mode, char *db_path) {
     return db;
 }
 
-/* Cache the first [layer_num] layers of the tree */
-void build_cache(int db_fd, size_t layer_num, size_t cache_level) {
-    /* Cache level cannot exceed min(layer_num, 3) */
-    cache_level = cache_level > layer_num ? layer_num : cache_level;
-    cache_level = cache_level > 3 ? 3 : cache_level;
+/* Set once `put` has split or merged nodes; see SB_RESHAPED */
+static int reshaped;
+
+/*
+ * Count the nodes of the level that starts at [offset] by following next pointers,
+ * and the entries of those nodes in [entries]. Runs of adjacent nodes are read in
+ * one go, which covers most of a level since put only moves the nodes it splits.
+ */
+static size_t count_level(int db_fd, ptr__t offset, size_t *entries) {
+    size_t const chunk = (4 << 20) / sizeof(Node);
+    Node *buf;
+    if (posix_memalign((void **) &buf, BLK_SIZE, chunk * sizeof(Node))) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+    ptr__t base = 0;
+    size_t len = 0, n = 0;
+    *entries = 0;
+    for (;;) {
+        if (offset < base || offset >= base + len * sizeof(Node)) {
+            ssize_t bytes_read = pread(db_fd, buf, chunk * sizeof(Node), (long) offset);
+            if (bytes_read < (ssize_t) sizeof(Node)) {
+                fprintf(stderr, "failed to read node at %lu\n", offset);
+                exit(1);
+            }
+            base = offset;
+            len = (size_t) bytes_read / sizeof(Node);
+        }
+        Node const *node = &buf[(offset - base) / sizeof(Node)];
+        n++;
+        *entries += node_nkeys(node);
+        if (node->next == 0) {
+            break;
+        }
+        offset = node->next;
+    }
+    free(buf);
+    return n;
+}
+
+/**
+ * Read the shape of the tree from the database [db_fd] into [layer_cap] (allocated
+ * here), [total_node], [max_key] and [n_keys], starting at the root named by the
+ * superblock. Trees need not be full, so this walks the leftmost path to find where
+ * each level starts and the rightmost path to find the largest key. Once `put` has
+ * reshaped the tree, levels are counted node by node instead. [n_keys] comes from
+ * the superblock, and is 0 (unknown) for reshaped trees whose last writer crashed.
+ *
+ * Exits if the tree does not have [layer_num] levels.
+ */
+void load_geometry(int db_fd, size_t layer_num) {
+    Node *node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
+    size_t first[layer_num], last[layer_num];
+    unsigned int leaf_keys = 0;
+    ptr__t left = superblock.root, right = superblock.root;
+    reshaped = (superblock.flags & SB_RESHAPED) != 0;
+    for (size_t i = 0;; ++i) {
+        checked_pread(db_fd, node, sizeof(Node), (long) left);
+        if ((node_type(node) == LEAF) != (i == layer_num - 1)) {
+            fprintf(stderr, "database does not have %lu layers\n", layer_num);
+            exit(1);
+        }
+        first[i] = left / BLK_SIZE;
+        leaf_keys = node_nkeys(node);
+        ptr__t leftmost_child = decode(node->ptr[0]);
+
+        checked_pread(db_fd, node, sizeof(Node), (long) right);
+        last[i] = right / BLK_SIZE;
+        if (i == layer_num - 1) {
+            break;
+        }
+        left = leftmost_child;
+        right = decode(node->ptr[node_nkeys(node) - 1]);
+    }
+    /* [node] is the last leaf; leaves emptied by deletes have no keys */
+    unsigned int last_keys = node_nkeys(node);
+    /* NOTE: this is actually 1 past the last key, since the keys start at 0 */
+    max_key = last_keys ? leaf_key(node, last_keys - 1) + 1 : 1;
+
+    free(layer_cap);
+    layer_cap = (size_t *)malloc(layer_num * sizeof(size_t));
+    BUG_ON(layer_cap == NULL);
+
+    if (reshaped) {
+        checked_pread(db_fd, node, sizeof(Node), superblock.root);
+        size_t entries = node_nkeys(node);
+        layer_cap[0] = 1;
+        total_node = 1;
+        for (size_t i = 1; i < layer_num; ++i) {
+            if (i == layer_num - 1) {
+                /* Every entry of the last internal level is a leaf */
+                layer_cap[i] = entries;
+            } else {
+                layer_cap[i] = count_level(db_fd, first[i] * BLK_SIZE, &entries);
+            }
+            total_node += layer_cap[i];
+        }
+        n_keys = superblock.n_keys;
+        printf("Tree was reshaped by put: %lu nodes\n", total_node);
+        return;
+    }
 
-    /* NB: This is a hack, but since we have global variables we need this */
+    /* The levels are laid out one after another, and the value heap starts right after the last leaf */
+    for (size_t i = 0; i + 1 < layer_num; ++i) {
+        layer_cap[i] = first[i + 1] - first[i];
+    }
+    layer_cap[layer_num - 1] = last[layer_num - 1] + 1 - first[layer_num - 1];
+    total_node = last[layer_num - 1] + 1 - first[0];
+    n_keys = superblock.n_keys;
+    if (n_keys == 0) {
+        /* Unknown after a crash; `create` fills all leaves but the last one equally */
+        n_keys = (layer_cap[layer_num - 1] - 1) * leaf_keys + last_keys;
+    }
+}
+
+/*
+ * Databases loaded with `create --from` have arbitrary keys, so random numbers below
+ * [max_key] would mostly miss. Lookups then draw from a pool of keys read from evenly
+ * spaced leaves instead. Reshaped trees are sampled the same way, finding the leaves
+ * by looking up evenly spaced keys since they are no longer stored in order.
+ */
+#define KEY_POOL_MAX (1ul << 22)
+
+void build_key_pool(int db_fd, size_t layer_num) {
+    if (n_keys == max_key) {
+        /* Every key below max_key exists */
+        return;
+    }
+    size_t leaves = layer_cap[layer_num - 1];
+    /* The leaves are the last level of the index, which starts at the root */
+    size_t first_leaf = superblock.root / BLK_SIZE + total_node - leaves;
+    size_t stride = reshaped ? 1 : (n_keys + KEY_POOL_MAX - 1) / KEY_POOL_MAX;
+    size_t samples = (leaves + stride - 1) / stride;
+    if (reshaped && samples > KEY_POOL_MAX / NODE_CAPACITY) {
+        samples = KEY_POOL_MAX / NODE_CAPACITY;
+    }
+    key_pool = malloc(samples * leaf_capacity() * sizeof(key__t));
+    BUG_ON(key_pool == NULL);
+    key_pool_len = 0;
+
+    Node *node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
+    key__t prev_first = KEY_PAD;
+    for (size_t i = 0; i < samples; ++i) {
+        if (reshaped) {
+            if (get_leaf_containing(db_fd, (key__t) ((double) max_key * i / samples), node, superblock.root) != 0) {
+                fprintf(stderr, "failed to sample keys\n");
+                exit(1);
+            }
+            /* Nearby samples can land in the same leaf */
+            if (node_nkeys(node) == 0 || leaf_key(node, 0) == prev_first) {
+                continue;
+            }
+            prev_first = leaf_key(node, 0);
+        } else {
+            checked_pread(db_fd, node, sizeof(Node), (long) ((first_leaf + i * stride) * BLK_SIZE));
+        }
+        for (unsigned int k = 0; k < node_nkeys(node); ++k) {
+            key_pool[key_pool_len++] = leaf_key(node, k);
+        }
+    }
+    if (key_pool_len == 0) {
+        fprintf(stderr, "database has no keys\n");
+        exit(1);
+    }
+    printf("%s: looking up %lu keys sampled from the leaves\n",
+           reshaped ? "Tree was reshaped" : "Keys are sparse", key_pool_len);
+}
+
+/* Key number [index] of the database, in key order (roughly, for sampled keys) */
+static key__t key_at(uint64_t index) {
+    return key_pool != NULL ? key_pool[index] : (key__t) index;
+}
+
+/* Draw the keys of the next (up to) KEY_BUF_LEN requests of worker [r] */
+void draw_keys(WorkerArg *r) {
+    size_t n = r->op_count - r->keys_drawn < KEY_BUF_LEN ? r->op_count - r->keys_drawn : KEY_BUF_LEN;
+    for (size_t i = 0; i < n; ++i) {
+        r->keys[i] = key_at(keygen_next(&r->keygen));
+    }
+    r->keys_len = n;
+    r->keys_used = 0;
+    r->keys_drawn += n;
+}
+
+/* Set up the key generator of worker [r] and draw its first keys before the run */
+static void generate_keys(WorkerArg *r) {
+    keygen_init(&r->keygen, &key_dist, monotonic_ns() ^ ((uint64_t) r->index << 48), key_dist.n / worker_num * r->index);
+    r->keys = malloc(KEY_BUF_LEN * sizeof(key__t));
+    BUG_ON(r->keys == NULL);
+    r->keys_drawn = 0;
+    draw_keys(r);
+}
+
+/* Number of whole index levels (at most [layer_num] - 1) whose nodes fit in [budget] bytes */
+size_t cache_levels_for_budget(size_t layer_num, size_t budget) {
+    size_t levels = 0, bytes = 0;
+    while (levels + 1 < layer_num) {
+        bytes += layer_cap[levels] * (sizeof(IndexNode) + sizeof(size_t));
+        /* The last cached level also keeps the file offsets of its children */
+        if (bytes + layer_cap[levels] * NODE_CAPACITY * sizeof(ptr__t) > budget) {
+            break;
+        }
+        ++levels;
+    }
+    return levels;
+}
+
+/* Copy the search keys of [node] into the cached node [in] */
+static void fill_index_node(IndexNode *in, Node const *node) {
+    key__t *line = &in->line[0][0];
+    for (size_t i = 0; i < INDEX_LINES * LINE_KEYS; ++i) {
+        line[i] = i + 1 < node_nkeys(node) ? node->key[i + 1] : KEY_PAD;
+    }
+    key__t *summary = &in->summary[0][0];
+    for (size_t i = 0; i < SUMMARY_LINES * LINE_KEYS; ++i) {
+        summary[i] = i + 1 < INDEX_LINES ? in->line[i + 1][0] : KEY_PAD;
+    }
+}
+
+/* Index of the child of the cached node [in] to follow for [key]; same as nxt_node */
+static inline size_t index_child(IndexNode const *in, key__t key) {
+    size_t line = 0;
+    for (size_t i = 0; i < SUMMARY_LINES; ++i) {
+        unsigned int n = line_child_index(key, in->summary[i]);
+        line += n;
+        if (n < LINE_KEYS) {
+            break;
+        }
+    }
+    return line * LINE_KEYS + line_child_index(key, in->line[line]);
+}
+
+/* Cache the first [cache_level] layers of the tree */
+void build_cache(int db_fd, size_t layer_num, size_t cache_level) {
+    /* Leaves are never cached; lookups always read at least the leaf and the value */
+    cache_level = cache_level >= layer_num ? layer_num - 1 : cache_level;
+    printf("Expected I/Os per userspace lookup: %lu\n", layer_num - cache_level + 1);
     if (cache_level == 0) {
-        cache = malloc(BLK_SIZE);
         return;
     }
 
@@ -84,30 +330,87 @@ void build_cache(int db_fd, size_t layer_num, size_t cache_level) {
         entry_num += layer_cap[i];
     }
 
-    if (posix_memalign((void **)&cache, 512, entry_num * sizeof(Node))) {
+    /* Levels are stored in order from the root on, so the cached nodes are one contiguous extent */
+    Node *nodes;
+    if (posix_memalign((void **) &nodes, BLK_SIZE, entry_num * sizeof(Node))) {
         perror("posix_memalign failed");
         exit(1);
     }
+    size_t const chunk = (8 << 20) / sizeof(Node);
+    for (size_t i = 0; i < entry_num; i += chunk) {
+        size_t n = entry_num - i < chunk ? entry_num - i : chunk;
+        checked_pread(db_fd, &nodes[i], n * sizeof(Node), (long) (superblock.root + i * sizeof(Node)));
+    }
 
-    size_t head = 0, tail = 1;
-    read_node(encode(0), &cache[head], db_fd);
+    size_t last_level = layer_cap[cache_level - 1];
+    if (posix_memalign((void **) &cache, 64, entry_num * sizeof(IndexNode))) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+    cache_child = malloc(entry_num * sizeof(size_t));
+    cache_ptr = malloc(last_level * NODE_CAPACITY * sizeof(ptr__t));
+    if (cache_child == NULL || cache_ptr == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-    while (tail < entry_num) {
-        for (size_t i = 0; i < NODE_CAPACITY; i++) {
-            read_node(cache[head].ptr[i], &cache[tail], db_fd);
-            cache[head].ptr[i] = (ptr__t)(&cache[tail]); // in-memory cache entry has in-memory pointer
-            tail++;
+    /*
+     * Renumber the cached nodes in BFS order, so the children of a node are adjacent
+     * and only the index of the first one has to be stored
+     */
+    ptr__t *file_offset = malloc(entry_num * sizeof(ptr__t));
+    BUG_ON(file_offset == NULL);
+    Node *outside = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
+    file_offset[0] = superblock.root;
+    size_t level_begin = 0, level_end = 1, next = 1, n_ptrs = 0;
+    for (size_t level = 0; level < cache_level; ++level) {
+        for (size_t i = level_begin; i < level_end; ++i) {
+            Node const *node = outside;
+            if (file_offset[i] >= superblock.root && (file_offset[i] - superblock.root) / sizeof(Node) < entry_num) {
+                node = &nodes[(file_offset[i] - superblock.root) / sizeof(Node)];
+            } else {
+                /* Not in the extent; read it on its own */
+                checked_pread(db_fd, outside, sizeof(Node), (long) file_offset[i]);
+            }
+            fill_index_node(&cache[i], node);
+            if (level + 1 < cache_level) {
+                cache_child[i] = next;
+                for (size_t j = 0; j < node_nkeys(node); ++j) {
+                    file_offset[next++] = decode(node->ptr[j]);
+                }
+            } else {
+                cache_child[i] = n_ptrs;
+                for (size_t j = 0; j < node_nkeys(node); ++j) {
+                    cache_ptr[n_ptrs++] = node->ptr[j];
+                }
+            }
         }
-        head++;
+        level_begin = level_end;
+        level_end = next;
     }
+    free(file_offset);
+    free(nodes);
 
+    cache_levels = cache_level;
     cache_cap = entry_num; // enable the cache
-    printf("Cache built. %lu layers %lu entries in total.\n", cache_level, entry_num);
+    printf("Cache built. %lu layers %lu entries in total (%.1f MiB).\n", cache_level, entry_num,
+           (double) (entry_num * (sizeof(IndexNode) + sizeof(size_t)) + n_ptrs * sizeof(ptr__t)) / (1 << 20));
 }
 
 void free_globals(void) {
     free(layer_cap);
     free(cache);
+    free(key_pool);
+    key_pool = NULL;
+    free(cache_child);
+    free(cache_ptr);
+    cache = NULL;
+    cache_child = NULL;
+    cache_ptr = NULL;
+    block_cache_free(node_cache);
+    node_cache = NULL;
+    block_cache_free(value_cache);
+    value_cache = NULL;
 }
 
 int terminate(void) {
@@ -116,25 +419,38 @@ int terminate(void) {
     return 0;
 }
 
-void initialize_workers(WorkerArg *args, size_t total_op_count, char *db_path, int use_xrp, int bpf_fd) {
-    size_t offset = 0;
-    args[0].latency_arr = (size_t *) malloc(total_op_count * sizeof(size_t));
-    BUG_ON(args[0].latency_arr == NULL);
+void initialize_workers(WorkerArg *args, size_t total_op_count, char *db_path, struct GetArgs const *ga, int bpf_fd) {
     for (size_t i = 0; i < worker_num; i++) {
         args[i].index = i;
         args[i].op_count = (total_op_count / worker_num) + (i < total_op_count % worker_num);
-        args[i].db_handler = get_handler(db_path, O_RDONLY);
+        args[i].db_handler = get_handler(db_path, ga->write_ratio > 0 ? O_RDWR : O_RDONLY);
         args[i].timer = 0;
-        args[i].use_xrp = use_xrp;
+        args[i].use_xrp = ga->xrp;
         args[i].bpf_fd = bpf_fd;
-        args[i].latency_arr = args[0].latency_arr + offset;
-        offset += args[i].op_count;
+        args[i].latency = hist_new();
+        args[i].batch = ga->batch;
+        args[i].use_uring = ga->uring;
+        args[i].queue_depth = ga->queue_depth;
+        args[i].sqpoll = ga->sqpoll;
+        args[i].fixed_bufs = ga->fixed_bufs;
+        args[i].write_ratio = ga->write_ratio;
+        args[i].writes = 0;
+        args[i].value_size = ga->value_size ? ga->value_size : DEFAULT_VAL_LEN;
+        args[i].write_latency = ga->write_ratio > 0 ? hist_new() : NULL;
+        args[i].phases = NULL;
+        if (ga->phases) {
+            args[i].phases = calloc(1, sizeof(struct PhaseStats));
+            BUG_ON(args[i].phases == NULL);
+        }
+        args[i].open_loop = ga->rate > 0;
+        args[i].send_delay = 0;
+        generate_keys(&args[i]);
     }
 }
 
 void start_workers(pthread_t *tids, WorkerArg *args) {
     for (size_t i = 0; i < worker_num; i++) {
-        pthread_create(&tids[i], NULL, subtask, (void*)&args[i]);
+        pthread_create(&tids[i], NULL, args[i].use_uring ? uring_subtask : subtask, (void*)&args[i]);
     }
 }
 
@@ -142,142 +458,410 @@ void terminate_workers(pthread_t *tids, WorkerArg *args) {
     for (size_t i = 0; i < worker_num; i++) {
         pthread_join(tids[i], NULL);
         close(args[i].db_handler);
+        free(args[i].keys);
+        args[i].keys = NULL;
     }
 }
 
-int cmp(const void *a, const void *b) {
-    size_t val_a = *((const size_t *) a);
-    size_t val_b = *((const size_t *) b);
-    if (val_a == val_b) {
-        return 0;
-    } else if (val_a < val_b) {
-        return -1;
-    } else {
-        return 1;
+/* Percentiles printed when none are given, in percent */
+static double const default_percentiles[] = { 95, 99, 99.9 };
+
+/* Print the [n] [percentiles] of [h]; [prefix] names the kind of request, if not all of them */
+static void print_percentiles(char const *prefix, struct Histogram const *h, double const *percentiles, int n) {
+    for (int i = 0; i < n; i++) {
+        char label[16];
+        snprintf(label, sizeof(label), "%g%%", percentiles[i]);
+        printf("%s%-6s latency: %f us\n", prefix, label, (double) hist_percentile(h, percentiles[i] / 100) / 1000);
     }
 }
 
-static double get_percentile(size_t *latency_arr, size_t request_num, double percentile)
-{
-    double exact_index = ((double) (request_num - 1)) * percentile;
-    double left_index = floor(exact_index);
-    double right_index = ceil(exact_index);
-
-    double left_value = (double) latency_arr[(size_t) left_index];
-    double right_value = (double) latency_arr[(size_t) right_index];
-    double value = left_value + (exact_index - left_index) * (right_value - left_value);
-    return value;
+/* Merge the latency histograms of the workers, or their update latency histograms if [writes], and free them */
+static struct Histogram *merge_histograms(WorkerArg *args, int writes) {
+    struct Histogram *total = hist_new();
+    for (size_t i = 0; i < worker_num; i++) {
+        struct Histogram **h = writes ? &args[i].write_latency : &args[i].latency;
+        hist_merge(total, *h);
+        free(*h);
+        *h = NULL;
+    }
+    return total;
 }
 
-static void print_tail_latency(WorkerArg* args, size_t request_num) {
-    size_t *latency_arr = args[0].latency_arr;
-    qsort(latency_arr, request_num, sizeof(size_t), cmp);
+/* Add up the phase timings of all workers, print them and free them */
+static void print_phases(WorkerArg *args) {
+    struct PhaseStats total = { 0 };
+    for (size_t i = 0; i < worker_num; i++) {
+        phase_stats_add(&total, args[i].phases);
+        free(args[i].phases);
+        args[i].phases = NULL;
+    }
+    phase_stats_print(&total);
+}
 
-    printf("95%%   latency: %f us\n", get_percentile(latency_arr, request_num, 0.95) / 1000);
-    printf("99%%   latency: %f us\n", get_percentile(latency_arr, request_num, 0.99) / 1000);
-    printf("99.9%% latency: %f us\n", get_percentile(latency_arr, request_num, 0.999) / 1000);
+/* Write the latency histograms to [path], as JSON if it ends in .json and CSV otherwise */
+static void dump_latency(char const *path, struct Histogram const *latency, struct Histogram const *write_latency,
+                         double const *percentiles, int n_percentiles) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = strlen(path);
+    if (len >= 5 && strcasecmp(path + len - 5, ".json") == 0) {
+        fprintf(out, "{\"unit\": \"ns\", \"requests\": ");
+        hist_dump_json(latency, percentiles, n_percentiles, out);
+        if (write_latency != NULL) {
+            fprintf(out, ", \"updates\": ");
+            hist_dump_json(write_latency, percentiles, n_percentiles, out);
+        }
+        fprintf(out, "}\n");
+    } else {
+        fprintf(out, "histogram,low_ns,high_ns,count\n");
+        hist_dump_csv(latency, "requests", out);
+        if (write_latency != NULL) {
+            hist_dump_csv(write_latency, "updates", out);
+        }
+    }
+    if (fclose(out) != 0) {
+        perror(path);
+        exit(1);
+    }
+    printf("Latency histograms written to %s\n", path);
 }
 
-int run(char *db_path, size_t layer_num, size_t request_num, size_t thread_num, int use_xrp,
-            int bpf_fd, size_t cache_level) {
+int run(char *db_path, struct GetArgs const *ga, int bpf_fd) {
+    size_t layer_num = ga->database_layers;
+    size_t request_num = ga->requests;
 
-    printf("Running benchmark with %ld layers, %ld requests, and %ld thread(s)\n",
-                layer_num, request_num, thread_num);
+    printf("Running benchmark with %ld layers, %ld requests, and %d thread(s)\n",
+                layer_num, request_num, ga->threads);
+    if (ga->batch > 1) {
+        printf("Looking up %d keys per request\n", ga->batch);
+    }
+    if (ga->uring) {
+        printf("Using io_uring engine: queue depth %d%s%s\n", ga->queue_depth,
+               ga->sqpoll ? ", SQPOLL" : "", ga->fixed_bufs ? ", fixed buffers" : "");
+    }
+    if (ga->rate > 0) {
+        printf("Offering %.1f requests per second with %s arrivals\n", ga->rate,
+               ga->arrivals == ARRIVAL_FIXED ? "evenly spaced" : "Poisson");
+    }
+    printf("Node search: %s\n", node_search_name());
     int db_fd = initialize(layer_num, RUN_MODE, db_path);
-    /* Cache up to 3 layers of the B+tree */
+    /* Cache the top layers of the B+tree */
+    size_t cache_level = ga->cache_level;
+    if (ga->cache_bytes > 0) {
+        cache_level = cache_levels_for_budget(layer_num, ga->cache_bytes);
+        printf("Cache budget of %lu bytes fits %lu layers\n", ga->cache_bytes, cache_level);
+    }
     build_cache(db_fd, layer_num, cache_level);
+    build_key_pool(db_fd, layer_num);
+    if (!(superblock.flags & SB_GENERATED_VALUES)) {
+        printf("Values were not generated by create, so they are not checked\n");
+    }
+    key_dist_init(&key_dist, &ga->keys, key_pool != NULL ? key_pool_len : max_key);
+    key_dist_print(&key_dist);
+    if (ga->node_cache_bytes > 0) {
+        node_cache = block_cache_new(ga->node_cache_bytes);
+    }
+    if (ga->value_cache_bytes > 0) {
+        value_cache = block_cache_new(ga->value_cache_bytes);
+    }
 
-    worker_num = thread_num;
+    worker_num = ga->threads;
+    /* [db_fd] is read only; the write path updates the superblock through its own handle */
+    int write_fd = -1;
+    if (ga->write_ratio > 0) {
+        printf("Updating keys in %.1f%% of the requests\n", 100 * ga->write_ratio);
+        write_fd = get_handler(db_path, O_RDWR);
+        write_path_init(write_fd, worker_num);
+        if (ga->compact) {
+            write_path_scan_values(write_fd);
+        }
+        if (ga->wal.enabled) {
+            write_path_attach_wal(wal_open(db_path, &ga->wal));
+        }
+    }
+    int compact_fd = -1;
+    if (ga->compact) {
+        compact_fd = get_handler(db_path, O_RDWR);
+        compactor_start(compact_fd);
+    }
     struct timespec start, end;
     pthread_t tids[worker_num];
     WorkerArg args[worker_num];
 
-    initialize_workers(args, request_num, db_path, use_xrp, bpf_fd);
+    initialize_workers(args, request_num, db_path, ga, bpf_fd);
+    if (ga->monitor != NULL) {
+        struct Histogram *latency[worker_num], *write_latency[worker_num];
+        for (size_t i = 0; i < worker_num; i++) {
+            latency[i] = args[i].latency;
+            write_latency[i] = args[i].write_latency;
+        }
+        monitor_start(ga->monitor, ga->monitor_interval_ms ? ga->monitor_interval_ms : DEFAULT_MONITOR_INTERVAL_MS,
+                      latency, write_latency, worker_num);
+    }
 
     clock_gettime(CLOCK_REALTIME, &start);
     srandom(start.tv_nsec ^ start.tv_sec);
+    if (ga->rate > 0) {
+        /* Stagger the schedules, so evenly spaced arrivals stay evenly spaced across threads */
+        uint64_t now = monotonic_ns();
+        for (size_t i = 0; i < worker_num; i++) {
+            arrivals_init(&args[i].arrivals, ga->rate / (double) worker_num, ga->arrivals,
+                          now + (uint64_t) ((double) i * NS_PER_SEC / ga->rate), (unsigned int) (random() ^ i));
+        }
+    }
     start_workers(tids, args);
     terminate_workers(tids, args);
     clock_gettime(CLOCK_REALTIME, &end);
+    if (ga->monitor != NULL) {
+        monitor_stop();
+    }
+    if (ga->compact) {
+        compactor_stop();
+        close(compact_fd);
+    }
 
     long total_latency = 0;
-    for (size_t i = 0; i < worker_num; i++) total_latency += args[i].timer;
+    size_t send_delay = 0;
+    for (size_t i = 0; i < worker_num; i++) {
+        total_latency += args[i].timer;
+        send_delay += args[i].send_delay;
+    }
     long run_time = 1000000000 * (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec);
 
     printf("Average throughput: %f op/s latency: %f usec\n", 
             (double)request_num / run_time * 1000000000, (double)total_latency / request_num / 1000);
-    print_tail_latency(args, request_num);
-
-    size_t num_extreme_latency = 0;
-    for (size_t i = 0; i < request_num; ++i) {
-        if (args[0].latency_arr[i] >= 1000000) {
-            ++num_extreme_latency;
+    if (ga->rate > 0) {
+        /* Requests sent late were queued behind earlier ones; the wait is part of their latency */
+        printf("Requests were sent %f usec after they were due on average\n",
+               (double) send_delay / (double) request_num / 1000);
+    }
+    double const *percentiles = ga->n_percentiles ? ga->percentiles : default_percentiles;
+    int n_percentiles = ga->n_percentiles ? ga->n_percentiles
+                                          : (int) (sizeof(default_percentiles) / sizeof(default_percentiles[0]));
+    struct Histogram *latency = merge_histograms(args, 0);
+    print_percentiles("", latency, percentiles, n_percentiles);
+    if (ga->phases) {
+        print_phases(args);
+    }
+    if (is_xrp_emu_fd(bpf_fd)) {
+        xrp_emu_print_stats(request_num);
+    }
+    block_cache_print_stats(node_cache, "Node");
+    block_cache_print_stats(value_cache, "Value");
+    struct Histogram *write_latency = NULL;
+    if (ga->write_ratio > 0) {
+        write_latency = merge_histograms(args, 1);
+        printf("%lu of the requests were updates, latency: %f usec\n", write_latency->count,
+               hist_mean(write_latency) / 1000);
+        if (write_latency->count > 0) {
+            print_percentiles("Update ", write_latency, percentiles, n_percentiles);
         }
+        write_path_print_stats();
+        write_path_close_wal(write_fd);
+        write_path_close(write_fd);
+        write_path_free();
+        close(write_fd);
     }
+
+    size_t num_extreme_latency = hist_count_at_least(latency, 1000000);
     printf("Percentage of requests with latency >= 1ms: %.4f%%\n",
            (100.0 * (double) num_extreme_latency) / ((double) request_num));
+    if (ga->latency_dump != NULL) {
+        dump_latency(ga->latency_dump, latency, write_latency, percentiles, n_percentiles);
+    }
 
-    free(args[0].latency_arr);
+    free(latency);
+    free(write_latency);
 
     return terminate();
 }
 
+/* Traverse the cached levels of the index; returns the file offset to continue the lookup from */
+ptr__t cached_index_offset(key__t key) {
+    /* Use the cache, if it's set */
+    if (cache_cap == 0) {
+        return superblock.root;
+    }
+    size_t n = 0;
+    for (size_t level = 1; level < cache_levels; ++level) {
+        n = cache_child[n] + index_child(&cache[n], key);
+    }
+    return decode(cache_ptr[cache_child[n] + index_child(&cache[n], key)]);
+}
+
+/* Parse and check value from db */
+void check_lookup_result(WorkerArg const *r, key__t key, struct Query const *query, long retval) {
+    char buf[sizeof(val__t) + 1];
+    buf[sizeof(val__t)] = '\0';
+    memcpy(buf, query->value, sizeof(val__t));
+    unsigned long long_val = strtoul(buf, NULL, 10);
+
+    /* Check result, print errors, etc */
+    if (retval < 0) {
+        fprintf(stderr, "XRP pread failed with code %d\n", errno);
+    } else if (query->found == 0) {
+        fprintf(stderr, "Value for key %ld not found\n", key);
+    } else if ((superblock.flags & SB_GENERATED_VALUES) && key != long_val) {
+        printf("Error! key: %lu val: %s thrd: %ld\n", key, buf, r->index);
+    }
+}
+
+/**
+ * Time the next request of [r] counts as sent. With --rate, that is when it arrives:
+ * wait for that time, and set [sent] to the time it is actually sent. Otherwise it
+ * is sent now.
+ */
+static uint64_t next_request(WorkerArg *r, uint64_t *sent) {
+    if (!r->open_loop) {
+        return *sent = monotonic_ns();
+    }
+    uint64_t arrival = arrivals_next(&r->arrivals);
+    *sent = arrival_wait(arrival);
+    r->send_delay += *sent - arrival;
+    return arrival;
+}
+
+/**
+ * Issue the worker's lookups in batches of [r->batch] keys; each key is charged the
+ * batch latency. With --rate, a batch is sent when its last key arrives, and the
+ * latency of each key is counted from its own arrival.
+ */
+static void subtask_batch(WorkerArg *r) {
+    key__t *keys = malloc(r->batch * sizeof(key__t));
+    struct MaybeValue *values = malloc(r->batch * sizeof(struct MaybeValue));
+    uint64_t *arrival = malloc(r->batch * sizeof(uint64_t));
+    BUG_ON(keys == NULL || values == NULL || arrival == NULL);
+    /* Lookups return the start of each value; long ones are read whole afterwards */
+    unsigned char value[MAX_VAL_LEN];
+
+    for (size_t i = 0; i < r->op_count; i += r->batch) {
+        int n = r->op_count - i < (size_t) r->batch ? (int) (r->op_count - i) : r->batch;
+        for (int j = 0; j < n; ++j) {
+            keys[j] = next_key(r);
+        }
+        uint64_t sent = 0;
+        for (int j = 0; j < n; ++j) {
+            arrival[j] = next_request(r, &sent);
+        }
+
+        long retval = lookup_batch(r->db_handler, r->use_xrp, r->bpf_fd, keys, n, values);
+        for (int j = 0; retval == 0 && j < n; ++j) {
+            if (values[j].found && values[j].value_len > VAL_SIZE) {
+                uint64_t phase = phase_start();
+                read_value(r->db_handler, values[j].value_ptr, values[j].value_len, value);
+                phase_end(PHASE_VALUE, phase);
+            }
+        }
+        uint64_t end = monotonic_ns();
+        phase_lookups(n, end - sent);
+
+        for (int j = 0; j < n; ++j) {
+            size_t latency = end - arrival[j];
+            r->timer += latency;
+            hist_record(r->latency, latency);
+
+            struct Query query = new_query(keys[j]);
+            query.found = values[j].found;
+            query.value_len = values[j].value_len;
+            memcpy(query.value, values[j].value, sizeof(val__t));
+            check_lookup_result(r, keys[j], &query, retval);
+        }
+    }
+    free(keys);
+    free(values);
+    free(arrival);
+}
+
 void *subtask(void *args) {
     WorkerArg *r = (WorkerArg*)args;
-    struct timespec tps, tpe;
     srand(r->index);
     printf("thread %ld op_count %ld\n", r->index, r->op_count);
+    phase_stats = r->phases;
+    if (r->batch > 1) {
+        subtask_batch(r);
+        return NULL;
+    }
+    unsigned char value[MAX_VAL_LEN];
     for (size_t i = 0; i < r->op_count; i++) {
-        key__t key = random() % max_key;
+        key__t key = next_key(r);
+        uint64_t sent;
+
+        if (r->write_ratio > 0 && random() < r->write_ratio * RAND_MAX) {
+            /* Store the same text as the generated value, so lookups still check out */
+            format_value((char *) value, key, r->value_size);
+            uint64_t start = next_request(r, &sent);
+            kv_put(r->db_handler, key, value, r->value_size);
+            write_path_commit(r->db_handler);
+            size_t latency = monotonic_ns() - start;
+            r->timer += latency;
+            hist_record(r->latency, latency);
+            hist_record(r->write_latency, latency);
+            r->writes++;
+            continue;
+        }
 
         /* Time and execute the XRP lookup */
-        clock_gettime(CLOCK_REALTIME, &tps);
+        uint64_t start = next_request(r, &sent);
 
         struct Query query = new_query(key);
-
-        ptr__t index_offset = ROOT_NODE_OFFSET;
-        /* Use the cache, if it's set */
-        if (cache_cap > 0) {
-            index_offset = (ptr__t) (&cache[0]);
-            do {
-                index_offset = nxt_node(key, (Node *) index_offset);
-            } while (!is_file_offset(index_offset));
-            index_offset = decode(index_offset);
+        reader_enter(r->index);
+        uint64_t phase = phase_start();
+        ptr__t index_offset = cached_index_offset(key);
+        if (cache_cap != 0) {
+            phase_end(PHASE_CACHED, phase);
         }
 
         long retval;
         if (r->use_xrp) {
-            retval = lookup_bpf(r->db_handler, r->bpf_fd, &query, ROOT_NODE_OFFSET);
+            retval = lookup_bpf(r->db_handler, r->bpf_fd, &query, superblock.root);
         } else {
-            retval = lookup_key_userspace(r->db_handler, &query, index_offset);
+            retval = lookup_key_userspace(r->db_handler, &query, index_offset, value);
         }
+        /* XRP returns the start of the value; the value blocks must not be reused before we are done reading them */
+        if (r->use_xrp && retval >= 0 && query.found && query.value_len > VAL_SIZE) {
+            phase = phase_start();
+            read_value(r->db_handler, query.value_ptr, query.value_len, value);
+            phase_end(PHASE_VALUE, phase);
+        }
+        reader_exit(r->index);
 
-        clock_gettime(CLOCK_REALTIME, &tpe);
-        size_t latency = 1000000000 * (tpe.tv_sec - tps.tv_sec) + (tpe.tv_nsec - tps.tv_nsec);
+        uint64_t end = monotonic_ns();
+        size_t latency = end - start;
         r->timer += latency;
-        r->latency_arr[i] = latency;
-
-        /* Parse and check value from db */
-        char buf[sizeof(val__t) + 1];
-        buf[sizeof(val__t)] = '\0';
-        memcpy(buf, query.value, sizeof(val__t));
-        unsigned long long_val = strtoul(buf, NULL, 10);
-
-
-        /* Check result, print errors, etc */
-        if (retval < 0) {
-            fprintf(stderr, "XRP pread failed with code %d\n", errno);
-        } else if (query.found == 0) {
-            fprintf(stderr, "Value for key %ld not found\n", key);
-        } else if (key != long_val) {
-            printf("Error! key: %lu val: %s thrd: %ld\n", key, buf, r->index);
-        }
+        hist_record(r->latency, latency);
+        phase_lookups(1, end - sent);
+
+        check_lookup_result(r, key, &query, retval);
     }
     return NULL;
 }
 
 void read_node(ptr__t ptr, Node *node, int db_handler) {
-    checked_pread(db_handler, node, sizeof(Node), decode(ptr));
+    checked_block_cache_pread(node_cache, db_handler, node, decode(ptr));
+}
+
+/*
+ * Read the superblock of the existing database named on the command line, after
+ * applying the changes a crashed writer left in the log (which can change the
+ * height of the tree). An N_LAYERS of 0 takes the layer count from the superblock;
+ * any other value has to match it. Subcommands call this once their options are
+ * parsed, so --help works without a database.
+ */
+void open_database(struct ArgState *as) {
+    wal_recover(as->filename);
+    int db_fd = get_handler(as->filename, O_RDONLY);
+    superblock_read(db_fd, as->filename, &superblock);
+    close(db_fd);
+    if (as->layers == 0) {
+        as->layers = (int) superblock.layers;
+    } else if ((uint32_t) as->layers != superblock.layers) {
+        fprintf(stderr, "%s has %u layers, not %d (pass 0 to use the layer count of the database)\n",
+                as->filename, superblock.layers, as->layers);
+        exit(1);
+    }
 }
 
 
@@ -303,6 +887,9 @@ static int parse_opt(int key, char *arg, struct argp_state *state) {
 
             /* command name */
             case 2:
+                if (strncmp(arg, CREATE_CMD, sizeof(CREATE_CMD)) == 0 && st->layers == 0) {
+                    argp_failure(state, 1, 0, "create needs the number of layers");
+                }
                 if (strncmp(arg, RANGE_CMD, sizeof(RANGE_CMD)) == 0) {
                     st->subcommand_retval = run_subcommand(state, RANGE_CMD, do_range_cmd);
                 }
@@ -312,6 +899,9 @@ static int parse_opt(int key, char *arg, struct argp_state *state) {
                 else if (strncmp(arg, GET_CMD, sizeof(GET_CMD)) == 0) {
                     st->subcommand_retval = run_subcommand(state, GET_CMD, do_get_cmd);
                 }
+                else if (strncmp(arg, PUT_CMD, sizeof(PUT_CMD)) == 0) {
+                    st->subcommand_retval = run_subcommand(state, PUT_CMD, do_put_cmd);
+                }
                 else {
                     argp_error(state, "unsupported argument %s", arg);
                 }
@@ -340,6 +930,7 @@ int main(int argc, char *argv[]) {
         { 0 }
     };
     struct ArgState arg_state = default_argstate();
+    node_search_init();
     struct argp argp = { options, parse_opt, "DB_NAME N_LAYERS CMD [CMD_ARGS] [CMD_OPTS]", doc };
     argp_parse(&argp, argc, argv, ARGP_IN_ORDER, 0, &arg_state);
 
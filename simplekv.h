@@ -9,6 +9,12 @@
 #include <errno.h>
 
 #include "db_types.h"
+#include "nodesearch.h"
+#include "superblock.h"
+#include "phase.h"
+#include "histogram.h"
+#include "arrival.h"
+#include "keygen.h"
 
 // Database-level information
 #define LOAD_MODE 0
@@ -17,14 +23,39 @@
 #define CREATE_CMD "create"
 #define RANGE_CMD "range"
 #define GET_CMD "get"
+#define PUT_CMD "put"
 
 extern size_t worker_num;
 extern size_t total_node;
 extern size_t *layer_cap;
 extern key__t max_key;
-extern Node *cache;
+/* Number of keys in the database; less than max_key if keys are sparse */
+extern size_t n_keys;
+/*
+ * Cached index node
+ *
+ * Only the separator keys key[1..nkeys-1] of the on-disk node are kept, in whole
+ * cache lines padded with KEY_PAD. [summary] holds the first key of
+ * every line but the first, so a search reads one summary line and one key line
+ * instead of the whole block-sized Node. Children are found by index, see build_cache.
+ */
+#define INDEX_LINES   ((NODE_CAPACITY - 1 + LINE_KEYS - 1) / LINE_KEYS)
+#define SUMMARY_LINES ((INDEX_LINES - 1 + LINE_KEYS - 1) / LINE_KEYS)
+
+typedef struct {
+    key__t summary[SUMMARY_LINES][LINE_KEYS];
+    key__t line[INDEX_LINES][LINE_KEYS];
+} __attribute__((aligned(64))) IndexNode;
+
+extern IndexNode *cache;
 extern size_t cache_cap;
 
+struct GetArgs;
+struct ArgState;
+
+/* Keys a worker draws at a time; its memory does not grow with --requests */
+#define KEY_BUF_LEN 65536
+
 typedef struct {
     size_t op_count;
     size_t index;
@@ -32,24 +63,77 @@ typedef struct {
     size_t timer;
     int use_xrp;
     int bpf_fd;
-    size_t *latency_arr;
+    /* Latency of each request */
+    struct Histogram *latency;
+    int batch;
+
+    /* io_uring engine settings */
+    int use_uring;
+    unsigned int queue_depth;
+    int sqpoll;
+    int fixed_bufs;
+
+    /* Fraction of requests that are updates, and the number issued */
+    double write_ratio;
+    size_t writes;
+    /* Length of the values updates store */
+    unsigned int value_size;
+    /* Latency of each update, including its commit */
+    struct Histogram *write_latency;
+    /* Time spent in each phase of the lookups, if timed */
+    struct PhaseStats *phases;
+
+    /* Schedule of the requests with --rate, and how long they waited past it to be sent */
+    int open_loop;
+    struct Arrivals arrivals;
+    size_t send_delay;
+
+    /*
+     * Keys of the next requests, drawn KEY_BUF_LEN at a time so that drawing them is
+     * not timed, the next one to use, and the number drawn so far
+     */
+    key__t *keys;
+    size_t keys_len;
+    size_t keys_used;
+    size_t keys_drawn;
+    struct KeyGen keygen;
 } WorkerArg;
 
 int get_handler(char *db_path, int flag);
 
-int run(char *db_path, size_t layer_num, size_t request_num, size_t thread_num, int use_xrp, int bpf_fd, size_t cache_level);
+int run(char *db_path, struct GetArgs const *ga, int bpf_fd);
 
 void *subtask(void *args);
 
+ptr__t cached_index_offset(key__t key);
+
+void check_lookup_result(WorkerArg const *r, key__t key, struct Query const *query, long retval);
+
+size_t cache_levels_for_budget(size_t layer_num, size_t budget);
+
+void load_geometry(int db_fd, size_t layer_num);
+
+void build_key_pool(int db_fd, size_t layer_num);
+
+void draw_keys(WorkerArg *r);
+
+/* Key for the next request of [r]; call it before timing the request */
+static inline key__t next_key(WorkerArg *r) {
+    if (r->keys_used == r->keys_len) {
+        draw_keys(r);
+    }
+    return r->keys[r->keys_used++];
+}
+
 void build_cache(int db_fd, size_t layer_num, size_t cache_level);
 
 void read_node(ptr__t ptr, Node *node, int db_handler);
 
-void read_log(ptr__t ptr, Log *log, int db_handler);
+void open_database(struct ArgState *as);
 
 int initialize(size_t layer_num, int mode, char *db_path);
 
-void initialize_workers(WorkerArg *args, size_t total_op_count, char *db_path, int use_xrp, int bpf_fd);
+void initialize_workers(WorkerArg *args, size_t total_op_count, char *db_path, struct GetArgs const *ga, int bpf_fd);
 
 void start_workers(pthread_t *tids, WorkerArg *args);
 
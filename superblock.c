@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "superblock.h"
+#include "helpers.h"
+
+/* 64 bit FNV-1a over the superblock with the checksum field cleared, folded to 32 bits */
+static uint32_t superblock_checksum(struct Superblock const *sb) {
+    struct Superblock tmp = *sb;
+    tmp.checksum = 0;
+    unsigned char const *p = (unsigned char const *) &tmp;
+    uint64_t h = 0xcbf29ce484222325ul;
+    for (size_t i = 0; i < sizeof(tmp); ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ul;
+    }
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+/* Superblock of a new database whose root is at ROOT_NODE_OFFSET and whose value heap starts at [heap] */
+void superblock_init(struct Superblock *sb, size_t layers, size_t n_keys, ptr__t heap) {
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = SB_MAGIC;
+    sb->version = SB_VERSION;
+    sb->block_size = BLK_SIZE;
+    sb->layers = (uint32_t) layers;
+    sb->n_keys = n_keys;
+    sb->root = ROOT_NODE_OFFSET;
+    sb->heap = heap;
+}
+
+/* Number of levels of the tree below [root], from the leftmost path */
+uint32_t tree_height(int db_fd, ptr__t root) {
+    Node *node = (Node *) aligned_alloca(BLK_SIZE, sizeof(Node));
+    ptr__t offset = root;
+    for (uint32_t height = 1;; ++height) {
+        checked_pread(db_fd, node, sizeof(Node), (long) offset);
+        if (node_type(node) == LEAF) {
+            return height;
+        }
+        offset = decode(node->ptr[0]);
+    }
+}
+
+/**
+ * Read the superblock of the database [db_fd] (at [db_path]) into [sb].
+ * Exits if the file is not a database this build can read.
+ */
+void superblock_read(int db_fd, char const *db_path, struct Superblock *sb) {
+    char *buf = (char *) aligned_alloca(BLK_SIZE, BLK_SIZE);
+    ssize_t bytes_read = pread(db_fd, buf, BLK_SIZE, SUPERBLOCK_OFFSET);
+    if (bytes_read < 0) {
+        perror("failed to read superblock");
+        exit(1);
+    }
+    memcpy(sb, buf, sizeof(*sb));
+    if (bytes_read < (ssize_t) sizeof(*sb) || sb->magic != SB_MAGIC) {
+        fprintf(stderr, "%s is not a SimpleKV database, or was created by an older version and must be "
+                        "created again\n", db_path);
+        exit(1);
+    }
+    if (sb->checksum != superblock_checksum(sb)) {
+        fprintf(stderr, "%s: superblock is corrupt\n", db_path);
+        exit(1);
+    }
+    if (sb->version != SB_VERSION) {
+        fprintf(stderr, "%s: unsupported format version %u (this build reads version %u)\n", db_path,
+                sb->version, SB_VERSION);
+        exit(1);
+    }
+    if (sb->block_size != BLK_SIZE) {
+        fprintf(stderr, "%s has %u byte blocks, but simplekv was built for %d byte blocks "
+                        "(rebuild with make BLK_SIZE_LOG=%d)\n", db_path, sb->block_size, BLK_SIZE,
+                __builtin_ctz(sb->block_size));
+        exit(1);
+    }
+    if (sb->flags & SB_OPEN) {
+        /* The last writer did not close the database; only the tree itself is up to date */
+        sb->layers = tree_height(db_fd, sb->root);
+        sb->n_keys = 0;
+    }
+}
+
+/* Write [sb] to the database [db_fd] */
+void superblock_write(int db_fd, struct Superblock const *sb) {
+    char *buf = (char *) aligned_alloca(BLK_SIZE, BLK_SIZE);
+    memset(buf, 0, BLK_SIZE);
+    struct Superblock *dst = (struct Superblock *) buf;
+    *dst = *sb;
+    dst->checksum = superblock_checksum(dst);
+    ssize_t bytes_written = pwrite(db_fd, buf, BLK_SIZE, SUPERBLOCK_OFFSET);
+    if (bytes_written != BLK_SIZE) {
+        perror("failed to write superblock");
+        exit(1);
+    }
+}
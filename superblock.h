@@ -0,0 +1,73 @@
+#ifndef _SUPERBLOCK_H_
+#define _SUPERBLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "db_types.h"
+
+/*
+ * Superblock
+ *
+ * The first block of the database file describes the rest of it, so commands other
+ * than `create` learn the shape of the tree from the file instead of trusting the
+ * command line. `create` writes it last, so a file whose creation did not finish
+ * has no valid superblock.
+ *
+ * Writers set SB_OPEN while they have the database open and clear it, with the
+ * counts brought up to date, when they close it. If a writer crashed, the layer
+ * count is taken from the tree itself and the key count is unknown.
+ */
+#define SUPERBLOCK_OFFSET 0
+/* "SimpleKV" in little endian */
+#define SB_MAGIC 0x564b656c706d6953ul
+#define SB_VERSION 1
+
+/* `put` has split or merged nodes, so the levels are no longer laid out one after another */
+#define SB_RESHAPED 1
+/* A writer has the database open */
+#define SB_OPEN 2
+/* `create --packed-leaves` wrote the leaves as PackedLeaf; the database is read only */
+#define SB_PACKED_LEAVES 4
+/*
+ * Every value is its key as text, as `create` generates them, so lookups check them.
+ * `create --from` does not set it, and `put --value` clears it.
+ */
+#define SB_GENERATED_VALUES 8
+
+struct Superblock {
+    uint64_t magic;
+    uint32_t version;
+    /* BLK_SIZE of the build that created the database */
+    uint32_t block_size;
+    uint32_t flags;
+    uint32_t layers;
+    /* Number of keys; 0 if unknown */
+    uint64_t n_keys;
+    /* Offset of the root node, and of the value heap `create` laid out after the index */
+    ptr__t root;
+    ptr__t heap;
+    uint32_t reserved;
+    /* Covers every other field */
+    uint32_t checksum;
+};
+
+_Static_assert(sizeof(struct Superblock) == 56, "the superblock must not have padding");
+
+/* Superblock of the open database */
+extern struct Superblock superblock;
+
+/* Keys in a full leaf of the open database */
+static inline unsigned int leaf_capacity(void) {
+    return superblock.flags & SB_PACKED_LEAVES ? PACKED_CAPACITY : NODE_CAPACITY;
+}
+
+void superblock_init(struct Superblock *sb, size_t layers, size_t n_keys, ptr__t heap);
+
+void superblock_read(int db_fd, char const *db_path, struct Superblock *sb);
+
+void superblock_write(int db_fd, struct Superblock const *sb);
+
+uint32_t tree_height(int db_fd, ptr__t root);
+
+#endif /* _SUPERBLOCK_H_ */
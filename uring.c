@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#include "uring.h"
+#include "simplekv.h"
+#include "helpers.h"
+#include "blkcache.h"
+#include "get.h"
+#include "phase.h"
+
+/*
+ * Asynchronous lookup engine
+ *
+ * Each worker thread keeps [queue_depth] independent lookups in flight. A lookup
+ * is a small state machine that walks the same path as `lookup_key_userspace`:
+ *
+ *     (cached levels) -> internal node(s) -> leaf -> value block
+ *
+ * Every step issues one block sized read; when it completes the slot either issues
+ * the read for the next step or finishes the lookup and immediately starts a new one.
+ * Blocks served by the node or value cache complete at once: the slot is queued as
+ * ready and advanced by the main loop, so runs of cache hits do not nest calls.
+ * Values whose record spans several blocks are read synchronously after the first.
+ *
+ * With --rate, a finished slot instead waits until the next request arrives. Requests
+ * that arrive while every slot is busy wait for one to finish.
+ */
+
+struct LookupSlot {
+    int state;
+    key__t key;
+    /* Leaf pointer of the value */
+    ptr__t value_ptr;
+    /* Offset of the block being read, to fill the node or value cache */
+    ptr__t fill_offset;
+    char *buf;
+    /* Time the lookup counts as started (its arrival with --rate), and the time it was */
+    uint64_t start;
+    uint64_t sent;
+    /* Start of the read in flight, with --phases */
+    uint64_t read_start;
+};
+
+struct UringWorker {
+    struct io_uring ring;
+    WorkerArg *r;
+    struct LookupSlot *slots;
+    char *buffers;
+    /* Either the database fd or its index in the registered file table */
+    int fd;
+    size_t issued;
+    size_t completed;
+    /* Slots without a lookup, with --rate */
+    struct LookupSlot **idle;
+    unsigned int n_idle;
+    /* Slots whose block was served by a cache, to advance without waiting for the ring */
+    struct LookupSlot **ready;
+    unsigned int n_ready;
+};
+
+static void submit_read(struct UringWorker *w, struct LookupSlot *slot, ptr__t offset) {
+    /* Serve nodes and value blocks from the caches without I/O */
+    struct BlockCache *bc = slot->state == SLOT_INDEX ? node_cache : value_cache;
+    slot->fill_offset = NO_BLOCK;
+    slot->read_start = phase_start();
+    if (bc != NULL) {
+        if (block_cache_lookup(bc, offset, slot->buf)) {
+            w->ready[w->n_ready++] = slot;
+            return;
+        }
+        slot->fill_offset = offset;
+    }
+
+    /* Each slot has at most one read outstanding, so the SQ can never be full */
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+    BUG_ON(sqe == NULL);
+
+    if (w->r->fixed_bufs) {
+        io_uring_prep_read_fixed(sqe, w->fd, slot->buf, BLK_SIZE, offset, 0);
+    } else {
+        io_uring_prep_read(sqe, w->fd, slot->buf, BLK_SIZE, offset);
+    }
+    if (w->r->sqpoll) {
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data(sqe, slot);
+}
+
+static void start_lookup(struct UringWorker *w, struct LookupSlot *slot, key__t key, uint64_t start) {
+    slot->key = key;
+    slot->state = SLOT_INDEX;
+    slot->start = start;
+    slot->sent = monotonic_ns();
+    uint64_t phase = phase_start();
+    ptr__t offset = cached_index_offset(slot->key);
+    if (cache_cap != 0) {
+        phase_end(PHASE_CACHED, phase);
+    }
+    w->issued++;
+    submit_read(w, slot, offset);
+}
+
+static void finish_lookup(struct UringWorker *w, struct LookupSlot *slot, struct Query *query, long retval) {
+    uint64_t end = monotonic_ns();
+    size_t latency = end - slot->start;
+    w->r->timer += latency;
+    hist_record(w->r->latency, latency);
+    w->completed++;
+    phase_lookups(1, end - slot->sent);
+
+    check_lookup_result(w->r, slot->key, query, retval);
+
+    slot->state = SLOT_IDLE;
+    if (w->r->open_loop) {
+        w->idle[w->n_idle++] = slot;
+    } else if (w->issued < w->r->op_count) {
+        key__t key = next_key(w->r);
+        start_lookup(w, slot, key, monotonic_ns());
+    }
+}
+
+/* Advance the state machine of [slot] after one of its reads completed with [res] */
+static void advance_lookup(struct UringWorker *w, struct LookupSlot *slot, int res) {
+    struct Query query = new_query(slot->key);
+    if (res != BLK_SIZE) {
+        errno = res < 0 ? -res : EIO;
+        finish_lookup(w, slot, &query, -1);
+        return;
+    }
+
+    if (slot->state == SLOT_VALUE) {
+        phase_end(PHASE_VALUE, slot->read_start);
+    } else {
+        phase_end_node((Node const *) slot->buf, slot->read_start);
+    }
+    if (slot->fill_offset != NO_BLOCK) {
+        block_cache_insert(slot->state == SLOT_INDEX ? node_cache : value_cache, slot->fill_offset, slot->buf);
+    }
+
+    if (slot->state == SLOT_VALUE) {
+        ptr__t offset = decode(slot->value_ptr);
+        query.value_len = value_len(slot->value_ptr);
+        memcpy(query.value, slot->buf + value_offset(offset) + VAL_HDR_SIZE, value_inline_len(query.value_len));
+        if (query.value_len > VAL_SIZE) {
+            /* Records of up to a block are all in the block just read; larger ones span several */
+            unsigned char value[MAX_VAL_LEN];
+            if (value_record_size(query.value_len) <= BLK_SIZE) {
+                memcpy(value, slot->buf + value_offset(offset) + VAL_HDR_SIZE, query.value_len);
+            } else {
+                read_value(w->r->db_handler, offset, query.value_len, value);
+            }
+        }
+        query.found = 1;
+        finish_lookup(w, slot, &query, 0);
+        return;
+    }
+
+    Node *node = (Node *) slot->buf;
+    if (node_type(node) != LEAF) {
+        submit_read(w, slot, decode(nxt_node(slot->key, node)));
+        return;
+    }
+    slot->value_ptr = leaf_lookup(slot->key, node);
+    if (slot->value_ptr == 0) {
+        finish_lookup(w, slot, &query, 0);
+        return;
+    }
+    slot->state = SLOT_VALUE;
+    submit_read(w, slot, value_base(decode(slot->value_ptr)));
+}
+
+/* Advance the slots served by a cache until all of them wait for the ring or are idle */
+static void advance_ready(struct UringWorker *w) {
+    while (w->n_ready > 0) {
+        advance_lookup(w, w->ready[--w->n_ready], BLK_SIZE);
+    }
+}
+
+/* Start the requests that have arrived, as long as there are idle slots for them */
+static void dispatch_arrivals(struct UringWorker *w) {
+    WorkerArg *r = w->r;
+    while (w->n_idle > 0 && w->issued < r->op_count && r->arrivals.next <= monotonic_ns()) {
+        uint64_t arrival = arrivals_next(&r->arrivals);
+        struct LookupSlot *slot = w->idle[--w->n_idle];
+        start_lookup(w, slot, next_key(r), arrival);
+        r->send_delay += slot->sent - arrival;
+    }
+}
+
+void *uring_subtask(void *args) {
+    WorkerArg *r = (WorkerArg *) args;
+    struct UringWorker w = { .r = r, .fd = r->db_handler };
+    unsigned int qd = r->queue_depth;
+    srand(r->index);
+    printf("thread %ld op_count %ld\n", r->index, r->op_count);
+    phase_stats = r->phases;
+
+    struct io_uring_params params = { 0 };
+    if (r->sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 2000;
+    }
+    int ret = io_uring_queue_init_params(qd, &w.ring, &params);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    if (r->sqpoll) {
+        ret = io_uring_register_files(&w.ring, &r->db_handler, 1);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_register_files failed: %s\n", strerror(-ret));
+            exit(1);
+        }
+        w.fd = 0;
+    }
+
+    /* One aligned block per slot for O_DIRECT */
+    if (posix_memalign((void **) &w.buffers, BLK_SIZE, qd * BLK_SIZE)) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+    w.slots = calloc(qd, sizeof(struct LookupSlot));
+    /* A slot has at most one block pending, so at most every slot is ready */
+    w.ready = malloc(qd * sizeof(struct LookupSlot *));
+    BUG_ON(w.slots == NULL || w.ready == NULL);
+    for (unsigned int i = 0; i < qd; ++i) {
+        w.slots[i].buf = w.buffers + (size_t) i * BLK_SIZE;
+    }
+    if (r->fixed_bufs) {
+        struct iovec iov = { .iov_base = w.buffers, .iov_len = qd * BLK_SIZE };
+        ret = io_uring_register_buffers(&w.ring, &iov, 1);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_register_buffers failed: %s\n", strerror(-ret));
+            exit(1);
+        }
+    }
+
+    if (r->open_loop) {
+        w.idle = malloc(qd * sizeof(struct LookupSlot *));
+        BUG_ON(w.idle == NULL);
+        for (unsigned int i = 0; i < qd; ++i) {
+            w.idle[w.n_idle++] = &w.slots[qd - 1 - i];
+        }
+    } else {
+        for (unsigned int i = 0; i < qd && w.issued < r->op_count; ++i) {
+            key__t key = next_key(r);
+            start_lookup(&w, &w.slots[i], key, monotonic_ns());
+        }
+    }
+    while (w.completed < r->op_count) {
+        unsigned int wait = 1;
+        advance_ready(&w);
+        if (r->open_loop) {
+            dispatch_arrivals(&w);
+            advance_ready(&w);
+        }
+        if (w.completed == r->op_count) {
+            break;
+        }
+        if (r->open_loop) {
+            /* Poll while a request can still be sent as soon as it arrives */
+            if (w.n_idle > 0 && w.issued < r->op_count) {
+                wait = 0;
+                if (w.issued == w.completed) {
+                    arrival_wait(r->arrivals.next);
+                    continue;
+                }
+            }
+        }
+        ret = io_uring_submit_and_wait(&w.ring, wait);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "io_uring_submit failed: %s\n", strerror(-ret));
+            exit(1);
+        }
+
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&w.ring, &cqe) == 0) {
+            struct LookupSlot *slot = (struct LookupSlot *) io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&w.ring, cqe);
+            advance_lookup(&w, slot, res);
+        }
+    }
+
+    io_uring_queue_exit(&w.ring);
+    free(w.idle);
+    free(w.ready);
+    free(w.slots);
+    free(w.buffers);
+    return NULL;
+}
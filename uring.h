@@ -0,0 +1,13 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "db_types.h"
+
+/* Lookup state machine for the io_uring engine */
+#define SLOT_IDLE 0
+#define SLOT_INDEX 1
+#define SLOT_VALUE 2
+
+void *uring_subtask(void *args);
+
+#endif /* _URING_H_ */
@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "parse.h"
+#include "write.h"
+#include "simplekv.h"
+#include "helpers.h"
+
+/*
+ * Write-ahead log
+ *
+ * The write path applies a change to the tree and appends its record to the log
+ * under the same lock, so the log holds changes in the order they were applied.
+ * Writers then wait in wal_commit until their record is durable. Commits are
+ * grouped: the first waiting writer becomes the leader, gives others up to the
+ * commit interval to join (or until the batch size is reached), and writes all
+ * pending records with one write and one fdatasync, or one O_DSYNC write. Records
+ * appended meanwhile go into the next group.
+ *
+ * The log only has to cover tree writes that may not have reached the disk yet: a
+ * checkpoint syncs the database file and truncates the log. After a crash,
+ * wal_recover replays the log up to the first torn record. Replaying a change that
+ * was already applied does no harm.
+ *
+ * Replaying puts and deletes needs a valid tree, but a crash in the middle of a
+ * split or merge can leave one half done. So changes to several nodes are logged
+ * as node images (WAL_NODES), which are made durable before any of the nodes is
+ * written in place; once the nodes are synced, WAL_NODES_DONE follows. Recovery
+ * first rewrites the nodes of a group that was logged in full but not finished,
+ * which can only be the last one, and then replays the puts and deletes.
+ */
+
+_Static_assert(sizeof(struct WalRecord) == 32, "log records must not have padding");
+_Static_assert(sizeof(Node) <= MAX_VAL_LEN, "node images must fit in a record");
+
+struct Wal {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Records appended since the current group was closed */
+    char *pending;
+    size_t n_pending;
+    size_t pending_bytes;
+    size_t pending_cap;
+    /* Records the leader is writing */
+    char *group;
+    size_t group_cap;
+    int flushing;
+
+    uint64_t next_lsn;
+    /* Every record with a smaller LSN is durable */
+    uint64_t durable_lsn;
+    /* Bytes in the log file */
+    size_t size;
+
+    long interval_ns;
+    size_t batch;
+    size_t checkpoint_bytes;
+    int dsync;
+
+    /* Statistics */
+    size_t records;
+    size_t flushes;
+    size_t checkpoints;
+};
+
+/* The log of [db_path] is the file [db_path].wal */
+static char *wal_path(char const *db_path) {
+    char *path = malloc(strlen(db_path) + sizeof(".wal"));
+    BUG_ON(path == NULL);
+    sprintf(path, "%s.wal", db_path);
+    return path;
+}
+
+static uint64_t fnv1a(uint64_t h, void const *buf, size_t size) {
+    unsigned char const *p = buf;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ul;
+    }
+    return h;
+}
+
+/* 64 bit FNV-1a over the record with the checksum field cleared and its [value], folded to 32 bits */
+static uint32_t record_checksum(struct WalRecord const *rec, unsigned char const *value) {
+    struct WalRecord tmp = *rec;
+    tmp.checksum = 0;
+    uint64_t h = fnv1a(0xcbf29ce484222325ul, &tmp, sizeof(tmp));
+    h = fnv1a(h, value, rec->len);
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+/* Open the log of [db_path] for appending; wal_recover must have emptied it */
+struct Wal *wal_open(char const *db_path, struct WalArgs const *wa) {
+    struct Wal *wal = calloc(1, sizeof(struct Wal));
+    BUG_ON(wal == NULL);
+    char *path = wal_path(db_path);
+    wal->fd = open(path, O_WRONLY | O_CREAT | (wa->dsync ? O_DSYNC : 0), 0644);
+    if (wal->fd < 0) {
+        fprintf(stderr, "failed to open log %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    free(path);
+    struct stat st;
+    if (fstat(wal->fd, &st) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    wal->size = (size_t) st.st_size;
+
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    wal->next_lsn = 1;
+    wal->durable_lsn = 1;
+    wal->interval_ns = wa->commit_interval_us * 1000;
+    wal->batch = wa->commit_batch;
+    wal->checkpoint_bytes = wa->checkpoint_bytes;
+    wal->dsync = wa->dsync;
+    printf("Logging writes: group commit after %ld us or %lu records, %s, checkpoint every %lu bytes\n",
+           wa->commit_interval_us, wa->commit_batch, wa->dsync ? "O_DSYNC" : "fdatasync", wa->checkpoint_bytes);
+    return wal;
+}
+
+void wal_close(struct Wal *wal) {
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->cond);
+    free(wal->pending);
+    free(wal->group);
+    free(wal);
+}
+
+/**
+ * Add a record of [op] on [key] (and the [len] byte [value], for WAL_PUT) to the
+ * current group. The caller serializes appends with the changes they describe.
+ *
+ * @return the LSN of the record, to pass to wal_commit
+ */
+uint64_t wal_append(struct Wal *wal, uint32_t op, key__t key, unsigned char const *value, unsigned int len) {
+    if (op != WAL_PUT && op != WAL_NODE) {
+        len = 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    size_t size = sizeof(struct WalRecord) + len;
+    if (wal->pending_bytes + size > wal->pending_cap) {
+        while (wal->pending_bytes + size > wal->pending_cap) {
+            wal->pending_cap = wal->pending_cap ? 2 * wal->pending_cap : 64 * sizeof(struct WalRecord);
+        }
+        wal->pending = realloc(wal->pending, wal->pending_cap);
+        BUG_ON(wal->pending == NULL);
+    }
+    struct WalRecord rec = {
+        .lsn = wal->next_lsn++,
+        .op = op,
+        .key = key,
+        .len = len
+    };
+    rec.checksum = record_checksum(&rec, value);
+    memcpy(wal->pending + wal->pending_bytes, &rec, sizeof(rec));
+    if (len > 0) {
+        memcpy(wal->pending + wal->pending_bytes + sizeof(rec), value, len);
+    }
+    wal->pending_bytes += size;
+    wal->n_pending++;
+    wal->records++;
+    if (wal->n_pending >= wal->batch) {
+        /* Wake a leader waiting for the group to fill up */
+        pthread_cond_broadcast(&wal->cond);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return rec.lsn;
+}
+
+static void write_group(struct Wal *wal, char const *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t bytes_written = pwrite(wal->fd, buf, size, (off_t) offset);
+        if (bytes_written < 0) {
+            perror("failed to write log");
+            exit(1);
+        }
+        buf += bytes_written;
+        offset += (size_t) bytes_written;
+        size -= (size_t) bytes_written;
+    }
+    if (!wal->dsync && fdatasync(wal->fd) != 0) {
+        perror("failed to sync log");
+        exit(1);
+    }
+}
+
+/*
+ * Wait until the record [lsn] is durable, flushing the current group if no one else is.
+ * With [gather], a leader first gives other writers time to join its group.
+ */
+static void commit(struct Wal *wal, uint64_t lsn, int gather) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable_lsn <= lsn) {
+        if (wal->flushing) {
+            pthread_cond_wait(&wal->cond, &wal->lock);
+            continue;
+        }
+
+        /* Lead the group: let other writers join it for up to the commit interval */
+        wal->flushing = 1;
+        if (gather && wal->interval_ns > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += wal->interval_ns;
+            deadline.tv_sec += deadline.tv_nsec / NS_PER_SEC;
+            deadline.tv_nsec %= NS_PER_SEC;
+            while (wal->n_pending < wal->batch
+                   && pthread_cond_timedwait(&wal->cond, &wal->lock, &deadline) != ETIMEDOUT) {
+            }
+        }
+
+        /* Close the group; records appended from now on go into the next one */
+        char *group = wal->pending;
+        size_t group_cap = wal->pending_cap;
+        size_t size = wal->pending_bytes;
+        wal->pending = wal->group;
+        wal->pending_cap = wal->group_cap;
+        wal->n_pending = 0;
+        wal->pending_bytes = 0;
+        wal->group = group;
+        wal->group_cap = group_cap;
+        uint64_t end_lsn = wal->next_lsn;
+        size_t offset = wal->size;
+
+        pthread_mutex_unlock(&wal->lock);
+        write_group(wal, group, size, offset);
+        pthread_mutex_lock(&wal->lock);
+
+        wal->size += size;
+        wal->durable_lsn = end_lsn;
+        wal->flushing = 0;
+        wal->flushes++;
+        pthread_cond_broadcast(&wal->cond);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_commit(struct Wal *wal, uint64_t lsn) {
+    commit(wal, lsn, 1);
+}
+
+/* Make the record [lsn] durable without waiting for other writers, for callers that block them */
+void wal_flush(struct Wal *wal, uint64_t lsn) {
+    commit(wal, lsn, 0);
+}
+
+/* Whether the log has grown past the checkpoint size */
+int wal_checkpoint_due(struct Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    int due = wal->size >= wal->checkpoint_bytes;
+    pthread_mutex_unlock(&wal->lock);
+    return due;
+}
+
+/**
+ * Make every change in the log durable in the database [db_fd] and empty the log.
+ * The caller must keep writers from changing the tree meanwhile.
+ */
+void wal_checkpoint(struct Wal *wal, int db_fd) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->flushing) {
+        pthread_cond_wait(&wal->cond, &wal->lock);
+    }
+    if (fdatasync(db_fd) != 0) {
+        perror("failed to sync database");
+        exit(1);
+    }
+    if (ftruncate(wal->fd, 0) != 0) {
+        perror("failed to truncate log");
+        exit(1);
+    }
+    /* Pending records describe changes the sync just made durable */
+    wal->size = 0;
+    wal->n_pending = 0;
+    wal->pending_bytes = 0;
+    wal->durable_lsn = wal->next_lsn;
+    wal->checkpoints++;
+    pthread_cond_broadcast(&wal->cond);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+void wal_print_stats(struct Wal *wal) {
+    printf("Log: %lu records in %lu group commits (%.1f per commit), %lu checkpoints\n",
+           wal->records, wal->flushes, wal->flushes ? (double) wal->records / (double) wal->flushes : 0.0,
+           wal->checkpoints);
+}
+
+/* Read the next record of [log] and its value; 0 at the end of the log or at a torn record */
+static int read_record(FILE *log, struct WalRecord *rec, unsigned char *value, size_t n, uint64_t next_lsn) {
+    /* A crash can leave a torn record at the end */
+    return fread(rec, sizeof(*rec), 1, log) == 1 && rec->len <= MAX_VAL_LEN
+           && fread(value, 1, rec->len, log) == rec->len && rec->checksum == record_checksum(rec, value)
+           && (n == 0 || rec->lsn == next_lsn) && rec->op >= WAL_PUT && rec->op <= WAL_NODES_DONE
+           && (rec->op != WAL_NODE || rec->len == sizeof(Node));
+}
+
+/* Replay the log of [db_path], if it has any records, and empty it */
+void wal_recover(char const *db_path) {
+    char *path = wal_path(db_path);
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+    FILE *log = fdopen(fd, "r");
+    BUG_ON(log == NULL);
+
+    int db_fd = get_handler((char *) db_path, O_RDWR);
+    superblock_read(db_fd, db_path, &superblock);
+
+    /* Find the intact records, and the last group of node images if it was not finished */
+    struct WalRecord rec;
+    unsigned char *value = (unsigned char *) aligned_alloca(BLK_SIZE, MAX_VAL_LEN);
+    size_t n = 0;
+    size_t replayed = 0;
+    uint64_t next_lsn = 0;
+    long group = -1;
+    size_t group_nodes = 0;
+    size_t group_seen = 0;
+    while (read_record(log, &rec, value, n, next_lsn)) {
+        if (rec.op == WAL_NODES) {
+            group = (long) replayed;
+            group_nodes = rec.key;
+            group_seen = 0;
+        } else if (rec.op == WAL_NODE) {
+            group_seen++;
+        } else if (rec.op == WAL_NODES_DONE) {
+            group = -1;
+        }
+        next_lsn = rec.lsn + 1;
+        n++;
+        replayed += sizeof(rec) + rec.len;
+    }
+    size_t torn = (size_t) st.st_size - replayed;
+
+    /* Nodes are only written once all their images are durable, so a partial group changed nothing */
+    size_t nodes = 0;
+    if (group >= 0 && group_seen == group_nodes) {
+        BUG_ON(fseek(log, group, SEEK_SET) != 0 || fread(&rec, sizeof(rec), 1, log) != 1);
+        for (; nodes < group_nodes; ++nodes) {
+            BUG_ON(fread(&rec, sizeof(rec), 1, log) != 1 || fread(value, 1, rec.len, log) != rec.len);
+            if (pwrite(db_fd, value, sizeof(Node), (off_t) rec.key) != (ssize_t) sizeof(Node)) {
+                perror("failed to rewrite node");
+                exit(1);
+            }
+        }
+    }
+
+    /* The tree is whole again: replay the changes, which allocate blocks past the rewritten nodes */
+    write_path_init(db_fd, 0);
+    BUG_ON(fseek(log, 0, SEEK_SET) != 0);
+    for (size_t i = 0; i < n; ++i) {
+        BUG_ON(fread(&rec, sizeof(rec), 1, log) != 1 || fread(value, 1, rec.len, log) != rec.len);
+        if (rec.op == WAL_PUT) {
+            kv_put(db_fd, rec.key, value, rec.len);
+        } else if (rec.op == WAL_DELETE) {
+            kv_delete(db_fd, rec.key);
+        }
+    }
+
+    write_path_close(db_fd);
+    if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        perror("failed to finish recovery");
+        exit(1);
+    }
+    printf("Recovered %lu records from %s", n, path);
+    if (nodes > 0) {
+        printf(", rewrote %lu nodes of an unfinished split or merge", nodes);
+    }
+    if (torn > 0) {
+        printf(", dropped %lu bytes of incomplete records", torn);
+    }
+    printf("\n");
+
+    write_path_free();
+    close(db_fd);
+    fclose(log);
+    free(path);
+}
@@ -0,0 +1,54 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "db_types.h"
+
+struct WalArgs;
+
+/* Operations recorded in the log */
+#define WAL_PUT 1
+#define WAL_DELETE 2
+/* A change to several nodes: [key] WAL_NODE records follow, then WAL_NODES_DONE once the nodes are synced */
+#define WAL_NODES 3
+/* Image of the node at file offset [key] */
+#define WAL_NODE 4
+#define WAL_NODES_DONE 5
+
+/*
+ * Log records; the log file next to the database is a sequence of these, each
+ * followed by the [len] bytes of its value
+ */
+struct WalRecord {
+    uint64_t lsn;
+    uint32_t op;
+    /* Covers every other field of the record and the value */
+    uint32_t checksum;
+    key__t key;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct Wal;
+
+struct Wal *wal_open(char const *db_path, struct WalArgs const *wa);
+
+void wal_close(struct Wal *wal);
+
+uint64_t wal_append(struct Wal *wal, uint32_t op, key__t key, unsigned char const *value, unsigned int len);
+
+void wal_commit(struct Wal *wal, uint64_t lsn);
+
+void wal_flush(struct Wal *wal, uint64_t lsn);
+
+int wal_checkpoint_due(struct Wal *wal);
+
+void wal_checkpoint(struct Wal *wal, int db_fd);
+
+void wal_print_stats(struct Wal *wal);
+
+void wal_recover(char const *db_path);
+
+#endif /* _WAL_H_ */
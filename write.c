@@ -0,0 +1,1119 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+
+#include "write.h"
+#include "parse.h"
+#include "simplekv.h"
+#include "helpers.h"
+#include "blkcache.h"
+#include "wal.h"
+
+/*
+ * Write path
+ *
+ * Writers are serialized by [write_lock]; readers, including XRP programs, take no
+ * locks. Every change is published by rewriting one node in place with a single
+ * block sized O_DIRECT write, which the device applies atomically, so a reader sees
+ * either the old or the new node. write_path_init refuses devices whose logical
+ * blocks are smaller than BLK_SIZE, unless their RWF_ATOMIC writes cover a block. Changes to several nodes are ordered so that the
+ * tree is valid for lookups and range scans after each write:
+ *
+ *   split L into L, R: write R (the upper half of L, R.next = L.next), add R to the
+ *       parent, wait for readers that may have passed the parent before that, then
+ *       rewrite L as the lower half with L.next = R. Until then range scans skip R
+ *       and L still holds all keys.
+ *   merge R into its left sibling L: rewrite L with the entries of both and
+ *       L.next = R.next, remove R from the parent, then free R.
+ *   split the root: write both halves to new blocks, then rewrite the root, which
+ *       stays in place, to point to them. The tree grows by a level.
+ *   root with one child: copy the child into the root, then free the child.
+ *
+ * Values are never overwritten; new values are appended to the value block at the
+ * end of the file before the leaf pointing to them is written. Values too large for
+ * a block get consecutive blocks of their own at the end of the file. Updates and
+ * deletes leave the old value behind; the write path counts these dead bytes per
+ * value block, and the compactor moves the live values out of blocks that are mostly
+ * dead (again by appending them and rewriting the leaves) and then frees those blocks.
+ *
+ * Blocks of removed nodes go to a free-space map and are reused for new nodes and
+ * values once no reader can still reach them. Readers announce the epoch in which
+ * their lookup started (reader_enter); a block freed in epoch e is reused after all
+ * readers active in epoch e have finished.
+ *
+ * The node writes of a change are staged and applied together by apply_changes. With
+ * a write-ahead log attached, every change is also appended to the log while
+ * [write_lock] is held, and writers make it durable with write_path_commit. Changes
+ * to several nodes are logged as node images before the nodes are written, so that
+ * recovery can finish a split or merge that a crash interrupted (see wal.c), and
+ * value blocks are written with RWF_DSYNC, so that no leaf that reaches the disk
+ * points to a value that did not.
+ *
+ * The superblock is marked SB_OPEN while the write path is set up, and SB_RESHAPED
+ * before the first split or merge. write_path_close stores the new layer and key
+ * counts in it.
+ */
+
+#ifndef RWF_ATOMIC
+#define RWF_ATOMIC 0x00000040
+#endif
+
+/* Deepest tree the write path handles; NODE_CAPACITY^16 keys is far more than a file can hold */
+#define MAX_DEPTH 16
+
+/* Most node writes of one change: two per level for splits, and three for the root */
+#define MAX_STAGED (2 * MAX_DEPTH + 1)
+
+/* Nodes with fewer entries are merged with a sibling when both fit in one node */
+#define MIN_ENTRIES (NODE_CAPACITY / 4)
+
+/*
+ * Value blocks with this many dead bytes are compacted, so moving the live values
+ * out of a block at most doubles the bytes written for them
+ */
+#define COMPACT_MIN_DEAD (BLK_SIZE / 2)
+
+/* Most blocks a value record covers */
+#define MAX_RECORD_BLOCKS ((VAL_HDR_SIZE + MAX_VAL_LEN + BLK_SIZE - 1) / BLK_SIZE)
+
+/*
+ * A pass reads every leaf, so it only starts once the blocks it can reclaim make up
+ * a fraction 1/COMPACT_FILE_FRACTION of the file, and at least COMPACT_MIN_BLOCKS
+ */
+#define COMPACT_FILE_FRACTION 16
+#define COMPACT_MIN_BLOCKS 64
+
+/* Root to leaf path of the key being written; node[depth] is the leaf */
+struct WritePath {
+    Node node[MAX_DEPTH];
+    /* Sibling or new half of a node being split or merged */
+    Node spare;
+    Node spare2;
+    /* Node writes of the current change, in the order they are applied */
+    Node staged[MAX_STAGED];
+    ptr__t staged_offset[MAX_STAGED];
+    /* Whether to wait for readers before the write */
+    int staged_sync[MAX_STAGED];
+    size_t n_staged;
+    ptr__t offset[MAX_DEPTH];
+    /* Index of the child of node[d] that the path follows */
+    unsigned int child[MAX_DEPTH];
+    size_t depth;
+};
+
+struct FreeBlock {
+    ptr__t offset;
+    /* Epoch in which the block was unlinked */
+    size_t epoch;
+};
+
+static struct {
+    size_t inserts;
+    size_t updates;
+    size_t deletes;
+    size_t splits;
+    size_t merges;
+    size_t reused;
+    size_t compactions;
+    size_t values_moved;
+    size_t blocks_reclaimed;
+} write_stats;
+
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct WritePath *wp;
+
+/* End of the file; blocks that are not taken from the free-space map are appended here */
+static ptr__t file_end;
+
+/* Value block being filled by appends, and records too large for one */
+static char *value_buf;
+static ptr__t value_block = NO_BLOCK;
+static unsigned int value_used;
+static char *span_buf;
+
+static struct FreeBlock *free_map;
+static size_t free_len;
+static size_t free_cap;
+
+/* Dead value bytes of a value block; blocks without dead values are not in the table */
+struct DeadCount {
+    ptr__t block;
+    unsigned int dead;
+};
+
+static size_t epoch = 1;
+/* Epoch each reader's current lookup started in, 0 if it is not in a lookup */
+static size_t *reader_epoch;
+static size_t n_readers;
+
+/* Open addressing hash table of dead byte counts, keyed by block offset */
+static struct DeadCount *dead_table;
+static size_t dead_len;
+static size_t dead_cap;
+/* Number of blocks with at least COMPACT_MIN_DEAD dead bytes */
+static size_t compact_candidates;
+
+/* Log of the changes, if any; see wal.c */
+static struct Wal *wal;
+/* LSN of the last change made by this thread */
+static __thread uint64_t last_lsn;
+/* LSN of the last WAL_NODES_DONE record */
+static uint64_t nodes_done_lsn;
+
+/* pwritev2 flags that make block writes atomic on the device, see check_atomic_writes */
+static int atomic_flags;
+
+/* The number in the queue attribute [attr] of the block device [dev], or 0 if there is none */
+static unsigned long queue_limit(dev_t dev, char const *attr) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(dev), minor(dev), attr);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        /* Partitions share the queue of their disk */
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(dev), minor(dev), attr);
+        f = fopen(path, "r");
+    }
+    unsigned long limit = 0;
+    if (f != NULL) {
+        if (fscanf(f, "%lu", &limit) != 1) {
+            limit = 0;
+        }
+        fclose(f);
+    }
+    return limit;
+}
+
+/*
+ * Make sure the device under [db_fd] writes a block atomically: a block sized write
+ * is split into logical blocks, so a crash can tear a node made of several. Larger
+ * blocks are only atomic with RWF_ATOMIC, within the device's atomic write unit.
+ * Files that are not on a block device (tmpfs) cannot be torn.
+ */
+static void check_atomic_writes(int db_fd, struct stat const *st) {
+    dev_t dev = st->st_dev;
+    unsigned long logical = 0;
+    if (S_ISBLK(st->st_mode)) {
+        int size;
+        if (ioctl(db_fd, BLKSSZGET, &size) != 0) {
+            perror("BLKSSZGET");
+            exit(1);
+        }
+        dev = st->st_rdev;
+        logical = (unsigned long) size;
+    } else {
+        logical = queue_limit(dev, "logical_block_size");
+    }
+    atomic_flags = 0;
+    if (logical == 0 || logical >= BLK_SIZE) {
+        return;
+    }
+    unsigned long unit_min = queue_limit(dev, "atomic_write_unit_min_bytes");
+    unsigned long unit_max = queue_limit(dev, "atomic_write_unit_max_bytes");
+    if (unit_min != 0 && unit_min <= BLK_SIZE && BLK_SIZE <= unit_max) {
+        atomic_flags = RWF_ATOMIC;
+        return;
+    }
+    fprintf(stderr, "the device writes %lu bytes atomically, less than a %d byte node, so a crash could tear nodes; "
+                    "updates need %d byte logical blocks or RWF_ATOMIC writes\n", logical, BLK_SIZE, BLK_SIZE);
+    exit(1);
+}
+
+/**
+ * Prepare the write path for the database [db_fd], whose superblock has been read,
+ * which is read concurrently by up to [n_readers] threads calling reader_enter /
+ * reader_exit with their index. Finish with write_path_close.
+ */
+void write_path_init(int db_fd, size_t n_readers_) {
+    if (superblock.flags & SB_PACKED_LEAVES) {
+        fprintf(stderr, "database has packed leaves and is read only (create it without --packed-leaves to update it)\n");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(db_fd, &st) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    check_atomic_writes(db_fd, &st);
+    file_end = ((ptr__t) st.st_size + BLK_SIZE - 1) & ~((ptr__t) BLK_SIZE - 1);
+
+    if (posix_memalign((void **) &wp, BLK_SIZE, sizeof(struct WritePath))
+        || posix_memalign((void **) &value_buf, BLK_SIZE, BLK_SIZE)
+        || posix_memalign((void **) &span_buf, BLK_SIZE, MAX_RECORD_BLOCKS * BLK_SIZE)) {
+        perror("posix_memalign failed");
+        exit(1);
+    }
+    memset(wp, 0, sizeof(struct WritePath));
+    value_block = NO_BLOCK;
+    free_len = 0;
+    dead_len = 0;
+    compact_candidates = 0;
+    memset(&write_stats, 0, sizeof(write_stats));
+
+    n_readers = n_readers_;
+    reader_epoch = NULL;
+    if (n_readers > 0) {
+        reader_epoch = calloc(n_readers, sizeof(size_t));
+        BUG_ON(reader_epoch == NULL);
+    }
+
+    /* After a crash the counts in the superblock are stale, so it has to say so before the tree changes */
+    superblock.flags |= SB_OPEN;
+    superblock_write(db_fd, &superblock);
+    if (fdatasync(db_fd) != 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+}
+
+void write_path_free(void) {
+    free(wp);
+    free(value_buf);
+    free(span_buf);
+    free(free_map);
+    free(dead_table);
+    free(reader_epoch);
+    wp = NULL;
+    value_buf = NULL;
+    span_buf = NULL;
+    free_map = NULL;
+    free_cap = 0;
+    dead_table = NULL;
+    dead_cap = 0;
+    reader_epoch = NULL;
+}
+
+void write_path_print_stats(void) {
+    printf("Writes: %lu inserts, %lu updates, %lu deletes, %lu splits, %lu merges, %lu blocks reused\n",
+           write_stats.inserts, write_stats.updates, write_stats.deletes, write_stats.splits,
+           write_stats.merges, write_stats.reused);
+    if (write_stats.compactions > 0) {
+        printf("Compaction: %lu passes, %lu values moved, %lu value blocks reclaimed\n",
+               write_stats.compactions, write_stats.values_moved, write_stats.blocks_reclaimed);
+    }
+}
+
+/* Announce that reader [reader] starts a lookup; no-op without concurrent writers */
+void reader_enter(size_t reader) {
+    if (reader_epoch == NULL) {
+        return;
+    }
+    /* Retry if a writer moved on while we announced, so that it never misses us */
+    size_t e;
+    do {
+        e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&reader_epoch[reader], e, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) != e);
+}
+
+void reader_exit(size_t reader) {
+    if (reader_epoch == NULL) {
+        return;
+    }
+    __atomic_store_n(&reader_epoch[reader], 0, __ATOMIC_RELEASE);
+}
+
+/* Epoch of the oldest lookup in progress, or ~0 if there is none */
+static size_t oldest_reader(void) {
+    size_t oldest = ~(size_t) 0;
+    for (size_t i = 0; i < n_readers; ++i) {
+        size_t e = __atomic_load_n(&reader_epoch[i], __ATOMIC_SEQ_CST);
+        if (e != 0 && e < oldest) {
+            oldest = e;
+        }
+    }
+    return oldest;
+}
+
+/* Wait until every lookup that started before now has finished */
+static void synchronize_readers(void) {
+    if (reader_epoch == NULL) {
+        return;
+    }
+    size_t e = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    while (oldest_reader() < e) {
+        sched_yield();
+    }
+}
+
+/* Return the block at [offset], which is no longer linked into the tree, to the free-space map */
+static void free_block(ptr__t offset) {
+    if (free_len == free_cap) {
+        free_cap = free_cap ? 2 * free_cap : 64;
+        free_map = realloc(free_map, free_cap * sizeof(struct FreeBlock));
+        BUG_ON(free_map == NULL);
+    }
+    free_map[free_len].offset = offset;
+    free_map[free_len].epoch = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+    free_len++;
+}
+
+/* Offset of a block for a new node or value block */
+static ptr__t alloc_block(void) {
+    size_t oldest = oldest_reader();
+    for (size_t i = 0; i < free_len; ++i) {
+        if (free_map[i].epoch < oldest) {
+            ptr__t offset = free_map[i].offset;
+            free_map[i] = free_map[--free_len];
+            write_stats.reused++;
+            return offset;
+        }
+    }
+    ptr__t offset = file_end;
+    file_end += BLK_SIZE;
+    return offset;
+}
+
+/* Write the [n] consecutive blocks in [buf] at [offset], with the pwritev2 [flags] */
+static void write_blocks(int db_fd, ptr__t offset, void const *buf, size_t n, struct BlockCache *bc, int flags) {
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = n * BLK_SIZE };
+    ssize_t bytes_written = pwritev2(db_fd, &iov, 1, (off_t) offset, flags);
+    if (bytes_written < 0) {
+        perror("write_block: ");
+        exit(1);
+    }
+    if (bytes_written != (ssize_t) (n * BLK_SIZE)) {
+        fprintf(stderr, "partial write %ld bytes of blocks at %lu\n", bytes_written, offset);
+        exit(1);
+    }
+    if (bc != NULL) {
+        for (size_t i = 0; i < n; ++i) {
+            block_cache_update(bc, offset + i * BLK_SIZE, (char const *) buf + i * BLK_SIZE);
+        }
+    }
+}
+
+static void write_node(int db_fd, ptr__t offset, Node const *node) {
+    write_blocks(db_fd, offset, node, 1, node_cache, atomic_flags);
+}
+
+/* Add the write of [node] at [offset] to the current change */
+static void stage_node(ptr__t offset, Node const *node) {
+    BUG_ON(wp->n_staged == MAX_STAGED);
+    memcpy(&wp->staged[wp->n_staged], node, sizeof(Node));
+    wp->staged_offset[wp->n_staged] = offset;
+    wp->n_staged++;
+}
+
+/* Wait for the readers that may have passed the nodes written so far before the next write */
+static void stage_reader_sync(void) {
+    BUG_ON(wp->n_staged == MAX_STAGED);
+    wp->staged_sync[wp->n_staged] = 1;
+}
+
+/* Read the node at [offset], as the current change leaves it */
+static void staged_read(int db_fd, ptr__t offset, Node *node) {
+    for (size_t i = wp->n_staged; i-- > 0;) {
+        if (wp->staged_offset[i] == offset) {
+            memcpy(node, &wp->staged[i], sizeof(Node));
+            return;
+        }
+    }
+    checked_pread(db_fd, node, sizeof(Node), (long) offset);
+}
+
+/*
+ * Write the staged nodes. When a change rewrites several nodes and there is a log,
+ * their images are made durable first, so that recovery can finish the change; once
+ * the nodes are synced, recovery must no longer rewrite them, as their blocks may be
+ * reused.
+ */
+static void apply_changes(int db_fd) {
+    int logged = wal != NULL && wp->n_staged > 1;
+    if (logged) {
+        uint64_t lsn = wal_append(wal, WAL_NODES, wp->n_staged, NULL, 0);
+        for (size_t i = 0; i < wp->n_staged; ++i) {
+            lsn = wal_append(wal, WAL_NODE, wp->staged_offset[i], (unsigned char *) &wp->staged[i], sizeof(Node));
+        }
+        wal_flush(wal, lsn);
+    }
+    for (size_t i = 0; i < wp->n_staged; ++i) {
+        if (wp->staged_sync[i]) {
+            synchronize_readers();
+            wp->staged_sync[i] = 0;
+        }
+        write_node(db_fd, wp->staged_offset[i], &wp->staged[i]);
+    }
+    if (logged) {
+        if (fdatasync(db_fd) != 0) {
+            perror("fdatasync");
+            exit(1);
+        }
+        nodes_done_lsn = wal_append(wal, WAL_NODES_DONE, 0, NULL, 0);
+    }
+    wp->n_staged = 0;
+}
+
+/* Store the record of the [len] byte [value] in the value heap; returns its offset */
+static ptr__t append_value(int db_fd, unsigned char const *value, unsigned int len) {
+    size_t size = value_record_size(len);
+    if (size > BLK_SIZE) {
+        /* Consecutive blocks are only found at the end of the file */
+        size_t n = (size + BLK_SIZE - 1) / BLK_SIZE;
+        ptr__t offset = file_end;
+        file_end += n * BLK_SIZE;
+        memset(span_buf + (n - 1) * BLK_SIZE, 0, BLK_SIZE);
+        set_value_header((unsigned char *) span_buf, len);
+        memcpy(span_buf + VAL_HDR_SIZE, value, len);
+        write_blocks(db_fd, offset, span_buf, n, value_cache, wal != NULL ? RWF_DSYNC : 0);
+        return offset;
+    }
+    if (value_block == NO_BLOCK || value_used + size > BLK_SIZE) {
+        value_block = alloc_block();
+        value_used = 0;
+        memset(value_buf, 0, BLK_SIZE);
+    }
+    ptr__t offset = value_block + value_used;
+    set_value_header((unsigned char *) value_buf + value_used, len);
+    memcpy(value_buf + value_used + VAL_HDR_SIZE, value, len);
+    value_used += (unsigned int) size;
+    /* The block is rewritten with each value, so it must not be torn either */
+    write_blocks(db_fd, value_block, value_buf, 1, value_cache, atomic_flags | (wal != NULL ? RWF_DSYNC : 0));
+    return offset;
+}
+
+/* Slot of [block] in the dead slot table, or the empty slot where it belongs */
+static struct DeadCount *dead_slot(ptr__t block) {
+    size_t i = (size_t) (block >> BLK_SIZE_LOG) * 0x9e3779b97f4a7c15ul;
+    for (i &= dead_cap - 1;; i = (i + 1) & (dead_cap - 1)) {
+        if (dead_table[i].block == block || dead_table[i].block == NO_BLOCK) {
+            return &dead_table[i];
+        }
+    }
+}
+
+/* Add [bytes] to the dead bytes of [block] */
+static void block_dead(ptr__t block, size_t bytes) {
+    if (2 * (dead_len + 1) > dead_cap) {
+        /* Keep the table at most half full */
+        struct DeadCount *old = dead_table;
+        size_t old_cap = dead_cap;
+        dead_cap = dead_cap ? 2 * dead_cap : 1024;
+        dead_table = malloc(dead_cap * sizeof(struct DeadCount));
+        BUG_ON(dead_table == NULL);
+        for (size_t i = 0; i < dead_cap; ++i) {
+            dead_table[i].block = NO_BLOCK;
+        }
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old[i].block != NO_BLOCK) {
+                *dead_slot(old[i].block) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct DeadCount *slot = dead_slot(block);
+    if (slot->block == NO_BLOCK) {
+        slot->block = block;
+        slot->dead = 0;
+        dead_len++;
+    }
+    if (slot->dead < COMPACT_MIN_DEAD && slot->dead + bytes >= COMPACT_MIN_DEAD) {
+        compact_candidates++;
+    }
+    slot->dead += (unsigned int) bytes;
+}
+
+/* Count the value at leaf pointer [ptr], which no leaf points to any more, as dead */
+static void value_dead(ptr__t ptr) {
+    ptr__t offset = decode(ptr);
+    size_t size = value_record_size(value_len(ptr));
+    if (size <= BLK_SIZE) {
+        block_dead(value_base(offset), size);
+        return;
+    }
+    /* The blocks of a large value hold nothing else */
+    for (ptr__t block = offset; block < offset + size; block += BLK_SIZE) {
+        block_dead(block, BLK_SIZE);
+    }
+}
+
+/* Read the path from the root to the leaf that holds (or would hold) [key] into [wp] */
+static void descend(int db_fd, key__t key) {
+    ptr__t offset = superblock.root;
+    for (size_t d = 0;; ++d) {
+        if (d == MAX_DEPTH) {
+            fprintf(stderr, "tree is deeper than %d levels\n", MAX_DEPTH);
+            exit(1);
+        }
+        checked_pread(db_fd, &wp->node[d], sizeof(Node), (long) offset);
+        wp->offset[d] = offset;
+        if (node_type(&wp->node[d]) == LEAF) {
+            wp->depth = d;
+            return;
+        }
+        wp->child[d] = node_child_index(key, &wp->node[d]);
+        offset = decode(wp->node[d].ptr[wp->child[d]]);
+    }
+}
+
+/* Index of the first key of the leaf [node] that is not smaller than [key] */
+static unsigned int lower_bound(Node const *node, key__t key) {
+    unsigned int i = 0, n = node_nkeys(node);
+    while (i < n && node->key[i] < key) {
+        ++i;
+    }
+    return i;
+}
+
+/* Make [node] a [type] node with the [n] entries [key], [ptr] */
+static void set_entries(Node *node, meta__t type, key__t const *key, ptr__t const *ptr, unsigned int n,
+                        meta__t next) {
+    node->next = next;
+    node->type = make_node_type(type, n);
+    for (unsigned int k = 0; k < NODE_CAPACITY; ++k) {
+        node->key[k] = k < n ? key[k] : KEY_PAD;
+        node->ptr[k] = k < n ? ptr[k] : 0;
+    }
+}
+
+/* Append the entries of [src] to [dst], which takes over its next pointer; the caller checked that they fit */
+static void append_entries(Node *dst, Node const *src) {
+    unsigned int n = node_nkeys(dst), m = node_nkeys(src);
+    memcpy(&dst->key[n], src->key, m * sizeof(key__t));
+    memcpy(&dst->ptr[n], src->ptr, m * sizeof(ptr__t));
+    dst->type = make_node_type(node_type(dst), n + m);
+    dst->next = src->next;
+}
+
+static void remove_entry(Node *node, unsigned int i) {
+    unsigned int n = node_nkeys(node);
+    memmove(&node->key[i], &node->key[i + 1], (n - i - 1) * sizeof(key__t));
+    memmove(&node->ptr[i], &node->ptr[i + 1], (n - i - 1) * sizeof(ptr__t));
+    node->key[n - 1] = KEY_PAD;
+    node->ptr[n - 1] = 0;
+    node->type = make_node_type(node_type(node), n - 1);
+}
+
+/* Record in the superblock that nodes are about to be split or merged, see SB_RESHAPED */
+static void mark_reshaped(int db_fd) {
+    if (superblock.flags & SB_RESHAPED) {
+        return;
+    }
+    superblock.flags |= SB_RESHAPED;
+    superblock_write(db_fd, &superblock);
+}
+
+/*
+ * Add the entry ([key], [ptr]) at index [i] of the node at depth [d] of the path and
+ * write it back, splitting it (and its ancestors, if they are full) when it is full
+ */
+static void insert_at(int db_fd, size_t d, unsigned int i, key__t key, ptr__t ptr) {
+    Node *node = &wp->node[d];
+    unsigned int n = node_nkeys(node);
+    if (n < NODE_CAPACITY) {
+        memmove(&node->key[i + 1], &node->key[i], (n - i) * sizeof(key__t));
+        memmove(&node->ptr[i + 1], &node->ptr[i], (n - i) * sizeof(ptr__t));
+        node->key[i] = key;
+        node->ptr[i] = ptr;
+        node->type = make_node_type(node_type(node), n + 1);
+        stage_node(wp->offset[d], node);
+        return;
+    }
+
+    mark_reshaped(db_fd);
+    write_stats.splits++;
+    key__t keys[NODE_CAPACITY + 1];
+    ptr__t ptrs[NODE_CAPACITY + 1];
+    memcpy(keys, node->key, i * sizeof(key__t));
+    memcpy(ptrs, node->ptr, i * sizeof(ptr__t));
+    keys[i] = key;
+    ptrs[i] = ptr;
+    memcpy(&keys[i + 1], &node->key[i], (n - i) * sizeof(key__t));
+    memcpy(&ptrs[i + 1], &node->ptr[i], (n - i) * sizeof(ptr__t));
+
+    meta__t type = node_type(node);
+    unsigned int low = (n + 1) / 2;
+    Node *right = &wp->spare;
+    ptr__t right_offset = alloc_block();
+    set_entries(right, type, &keys[low], &ptrs[low], n + 1 - low, node->next);
+
+    if (d == 0) {
+        /* The root stays in place: move both halves out and make it their parent */
+        Node *left = &wp->spare2;
+        ptr__t left_offset = alloc_block();
+        set_entries(left, type, keys, ptrs, low, right_offset);
+        stage_node(right_offset, right);
+        stage_node(left_offset, left);
+
+        key__t root_keys[2] = { keys[0], keys[low] };
+        ptr__t root_ptrs[2] = { encode(left_offset), encode(right_offset) };
+        set_entries(node, INTERNAL, root_keys, root_ptrs, 2, 0);
+        stage_node(superblock.root, node);
+        return;
+    }
+
+    stage_node(right_offset, right);
+    insert_at(db_fd, d - 1, wp->child[d - 1] + 1, keys[low], encode(right_offset));
+    /* Lookups that read the parent before it pointed to [right] may still expect the upper half here */
+    stage_reader_sync();
+    set_entries(node, type, keys, ptrs, low, right_offset);
+    stage_node(wp->offset[d], node);
+}
+
+static void remove_at(int db_fd, size_t d, unsigned int i);
+
+/*
+ * Merge the node at depth [d] of the path, which has already been changed in memory,
+ * with its right or left sibling if their entries fit in one node, and write the result
+ * @return 1 if the nodes were merged, 0 if the caller has to write the node itself
+ */
+static int merge_with_sibling(int db_fd, size_t d) {
+    Node *node = &wp->node[d];
+    Node *parent = &wp->node[d - 1];
+    Node *sibling = &wp->spare;
+    unsigned int idx = wp->child[d - 1];
+
+    if (idx + 1 < node_nkeys(parent)) {
+        ptr__t right = decode(parent->ptr[idx + 1]);
+        staged_read(db_fd, right, sibling);
+        if (node_nkeys(node) + node_nkeys(sibling) <= NODE_CAPACITY) {
+            /* Pull the right sibling into this node */
+            mark_reshaped(db_fd);
+            append_entries(node, sibling);
+            stage_node(wp->offset[d], node);
+            remove_at(db_fd, d - 1, idx + 1);
+            free_block(right);
+            write_stats.merges++;
+            return 1;
+        }
+    }
+    if (idx > 0) {
+        ptr__t left = decode(parent->ptr[idx - 1]);
+        staged_read(db_fd, left, sibling);
+        if (node_nkeys(node) + node_nkeys(sibling) <= NODE_CAPACITY) {
+            /* Move this node into its left sibling */
+            mark_reshaped(db_fd);
+            append_entries(sibling, node);
+            stage_node(left, sibling);
+            remove_at(db_fd, d - 1, idx);
+            free_block(wp->offset[d]);
+            write_stats.merges++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Remove entry [i] of the node at depth [d] of the path and write it back, merging it if it gets small */
+static void remove_at(int db_fd, size_t d, unsigned int i) {
+    Node *node = &wp->node[d];
+    remove_entry(node, i);
+
+    if (d > 0) {
+        if (node_nkeys(node) >= MIN_ENTRIES || !merge_with_sibling(db_fd, d)) {
+            stage_node(wp->offset[d], node);
+        }
+        return;
+    }
+
+    if (node_type(node) != LEAF && node_nkeys(node) == 1) {
+        /* Root with a single child: pull the child up, the tree loses a level */
+        ptr__t child = decode(node->ptr[0]);
+        staged_read(db_fd, child, node);
+        node->next = 0;
+        stage_node(superblock.root, node);
+        free_block(child);
+        return;
+    }
+    stage_node(superblock.root, node);
+}
+
+/**
+ * Insert [key] with the [len] byte [value], or replace its value if it exists.
+ * Safe to call from several threads while others look up keys.
+ *
+ * @return 1 if the key was inserted, 0 if it was updated
+ */
+int kv_put(int db_fd, key__t key, unsigned char const *value, unsigned int len) {
+    pthread_mutex_lock(&write_lock);
+    ptr__t ptr = encode_value(append_value(db_fd, value, len), len);
+    descend(db_fd, key);
+
+    Node *leaf = &wp->node[wp->depth];
+    unsigned int i = lower_bound(leaf, key);
+    int inserted = i == node_nkeys(leaf) || leaf->key[i] != key;
+    if (inserted) {
+        insert_at(db_fd, wp->depth, i, key, ptr);
+        write_stats.inserts++;
+    } else {
+        value_dead(leaf->ptr[i]);
+        leaf->ptr[i] = ptr;
+        stage_node(wp->offset[wp->depth], leaf);
+        write_stats.updates++;
+    }
+    apply_changes(db_fd);
+    if (wal != NULL) {
+        last_lsn = wal_append(wal, WAL_PUT, key, value, len);
+    }
+    pthread_mutex_unlock(&write_lock);
+    return inserted;
+}
+
+/**
+ * Delete [key]. Its value stays in the heap.
+ * @return 0 if the key was deleted, -1 if it does not exist
+ */
+int kv_delete(int db_fd, key__t key) {
+    pthread_mutex_lock(&write_lock);
+    descend(db_fd, key);
+
+    Node *leaf = &wp->node[wp->depth];
+    unsigned int i = lower_bound(leaf, key);
+    int found = i < node_nkeys(leaf) && leaf->key[i] == key;
+    if (found) {
+        value_dead(leaf->ptr[i]);
+        remove_at(db_fd, wp->depth, i);
+        apply_changes(db_fd);
+        write_stats.deletes++;
+        if (wal != NULL) {
+            last_lsn = wal_append(wal, WAL_DELETE, key, NULL, 0);
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+    return found ? 0 : -1;
+}
+
+static int cmp_block(void const *a, void const *b) {
+    ptr__t x = *(ptr__t const *) a;
+    ptr__t y = *(ptr__t const *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Reclaim the value blocks that are at least half dead: append their live values
+ * anew, point the leaves at the copies, and free the blocks once the leaves are on
+ * disk. Writers and readers may run meanwhile; the leaves are rewritten one at a
+ * time under the write lock, in key order, so entries that splits and merges move
+ * around are still visited.
+ *
+ * @return the number of blocks reclaimed
+ */
+size_t write_path_compact(int db_fd) {
+    /* The blocks to reclaim; never the one values are being appended to */
+    pthread_mutex_lock(&write_lock);
+    size_t n_victims = 0;
+    ptr__t *victims = malloc((compact_candidates + 1) * sizeof(ptr__t));
+    BUG_ON(victims == NULL);
+    for (size_t i = 0; i < dead_cap && n_victims < compact_candidates; ++i) {
+        if (dead_table[i].block != NO_BLOCK && dead_table[i].dead >= COMPACT_MIN_DEAD
+            && dead_table[i].block != value_block) {
+            victims[n_victims++] = dead_table[i].block;
+        }
+    }
+    pthread_mutex_unlock(&write_lock);
+    if (n_victims == 0) {
+        free(victims);
+        return 0;
+    }
+    qsort(victims, n_victims, sizeof(ptr__t), cmp_block);
+
+    char *buf = (char *) aligned_alloca(BLK_SIZE, MAX_RECORD_BLOCKS * BLK_SIZE);
+    ptr__t buf_offset = NO_BLOCK;
+    size_t moved = 0;
+    key__t key = 0;
+    for (int reached_end = 0; !reached_end;) {
+        pthread_mutex_lock(&write_lock);
+        descend(db_fd, key);
+        Node *leaf = &wp->node[wp->depth];
+        unsigned int n = node_nkeys(leaf);
+        int changed = 0;
+        for (unsigned int i = 0; i < n; ++i) {
+            ptr__t offset = decode(leaf->ptr[i]);
+            unsigned int len = value_len(leaf->ptr[i]);
+            ptr__t first = value_base(offset);
+            /* Large values are freed all at once, so checking their first block suffices */
+            if (bsearch(&first, victims, n_victims, sizeof(ptr__t), cmp_block) == NULL) {
+                continue;
+            }
+            /* Victims are not written until they are freed, so the copy stays valid */
+            size_t size = value_base(offset + value_record_size(len) - 1) - first + BLK_SIZE;
+            if (first != buf_offset) {
+                checked_pread(db_fd, buf, size, (long) first);
+                /* Only single blocks are worth keeping for the next values */
+                buf_offset = size == BLK_SIZE ? first : NO_BLOCK;
+            }
+            ptr__t moved_to = append_value(db_fd, (unsigned char *) buf + (offset - first) + VAL_HDR_SIZE, len);
+            leaf->ptr[i] = encode_value(moved_to, len);
+            changed = 1;
+            moved++;
+        }
+        if (changed) {
+            write_node(db_fd, wp->offset[wp->depth], leaf);
+        }
+        /*
+         * Go on with the first key of the next leaf; keys above this leaf's last one may still
+         * lead here. Leaves that could not be merged after deletes may be empty: step over them.
+         */
+        reached_end = 1;
+        for (ptr__t next = leaf->next; next != 0; next = wp->spare.next) {
+            checked_pread(db_fd, &wp->spare, sizeof(Node), (long) next);
+            if (node_nkeys(&wp->spare) > 0) {
+                key = wp->spare.key[0];
+                reached_end = 0;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&write_lock);
+    }
+
+    /*
+     * Only now that every leaf was visited are the victims unreachable. Reused blocks are
+     * overwritten, so the leaves must not point to them after a crash, and recovery must
+     * not rewrite leaves from node images logged before they were moved.
+     */
+    if (fdatasync(db_fd) != 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+    pthread_mutex_lock(&write_lock);
+    if (wal != NULL) {
+        wal_flush(wal, nodes_done_lsn);
+    }
+    for (size_t i = 0; i < n_victims; ++i) {
+        struct DeadCount *slot = dead_slot(victims[i]);
+        slot->dead = 0;
+        compact_candidates--;
+        free_block(victims[i]);
+    }
+    write_stats.compactions++;
+    write_stats.values_moved += moved;
+    write_stats.blocks_reclaimed += n_victims;
+    pthread_mutex_unlock(&write_lock);
+    free(victims);
+    return n_victims;
+}
+
+/* Live bytes of a block that holds a node, in write_path_scan_values */
+#define SCAN_NODE 0xffff
+
+/* Mark the blocks of the subtree at [offset], at depth [d], and the values its leaves point to in [live] */
+static void scan_subtree(int db_fd, ptr__t offset, size_t d, unsigned short *live) {
+    if (d == MAX_DEPTH) {
+        fprintf(stderr, "tree is deeper than %d levels\n", MAX_DEPTH);
+        exit(1);
+    }
+    Node *node = &wp->node[d];
+    checked_pread(db_fd, node, sizeof(Node), (long) offset);
+    live[offset >> BLK_SIZE_LOG] = SCAN_NODE;
+    unsigned int n = node_nkeys(node);
+    if (node_type(node) != LEAF) {
+        for (unsigned int i = 0; i < n; ++i) {
+            /* Reading a child overwrites the nodes below this one only */
+            scan_subtree(db_fd, decode(wp->node[d].ptr[i]), d + 1, live);
+        }
+        return;
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+        ptr__t ptr = node->ptr[i];
+        ptr__t value = decode(ptr);
+        size_t size = value_record_size(value_len(ptr));
+        if (size <= BLK_SIZE) {
+            live[value >> BLK_SIZE_LOG] += (unsigned short) size;
+            continue;
+        }
+        for (ptr__t block = value; block < value + size; block += BLK_SIZE) {
+            live[block >> BLK_SIZE_LOG] = BLK_SIZE;
+        }
+    }
+}
+
+/**
+ * Rebuild the dead byte counts and the free-space map, which only live in memory, so
+ * that compaction also reclaims what earlier runs left behind. Walks the whole tree:
+ * blocks that no node points to are free, and value blocks are dead except for the
+ * records leaves point to (including the slack at their end, which was never used).
+ * Call after write_path_init, before the first change.
+ */
+void write_path_scan_values(int db_fd) {
+    size_t n_blocks = file_end >> BLK_SIZE_LOG;
+    unsigned short *live = calloc(n_blocks, sizeof(unsigned short));
+    BUG_ON(live == NULL);
+    live[SUPERBLOCK_OFFSET >> BLK_SIZE_LOG] = SCAN_NODE;
+    scan_subtree(db_fd, superblock.root, 0, live);
+
+    size_t n_free = 0;
+    for (size_t b = 0; b < n_blocks; ++b) {
+        if (live[b] == 0) {
+            free_block((ptr__t) b << BLK_SIZE_LOG);
+            n_free++;
+        } else if (live[b] < BLK_SIZE) {
+            block_dead((ptr__t) b << BLK_SIZE_LOG, BLK_SIZE - live[b]);
+        }
+    }
+    free(live);
+    printf("Value blocks: %lu free, %lu at least half dead\n", n_free, compact_candidates);
+}
+
+/* Whether enough value blocks can be reclaimed to make a compaction pass worthwhile */
+int write_path_compact_due(void) {
+    size_t candidates = __atomic_load_n(&compact_candidates, __ATOMIC_RELAXED);
+    size_t blocks = __atomic_load_n(&file_end, __ATOMIC_RELAXED) >> BLK_SIZE_LOG;
+    return candidates >= COMPACT_MIN_BLOCKS && candidates >= blocks / COMPACT_FILE_FRACTION;
+}
+
+static struct {
+    pthread_t tid;
+    int db_fd;
+    int stop;
+} compactor;
+
+static void *compactor_thread(void *arg) {
+    (void) arg;
+    struct timespec pause = { .tv_nsec = 1000000 };
+    while (!__atomic_load_n(&compactor.stop, __ATOMIC_ACQUIRE)) {
+        if (write_path_compact_due()) {
+            write_path_compact(compactor.db_fd);
+        } else {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Compact value blocks of [db_fd] in the background until compactor_stop */
+void compactor_start(int db_fd) {
+    compactor.db_fd = db_fd;
+    compactor.stop = 0;
+    if (pthread_create(&compactor.tid, NULL, compactor_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+void compactor_stop(void) {
+    __atomic_store_n(&compactor.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(compactor.tid, NULL);
+}
+
+/* Log every change from now on to [wal_] */
+void write_path_attach_wal(struct Wal *wal_) {
+    wal = wal_;
+}
+
+/**
+ * Wait until the changes this thread made are durable, and checkpoint the log
+ * when it has grown large. No-op without a log.
+ */
+void write_path_commit(int db_fd) {
+    if (wal == NULL) {
+        return;
+    }
+    wal_commit(wal, last_lsn);
+    if (wal_checkpoint_due(wal)) {
+        pthread_mutex_lock(&write_lock);
+        if (wal_checkpoint_due(wal)) {
+            wal_checkpoint(wal, db_fd);
+        }
+        pthread_mutex_unlock(&write_lock);
+    }
+}
+
+/* Checkpoint and detach the log, if any */
+void write_path_close_wal(int db_fd) {
+    if (wal == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&write_lock);
+    wal_checkpoint(wal, db_fd);
+    pthread_mutex_unlock(&write_lock);
+    wal_print_stats(wal);
+    wal_close(wal);
+    wal = NULL;
+}
+
+/**
+ * Once the changes are on disk, store the new layer and key counts in the superblock
+ * and clear SB_OPEN. Call before write_path_free, with no writers left.
+ */
+void write_path_close(int db_fd) {
+    if (fdatasync(db_fd) != 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+    superblock.layers = tree_height(db_fd, superblock.root);
+    /* Inserts and deletes are counted against the tree, so they are exact even when replaying a log */
+    if (superblock.n_keys != 0) {
+        superblock.n_keys += write_stats.inserts - write_stats.deletes;
+    }
+    superblock.flags &= ~SB_OPEN;
+    superblock_write(db_fd, &superblock);
+    if (fdatasync(db_fd) != 0) {
+        perror("fdatasync");
+        exit(1);
+    }
+}
+
+int do_put_cmd(int argc, char *argv[], struct ArgState *as) {
+    struct PutArgs pa = { .count = 1, .wal = WAL_ARGS_DEFAULT };
+    parse_put_opts(argc, argv, &pa);
+    open_database(as);
+
+    int db_fd = get_handler(as->filename, O_RDWR);
+    load_geometry(db_fd, as->layers);
+    if (pa.value != NULL) {
+        /* Stored by write_path_init, before the first value that is not the key */
+        superblock.flags &= ~SB_GENERATED_VALUES;
+    }
+    write_path_init(db_fd, 0);
+    if (pa.compact) {
+        write_path_scan_values(db_fd);
+    }
+    if (pa.wal.enabled) {
+        write_path_attach_wal(wal_open(as->filename, &pa.wal));
+    }
+
+    unsigned char value[MAX_VAL_LEN];
+    unsigned int len = pa.value_size ? pa.value_size : DEFAULT_VAL_LEN;
+    if (pa.value != NULL) {
+        len = (unsigned int) strlen(pa.value);
+        memcpy(value, pa.value, len);
+    }
+    size_t changed = 0;
+    for (size_t i = 0; i < pa.count; ++i) {
+        key__t key = pa.key + i;
+        if (pa.delete) {
+            changed += kv_delete(db_fd, key) == 0;
+        } else {
+            if (pa.value == NULL) {
+                format_value((char *) value, key, len);
+            }
+            changed += kv_put(db_fd, key, value, len);
+        }
+        if (pa.wal.enabled && (i + 1) % pa.wal.commit_batch == 0) {
+            write_path_commit(db_fd);
+        }
+        /* Reclaim blocks while we still append, so that new values can reuse them */
+        if (pa.compact && write_path_compact_due()) {
+            write_path_compact(db_fd);
+        }
+    }
+    if (pa.wal.enabled) {
+        write_path_commit(db_fd);
+        write_path_close_wal(db_fd);
+    }
+    write_path_close(db_fd);
+
+    if (pa.delete) {
+        printf("Deleted %lu keys, %lu not found\n", changed, pa.count - changed);
+    } else {
+        printf("Inserted %lu keys, updated %lu keys\n", changed, pa.count - changed);
+    }
+    write_path_print_stats();
+    if (superblock.layers != (uint32_t) as->layers) {
+        printf("The tree now has %u layers\n", superblock.layers);
+    }
+
+    write_path_free();
+    close(db_fd);
+    free_globals();
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef _WRITE_H_
+#define _WRITE_H_
+
+#include <stddef.h>
+
+#include "db_types.h"
+
+struct ArgState;
+struct Wal;
+
+int do_put_cmd(int argc, char *argv[], struct ArgState *as);
+
+void write_path_init(int db_fd, size_t n_readers);
+
+void write_path_scan_values(int db_fd);
+
+void write_path_close(int db_fd);
+
+void write_path_free(void);
+
+void write_path_print_stats(void);
+
+int kv_put(int db_fd, key__t key, unsigned char const *value, unsigned int len);
+
+int kv_delete(int db_fd, key__t key);
+
+int write_path_compact_due(void);
+
+size_t write_path_compact(int db_fd);
+
+void compactor_start(int db_fd);
+
+void compactor_stop(void);
+
+void write_path_attach_wal(struct Wal *wal);
+
+void write_path_commit(int db_fd);
+
+void write_path_close_wal(int db_fd);
+
+void reader_enter(size_t reader);
+
+void reader_exit(size_t reader);
+
+#endif /* _WRITE_H_ */
@@ -0,0 +1,31 @@
+#ifndef XRP_EMU_SHIM_H
+#define XRP_EMU_SHIM_H
+
+/*
+ * Shim that lets the XRP programs in this directory be compiled natively
+ * (with -DXRP_EMU) and driven by the userspace emulator in xrp_emu.c.
+ *
+ * Mirrors the subset of the XRP kernel interface that the programs use.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#define XRP_MAX_ADDRS 16
+
+struct bpf_xrp {
+    /* Data read by the previous I/O */
+    char *data;
+    /* Set by the program to stop resubmitting */
+    int done;
+    /* Next I/O; only the first entry is used by the emulator */
+    unsigned long next_addr[XRP_MAX_ADDRS];
+    unsigned long size[XRP_MAX_ADDRS];
+    /* Per-call scratch page shared with userspace */
+    char *scratch;
+};
+
+#define SEC(name)
+#define bpf_printk(...) printf(__VA_ARGS__)
+
+#endif /* XRP_EMU_SHIM_H */
@@ -3,8 +3,12 @@
  *
  * Author: etm2131@columbia.edu
  */
+#ifdef XRP_EMU
+#include "emu.h"
+#else
 #include <linux/bpf.h>
 #include <bpf/bpf_helpers.h>
+#endif
 #include "simplekvspec.h"
 
 #ifndef NULL
@@ -13,14 +17,28 @@
 
 char LICENSE[] SEC("license") = "GPL";
 
-static __inline int key_exists(unsigned long const key, Node *node) {
+/* Leaf pointer of [key] in the leaf [node], or 0 if it is not there */
+static __inline ptr__t leaf_lookup(unsigned long const key, Node *node) {
     /* Safety: NULL is never passed for node, but mr. verifier doesn't know that */
-    dbg_print("simplekv-bpf: key_exists entered\n");
+    dbg_print("simplekv-bpf: leaf_lookup entered\n");
     if (node == NULL)
-        return -1;
+        return 0;
+    if (node_packed(node)) {
+        PackedLeaf *leaf = (PackedLeaf *) node;
+        /* Unused slots hold KEY_DELTA_PAD, which no key of the leaf is that far from the base */
+        unsigned long delta = key - leaf->key_base;
+        if (key < leaf->key_base || delta >= KEY_DELTA_PAD)
+            return 0;
+        for (int i = 0; i < (int) PACKED_CAPACITY; ++i) {
+            if (leaf->key_delta[i] == delta) {
+                return encode_value(leaf->ptr_base + leaf->ptr_delta[i], leaf->value_len[i]);
+            }
+        }
+        return 0;
+    }
     for (int i = 0; i < NODE_CAPACITY; ++i) {
         if (node->key[i] == key) {
-            return 1;
+            return node->ptr[i];
         }
     }
     return 0;
@@ -57,7 +75,7 @@ static __inline void set_context_next_index(struct bpf_xrp *context, struct Scat
 }
 
 /* Mask to prevent out of bounds memory access */
-#define EBPF_CONTEXT_MASK SG_KEYS - 1
+#define EBPF_CONTEXT_MASK (SG_KEYS - 1)
 
 SEC("oliver_agg")
 unsigned int oliver_agg_func(struct bpf_xrp *context) {
@@ -84,21 +102,36 @@ unsigned int oliver_agg_func(struct bpf_xrp *context) {
     if (query->state_flags & AT_VALUE) {
         dbg_print("simplekv-bpf: case 1 - value found\n");
 
-        ptr__t offset = query->value_ptr & (BLK_SIZE - 1);
+        ptr__t offset = value_offset(decode(query->value_ptr));
         struct MaybeValue *mv = &query->values[*curr_idx & EBPF_CONTEXT_MASK];
         mv->found = 1;
-        memcpy(mv->value, context->data + offset, sizeof(val__t));
+        mv->value_len = value_len(query->value_ptr);
+        mv->value_ptr = decode(query->value_ptr);
+        /*
+         * Records larger than a block start at a block boundary, so the prefix is in this block.
+         * Only copy the inline prefix, and never past the end of the block: a short value can
+         * sit at the very end of it. Indexes are masked for the verifier.
+         */
+        unsigned int inline_len = value_inline_len(mv->value_len);
+        for (unsigned int k = 0; k < VAL_SIZE && k < inline_len; ++k) {
+            ptr__t at = offset + VAL_HDR_SIZE + k;
+            if (at >= BLK_SIZE) {
+                break;
+            }
+            mv->value[k] = context->data[at & (BLK_SIZE - 1)];
+        }
 
         set_context_next_index(context, query);
         return 0;
     }
 
     /* Case 2: verify key & submit read for block containing value */
-    if (node->type == LEAF) {
+    if (node_type(node) == LEAF) {
         dbg_print("simplekv-bpf: case 2 - verify key & get last block\n");
 
         query->state_flags = REACHED_LEAF;
-        if (!key_exists(query->keys[*curr_idx & EBPF_CONTEXT_MASK], node)) {
+        ptr__t value_ptr = leaf_lookup(query->keys[*curr_idx & EBPF_CONTEXT_MASK], node);
+        if (value_ptr == 0) {
             dbg_print("simplekv-bpf: key doesn't exist\n");
 
             /* Skip this key */
@@ -107,9 +140,9 @@ unsigned int oliver_agg_func(struct bpf_xrp *context) {
             return 0;
         }
         query->state_flags = AT_VALUE;
-        query->value_ptr = decode(nxt_node(query->keys[*curr_idx & EBPF_CONTEXT_MASK], node));
+        query->value_ptr = value_ptr;
         /* Need to submit a request for base of the block containing our offset */
-        ptr__t base = query->value_ptr & ~(BLK_SIZE - 1);
+        ptr__t base = value_base(decode(query->value_ptr));
         context->next_addr[0] = base;
         context->size[0] = BLK_SIZE;
         return 0;
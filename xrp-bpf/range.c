@@ -3,8 +3,12 @@
  *
  * Author: etm2131@columbia.edu
  */
+#ifdef XRP_EMU
+#include "emu.h"
+#else
 #include <linux/bpf.h>
 #include <bpf/bpf_helpers.h>
+#endif
 #include "simplekvspec.h"
 
 #ifndef NULL
@@ -29,16 +33,108 @@ static __inline ptr__t nxt_node(unsigned long key, Node *node) {
     return node->ptr[NODE_CAPACITY - 1];
 }
 
-static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQuery *query, Node *node) {
+/*
+ * Entries of the leaf being scanned. While the leaf itself is in the data buffer, they are
+ * read from it; while its values are read, from the window of the leaf saved in the query.
+ */
+struct LeafView {
+    key__t *key;
+    ptr__t *ptr;
+    /* Index of key[0] in the leaf, and mask for indexes into key[] and ptr[] */
+    unsigned int begin;
+    unsigned int mask;
+    /* Entries available from [begin] */
+    unsigned int len;
+    unsigned int nkeys;
+    ptr__t next;
+};
+
+static __inline void node_view(struct LeafView *view, Node *node) {
+    view->key = node->key;
+    view->ptr = node->ptr;
+    view->begin = 0;
+    view->mask = NODE_INDEX_MASK;
+    view->len = NODE_CAPACITY;
+    view->nkeys = node_nkeys(node);
+    view->next = node->next;
+}
+
+static __inline void window_view(struct LeafView *view, struct RangeQuery *query) {
+    view->key = query->_window_key;
+    view->ptr = query->_window_ptr;
+    view->begin = query->_window_begin;
+    view->mask = KEY_MASK;
+    view->len = RNG_KEYS;
+    view->nkeys = query->_leaf_nkeys;
+    view->next = query->_leaf_next;
+}
+
+/* Save entries [begin, begin + RNG_KEYS) of the leaf [node] in the query, padded past its end */
+static __inline void save_window(struct RangeQuery *query, Node *node, unsigned int begin) {
+    for (unsigned int k = 0; k < RNG_KEYS; ++k) {
+        unsigned int j = begin + k;
+        if (j < NODE_CAPACITY) {
+            query->_window_key[k] = node->key[j & NODE_INDEX_MASK];
+            query->_window_ptr[k] = node->ptr[j & NODE_INDEX_MASK];
+        } else {
+            query->_window_key[k] = KEY_PAD;
+            query->_window_ptr[k] = 0;
+        }
+    }
+    query->_window_begin = begin;
+    query->_leaf_nkeys = node_nkeys(node);
+    query->_leaf_next = node->next;
+}
+
+/*
+ * Packed leaves are only ever read through the window: save entries from the first one
+ * at or after _node_key_ix that is not before the range, decoded to keys and leaf pointers.
+ */
+static __inline void save_packed_window(struct RangeQuery *query, PackedLeaf *leaf) {
+    key__t first_key = query->flags & RNG_BEGIN_EXCLUSIVE ? query->range_begin + 1 : query->range_begin;
+    unsigned int nkeys = node_nkeys((Node *) leaf);
+    unsigned int begin = query->_node_key_ix;
+    for (unsigned int k = 0; k < PACKED_CAPACITY && begin < nkeys && begin < PACKED_CAPACITY; ++k) {
+        if (leaf->key_base + leaf->key_delta[begin] >= first_key) {
+            break;
+        }
+        ++begin;
+    }
+    for (unsigned int k = 0; k < RNG_KEYS; ++k) {
+        unsigned int j = begin + k;
+        if (j < PACKED_CAPACITY) {
+            query->_window_key[k] = leaf->key_base + leaf->key_delta[j];
+            query->_window_ptr[k] = encode_value(leaf->ptr_base + leaf->ptr_delta[j], leaf->value_len[j]);
+        } else {
+            query->_window_key[k] = KEY_PAD;
+            query->_window_ptr[k] = 0;
+        }
+    }
+    query->_node_key_ix = begin;
+    query->_window_begin = begin;
+    query->_leaf_nkeys = nkeys;
+    query->_leaf_next = leaf->next;
+}
+
+static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQuery *query,
+                                          struct LeafView *view, Node *node) {
     key__t first_key = query->flags & RNG_BEGIN_EXCLUSIVE ? query->range_begin + 1 : query->range_begin;
     unsigned int end_inclusive = query->flags & RNG_END_INCLUSIVE;
+    unsigned int nkeys = view->nkeys;
     
     /* Iterate over keys in leaf node */
     unsigned int *i = &query->_node_key_ix;
     for(;;) {
-        /* Iterate over keys in leaf node */
-        for (; *i < NODE_CAPACITY && query->len < RNG_KEYS; ++(*i)) {
-            key__t curr_key = node->key[*i & KEY_MASK];
+        /* Iterate over keys in leaf node; packed leaves hold more than NODE_CAPACITY */
+        for (; *i < PACKED_CAPACITY && *i < nkeys && query->len < RNG_KEYS; ++(*i)) {
+            if (*i - view->begin >= view->len) {
+                /* Past the saved window (never with full windows); read the rest of the leaf again */
+                query->_state = RNG_READ_NODE;
+                context->next_addr[0] = query->_resume_from_leaf;
+                context->size[0] = BLK_SIZE;
+                return 0;
+            }
+            key__t curr_key = view->key[(*i - view->begin) & view->mask];
             if (curr_key > query->range_end || (curr_key == query->range_end && !end_inclusive)) {
                 /* All done; set state and return 0 */
                 mark_range_query_complete(query);
@@ -48,16 +144,19 @@ static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQ
             /* Retrieve value for this key */
             if (curr_key >= first_key) {
                 /* Set up the next resubmit to read the value */
-                context->next_addr[0] = value_base(decode(node->ptr[*i & KEY_MASK]));
+                context->next_addr[0] = value_base(decode(view->ptr[(*i - view->begin) & view->mask]));
                 context->size[0] = BLK_SIZE;
 
-                key__t key = node->key[*i & KEY_MASK];
-                query->kv[query->len & KEY_MASK].key = key;
+                query->kv[query->len & KEY_MASK].key = curr_key;
 
                 /* Fixup the begin range so that we don't try to grab the same key again */
-                query->range_begin = key;
+                query->range_begin = curr_key;
                 query->flags |= RNG_BEGIN_EXCLUSIVE;
 
+                /* The value replaces the leaf in the data buffer */
+                if (node != NULL) {
+                    save_window(query, node, *i);
+                }
                 query->_state = RNG_READ_VALUE;
                 return 0;
             }
@@ -71,23 +170,23 @@ static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQ
             context->done = 1;
             query->range_begin = query->kv[(query->len - 1) & KEY_MASK].key;
             query->flags |= RNG_BEGIN_EXCLUSIVE;
-            if (*i < NODE_CAPACITY) {
+            if (*i < nkeys) {
                 /* This node still has values we should inspect */
                 return 0;
             }
 
             /* Need to look at next node */
-            if (node->next == 0) {
+            if (view->next == 0) {
                 /* No next node, so we're done */
                 mark_range_query_complete(query);
             } else {
-                query->_resume_from_leaf = node->next;
+                query->_resume_from_leaf = view->next;
                 query->_node_key_ix = 0;
                 query->_state = RNG_READ_NODE;
             }
             /* Return to user since we marked context->done = 1 at the top of this if block */
             return 0;
-        } else if (node->next == 0) {
+        } else if (view->next == 0) {
             /* Still have room in query buf, but we've read the entire index */
             mark_range_query_complete(query);
             context->done = 1;
@@ -98,10 +197,10 @@ static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQ
          * Query buff isn't full, so we inspected all keys in this node
          * and need to get the next node.
          */
-        query->_resume_from_leaf = node->next;
+        query->_resume_from_leaf = view->next;
         query->_state = RNG_READ_NODE;
         query->_node_key_ix = 0;
-        context->next_addr[0] = node->next;
+        context->next_addr[0] = view->next;
         context->size[0] = BLK_SIZE;
         return 0;
     }
@@ -109,14 +208,20 @@ static __inline unsigned int process_leaf(struct bpf_xrp *context, struct RangeQ
 
 static __inline unsigned int process_value(struct bpf_xrp *context, struct RangeQuery *query) {
     unsigned int *i = &query->_node_key_ix;
-    unsigned long offset = value_offset(decode(query->_current_node.ptr[*i & KEY_MASK]));
+    ptr__t ptr = query->_window_ptr[(*i - query->_window_begin) & KEY_MASK];
+    unsigned long offset = value_offset(decode(ptr)) + VAL_HDR_SIZE;
 
     if (query->agg_op == AGG_NONE) {
-        memcpy(query->kv[query->len & KEY_MASK].value, context->data + offset, sizeof(val__t));
+        struct KeyValue *kv = &query->kv[query->len & KEY_MASK];
+        kv->value_len = value_len(ptr);
+        memcpy(kv->value, context->data + offset, sizeof(val__t));
         query->len += 1;
     }
     else if (query->agg_op == AGG_SUM) {
-        query->agg_value += *(long *) (context->data + offset);
+        /* Records are not aligned */
+        long v;
+        memcpy(&v, context->data + offset, sizeof(long));
+        query->agg_value += v;
     }
 
     /* TODO: This should be incremented, but not doing so does not affect correctness.
@@ -127,17 +232,30 @@ static __inline unsigned int process_value(struct bpf_xrp *context, struct Range
      */
     // *i += 1;
     query->_state = RNG_RESUME;
-    return process_leaf(context, query, &query->_current_node);
+    struct LeafView view;
+    window_view(&view, query);
+    return process_leaf(context, query, &view, NULL);
+}
+
+static __inline unsigned int leaf_read(struct bpf_xrp *context, struct RangeQuery *query, Node *node) {
+    struct LeafView view;
+    if (node_packed(node)) {
+        save_packed_window(query, (PackedLeaf *) node);
+        window_view(&view, query);
+        return process_leaf(context, query, &view, NULL);
+    }
+    node_view(&view, node);
+    return process_leaf(context, query, &view, node);
 }
 
 static __inline unsigned int traverse_index(struct bpf_xrp *context, struct RangeQuery *query, Node *node) {
-    if (node->type == LEAF) {
-        query->_current_node = *node;
-        return process_leaf(context, query, node);
+    if (node_type(node) == LEAF) {
+        return leaf_read(context, query, node);
     }
 
-    /* Grab the next node in the traversal */
-    context->next_addr[0] = decode(nxt_node(query->range_begin, node));
+    /* Grab the next node in the traversal; remember it in case the leaf has to be read again */
+    query->_resume_from_leaf = decode(nxt_node(query->range_begin, node));
+    context->next_addr[0] = query->_resume_from_leaf;
     context->size[0] = BLK_SIZE;
     return 0;
 }
@@ -151,11 +269,10 @@ unsigned int oliver_range_func(struct bpf_xrp *context) {
         case RNG_TRAVERSE:
             return traverse_index(context, query, node);
         case RNG_READ_NODE:
-            query->_current_node = *node;
             query->_state = RNG_RESUME;
             /* FALL THROUGH */
         case RNG_RESUME:
-            return process_leaf(context, query, node);
+            return leaf_read(context, query, node);
         case RNG_READ_VALUE:
             return process_value(context, query);
         default:
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "xrp_emu.h"
+#include "xrp-bpf/emu.h"
+
+/* Entry points of the natively compiled programs in xrp-bpf/ */
+unsigned int oliver_agg_func(struct bpf_xrp *context);
+unsigned int oliver_range_func(struct bpf_xrp *context);
+
+/* Totals across all threads */
+static struct XrpEmuStats emu_stats;
+
+static inline size_t elapsed_ns(struct timespec const *start, struct timespec const *end) {
+    return 1000000000L * (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Emulates the XRP read syscall: read [size] bytes at [offset] into [buf], run the
+ * program and keep resubmitting reads at context->next_addr[0] until it sets done.
+ *
+ * @return bytes read by the last I/O on success, -1 with errno set on failure
+ */
+long xrp_emu_read(int db_fd, char *buf, size_t size, long offset, int bpf_fd, char *scratch) {
+    unsigned int (*prog)(struct bpf_xrp *) = bpf_fd == XRP_EMU_RANGE ? oliver_range_func : oliver_agg_func;
+    struct bpf_xrp context = { .data = buf, .scratch = scratch };
+    struct timespec t0, t1, t2;
+    size_t hops = 0, io_ns = 0, prog_ns = 0;
+    long ret = -1;
+
+    for (;;) {
+        if (hops == XRP_EMU_MAX_HOPS) {
+            errno = ELOOP;
+            goto out;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ssize_t bytes_read = pread(db_fd, buf, size, offset);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (bytes_read != (ssize_t) size) {
+            if (bytes_read >= 0) {
+                errno = EIO;
+            }
+            goto out;
+        }
+        ++hops;
+
+        context.done = 0;
+        context.next_addr[0] = 0;
+        context.size[0] = 0;
+        unsigned int prog_ret = prog(&context);
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        io_ns += elapsed_ns(&t0, &t1);
+        prog_ns += elapsed_ns(&t1, &t2);
+
+        if (prog_ret != 0) {
+            errno = EINVAL;
+            goto out;
+        }
+        if (context.done || context.size[0] == 0) {
+            ret = bytes_read;
+            goto out;
+        }
+        offset = (long) context.next_addr[0];
+        size = context.size[0];
+    }
+
+out:
+    __atomic_fetch_add(&emu_stats.calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&emu_stats.hops, hops, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&emu_stats.io_ns, io_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&emu_stats.prog_ns, prog_ns, __ATOMIC_RELAXED);
+    return ret;
+}
+
+void xrp_emu_get_stats(struct XrpEmuStats *stats) {
+    stats->calls = __atomic_load_n(&emu_stats.calls, __ATOMIC_RELAXED);
+    stats->hops = __atomic_load_n(&emu_stats.hops, __ATOMIC_RELAXED);
+    stats->io_ns = __atomic_load_n(&emu_stats.io_ns, __ATOMIC_RELAXED);
+    stats->prog_ns = __atomic_load_n(&emu_stats.prog_ns, __ATOMIC_RELAXED);
+}
+
+/* Print resubmission counts and the per-hop cost model */
+void xrp_emu_print_stats(size_t n_queries) {
+    struct XrpEmuStats st;
+    xrp_emu_get_stats(&st);
+    if (st.calls == 0 || st.hops == 0 || n_queries == 0) {
+        return;
+    }
+    printf("XRP emulator: %lu calls, %lu hops, %.2f hops/query, %.2f hops/call\n",
+           st.calls, st.hops, (double) st.hops / n_queries, (double) st.hops / st.calls);
+    printf("XRP emulator per hop: read %.3f usec, program %.3f usec\n",
+           (double) st.io_ns / st.hops / 1000, (double) st.prog_ns / st.hops / 1000);
+}
@@ -0,0 +1,37 @@
+#ifndef _XRP_EMU_H_
+#define _XRP_EMU_H_
+
+#include <stddef.h>
+
+/*
+ * Userspace XRP emulator
+ *
+ * Runs the natively compiled XRP programs from xrp-bpf/ and performs their
+ * resubmissions with regular (O_DIRECT) reads. Emulated programs are selected
+ * with pseudo BPF file descriptors so that they can be passed wherever a loaded
+ * program's fd is expected.
+ */
+#define XRP_EMU_GET   (-2)
+#define XRP_EMU_RANGE (-3)
+
+/* Upper bound on resubmissions per call; guards against programs that never set done */
+#define XRP_EMU_MAX_HOPS 4096
+
+static inline int is_xrp_emu_fd(int bpf_fd) {
+    return bpf_fd == XRP_EMU_GET || bpf_fd == XRP_EMU_RANGE;
+}
+
+struct XrpEmuStats {
+    size_t calls;
+    size_t hops;
+    size_t io_ns;
+    size_t prog_ns;
+};
+
+long xrp_emu_read(int db_fd, char *buf, size_t size, long offset, int bpf_fd, char *scratch);
+
+void xrp_emu_get_stats(struct XrpEmuStats *stats);
+
+void xrp_emu_print_stats(size_t n_queries);
+
+#endif /* _XRP_EMU_H_ */